@@ -6,25 +6,108 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <memory>
 #include <cmath>
 #include <set>
 #include <exception>
+#include <unordered_map>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <functional>
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+#include <chrono>
+#include <iomanip>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <sstream>
+#include <future>
+#include <cctype>
+#include <map>
+#include <tuple>
+#include <random>
+#include <cerrno>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
 
 using namespace std;
 
-int streamcounter = 0; ///< Global variable to keep track of stream creation.
-
 const int MIXER_OUTPUTS = 1;
 const float POSSIBLE_ERROR = 0.01;
 
+// ============ СЧЕТЧИК ВЫДЕЛЕНИЙ ПАМЯТИ ============
+atomic<size_t> heapAllocations{0}; ///< Сколько раз вызывался глобальный operator new
+atomic<size_t> heapBytes{0};       ///< Сколько байт запрошено через глобальный operator new
+
+// Глобальный operator new подменяется только в сборках тестов и бенчмарков (make, make bench):
+// атомарное сложение на каждом выделении исказило бы замеры release, LTO, PGO и perf-check.
+// Без -DDEVICE_COUNT_ALLOCATIONS счетчики остаются нулевыми.
+#ifdef DEVICE_COUNT_ALLOCATIONS
+constexpr bool COUNTING_ALLOCATIONS = true;
+
+// Замены не встраиваются: иначе GCC видит free() указателя из new и выдает -Wmismatched-new-delete
+#if defined(__GNUC__)
+#define DEVICE_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define DEVICE_NOINLINE __declspec(noinline)
+#else
+#define DEVICE_NOINLINE
+#endif
+
+DEVICE_NOINLINE void* operator new(size_t size) {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    heapBytes.fetch_add(size, memory_order_relaxed);
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+// Без исключений (буферы stable_sort и т.п.) - тоже через malloc, чтобы пара с delete совпадала
+DEVICE_NOINLINE void* operator new(size_t size, const nothrow_t&) noexcept {
+    heapAllocations.fetch_add(1, memory_order_relaxed);
+    heapBytes.fetch_add(size, memory_order_relaxed);
+    return malloc(size ? size : 1);
+}
+
+DEVICE_NOINLINE void operator delete(void* p) noexcept { free(p); }
+DEVICE_NOINLINE void operator delete(void* p, size_t) noexcept { free(p); }
+DEVICE_NOINLINE void operator delete(void* p, const nothrow_t&) noexcept { free(p); }
+#else
+constexpr bool COUNTING_ALLOCATIONS = false;
+#endif
+
 // ============ ПРЕДВАРИТЕЛЬНЫЕ ОБЪЯВЛЕНИЯ ============
 class Stream;
 class Device;
 class Mixer;
 class Reactor;
 class RecycleException;
+class ConvergenceException;
+class SolveCancelledException;
+class Flowsheet;
 void testRecycleDetectionOnCalculatedDevice();
 void testRecycleWithMultipleDevices();
 void testRecycleWithMixer();
@@ -35,18 +118,91 @@ void testRecycleWithMixer();
  * @brief Исключение для обнаружения рецикла
  */
 class RecycleException : public exception {
+private:
+    string_view deviceType;   ///< Строка из getDeviceType() - статическая
+    string streamName;
+    mutable string message;   ///< Формируется при первом what()
+public:
+    RecycleException(string_view type, const string& stream) : deviceType(type), streamName(stream) {}
+
+    const char* what() const noexcept override {
+        if (message.empty()) {
+            try {
+                message.append("RECYCLE DETECTED: ").append(deviceType)
+                       .append(" has calculated output stream ").append(streamName);
+            } catch (...) {
+                return "RECYCLE DETECTED";
+            }
+        }
+        return message.c_str();
+    }
+};
+
+/**
+ * @class ConvergenceException
+ * @brief Исключение: контур рецикла не сошелся за допустимое число итераций
+ */
+class ConvergenceException : public exception {
 private:
     string message;
 public:
-    explicit RecycleException(const string& deviceType, const string& streamName) {
-        message = "RECYCLE DETECTED: " + deviceType + " has calculated output stream " + streamName;
+    ConvergenceException(const string& streamName, int iterations) {
+        message = "RECYCLE NOT CONVERGED: tear stream " + streamName + " after " +
+                  to_string(iterations) + " iterations";
     }
-    
+
     const char* what() const noexcept override {
         return message.c_str();
     }
 };
 
+/**
+ * @class SolveCancelledException
+ * @brief Исключение: расчет остановлен через SolveControl (отмена или истек срок)
+ */
+class SolveCancelledException : public exception {
+private:
+    bool expired;
+public:
+    explicit SolveCancelledException(bool deadlineExpired) : expired(deadlineExpired) {}
+
+    bool isDeadline() const { return expired; }
+
+    const char* what() const noexcept override {
+        return expired ? "SOLVE DEADLINE EXPIRED" : "SOLVE CANCELLED";
+    }
+};
+
+// ============ КОДЫ ОШИБОК DeviceError ============
+/**
+ * @brief Ошибки устройств для API без исключений (tryAddInput, validate, tryUpdateOutputs)
+ */
+enum class DeviceError {
+    None,             ///< Ошибки нет
+    InputLimit,       ///< Все входы уже заняты
+    OutputLimit,      ///< Все выходы уже заняты
+    NoInput,          ///< Не подключен вход
+    NoOutputs,        ///< Не подключены выходы
+    WrongOutputCount, ///< Подключено не то число выходов
+    Recycle           ///< Устройство уже рассчитано
+};
+
+/**
+ * @brief Текст ошибки - тот же, что бросают методы с исключениями
+ */
+inline const char* describe(DeviceError error) {
+    switch (error) {
+        case DeviceError::None: return "OK";
+        case DeviceError::InputLimit: return "INPUT STREAM LIMIT!";
+        case DeviceError::OutputLimit: return "OUTPUT STREAM LIMIT!";
+        case DeviceError::NoInput: return "No input stream";
+        case DeviceError::NoOutputs: return "Should set outputs before update";
+        case DeviceError::WrongOutputCount: return "Wrong number of outputs";
+        case DeviceError::Recycle: return "RECYCLE DETECTED";
+    }
+    return "Unknown error";
+}
+
 // ============ БАЗОВЫЙ КЛАСС CalculatedDevice ============
 /**
  * @class CalculatedDevice
@@ -54,7 +210,7 @@ public:
  */
 class CalculatedDevice {
 protected:
-    bool calculated = false;  ///< Признак: true - аппарат рассчитан, false - не рассчитан
+    atomic<bool> calculated{false};  ///< Признак: true - аппарат рассчитан, false - не рассчитан (безопасен при параллельном расчете)
     
 public:
     CalculatedDevice() = default;
@@ -64,529 +220,9617 @@ public:
      * @brief Установить признак "рассчитан"
      * @param calc true - рассчитан, false - не рассчитан
      */
-    virtual void setCalculated(bool calc) { calculated = calc; }
+    virtual void setCalculated(bool calc) { calculated.store(calc, memory_order_release); }
     
     /**
      * @brief Получить признак "рассчитан"
      * @return true - рассчитан, false - не рассчитан
      */
-    virtual bool isCalculated() const { return calculated; }
+    virtual bool isCalculated() const { return calculated.load(memory_order_acquire); }
     
     /**
      * @brief Виртуальный метод для получения имени типа устройства
+     * @return Строка со статическим временем жизни (литерал) - без выделения памяти
      */
-    virtual string getDeviceType() const = 0;
+    virtual string_view getDeviceType() const = 0;
 };
 
-// ============ КЛАСС Stream ============
+// ============ КЛАСС StreamTable ============
+using StreamId = uint32_t; ///< Компактный номер потока в StreamTable
+
 /**
- * @class Stream
- * @brief Represents a chemical stream with a name and mass flow.
+ * @brief Автоматическое имя потока "s<номер>" (строится только по запросу: печать, ошибки)
  */
-class Stream
+inline string streamName(uint32_t number) { return "s" + to_string(number); }
+
+/**
+ * @brief Разобрать автоматическое имя "s<номер>" без ведущих нулей, номер меньше 2^31
+ * @return false для любого другого имени
+ */
+inline bool parseStreamName(const string& name, uint32_t& number) {
+    if (name.size() < 2 || name.size() > 11 || name[0] != 's' || (name[1] == '0' && name.size() > 2)) {
+        return false;
+    }
+    uint64_t value = 0;
+    for (size_t i = 1; i < name.size(); i++) {
+        if (!isdigit(static_cast<unsigned char>(name[i]))) {
+            return false;
+        }
+        value = value * 10 + (name[i] - '0');
+    }
+    if (value >= 0x80000000u) {
+        return false;
+    }
+    number = value;
+    return true;
+}
+
+/**
+ * @class StreamTable
+ * @brief Хранилище потоков схемы в виде структуры массивов.
+ *
+ * Массовые расходы всех потоков лежат подряд в одном vector<double>, имена вынесены
+ * в отдельную таблицу интернированных строк. Устройства обращаются к потокам по StreamId.
+ *
+ * В пакетном режиме у каждого потока caseCount() расходов - по одному на вариант
+ * расчета. Варианты одного потока лежат подряд (строка row(id)), и ядра устройств
+ * обрабатывают их одним векторизуемым циклом.
+ *
+ * Многокомпонентный поток (setComponentCount) хранит в каждом варианте общий расход
+ * и за ним расходы компонентов: вариант c занимает дорожки [c * stride, (c + 1) * stride).
+ * Общий расход всегда равен сумме компонентов. Линейные ядра (смешение, деление)
+ * обрабатывают все laneCount() дорожек одинаково и про компоненты не знают.
+ */
+class StreamTable
 {
 private:
-    double mass_flow = 0.0; ///< The mass flow rate of the stream.
-    string name;      ///< The name of the stream.
+    vector<double> massFlows;              ///< Дорожка k потока id - massFlows[id * width + k]
+    size_t width = 1;                      ///< Дорожек в строке: cases * stride
+    size_t cases = 1;                      ///< Количество вариантов расчета
+    size_t stride = 1;                     ///< Дорожек на вариант: 1 + число компонентов
+    static constexpr uint32_t CUSTOM_NAME = 0x80000000u;
+    vector<uint32_t> nameIds;              ///< Номер автоматического имени "s<n>" или CUSTOM_NAME | номер в names
+    vector<string> names;                  ///< Интернированные имена, заданные явно
+    unordered_map<string, uint32_t> nameIndex;
+    vector<uint8_t> dirtyFlags;            ///< 1 - расход задан извне после последнего расчета
+    vector<StreamId> dirtyList;            ///< Измененные потоки в порядке изменения
+
+    void markDirty(StreamId id) {
+        if (!dirtyFlags[id]) {
+            dirtyFlags[id] = 1;
+            dirtyList.push_back(id);
+        }
+    }
 
-public:
     /**
-     * @brief Constructor to create a Stream with a unique name.
-     * @param s An integer used to generate a unique name for the stream.
+     * @brief Задать общий расход варианта, сохранив состав (пустой поток - весь в компонент 0)
      */
-    Stream(int s) { 
-        setName("s" + std::to_string(s)); 
+    void setCaseTotal(double* lanes, double m) {
+        double total = lanes[0];
+        lanes[0] = m;
+        if (stride == 1) {
+            return;
+        }
+        if (total != 0.0) {
+            double scale = m / total;
+            for (size_t j = 1; j < stride; j++) {
+                lanes[j] *= scale;
+            }
+        } else {
+            fill_n(lanes + 1, stride - 1, 0.0);
+            lanes[1] = m;
+        }
     }
 
     /**
-     * @brief Set the name of the stream.
-     * @param s The new name for the stream.
+     * @brief Переложить строки таблицы под новое число вариантов и компонентов
+     *
+     * Существующие варианты сохраняются, новые получают значения варианта 0; новые
+     * компоненты пусты, а если компонентов не было - весь расход попадает в компонент 0.
      */
-    void setName(string s) { name = s; }
+    void relayout(size_t newCases, size_t newStride) {
+        size_t newWidth = newCases * newStride;
+        vector<double> resized(size() * newWidth, 0.0);
+        for (size_t id = 0; id < size(); id++) {
+            const double* source = massFlows.data() + id * width;
+            double* target = resized.data() + id * newWidth;
+            for (size_t c = 0; c < newCases; c++) {
+                const double* from = source + (c < cases ? c : 0) * stride;
+                double* lanes = target + c * newStride;
+                if (stride == 1 && newStride > 1) {
+                    lanes[0] = lanes[1] = from[0];
+                } else {
+                    copy_n(from, min(stride, newStride), lanes);
+                }
+            }
+        }
+        massFlows.swap(resized);
+        cases = newCases;
+        stride = newStride;
+        width = newWidth;
+    }
+
+    uint32_t intern(const string& name) {
+        auto it = nameIndex.find(name);
+        if (it != nameIndex.end()) {
+            return it->second;
+        }
+        uint32_t id = names.size();
+        names.push_back(name);
+        nameIndex.emplace(name, id);
+        return id;
+    }
+
+    uint32_t nameTag(const string& name) {
+        uint32_t number;
+        return parseStreamName(name, number) ? number : CUSTOM_NAME | intern(name);
+    }
+
+    StreamId addTagged(uint32_t tag, double massFlow) {
+        StreamId id = nameIds.size();
+        massFlows.resize(massFlows.size() + width, 0.0);
+        for (size_t c = 0; c < cases; c++) {
+            setCaseTotal(massFlows.data() + id * width + c * stride, massFlow);
+        }
+        nameIds.push_back(tag);
+        dirtyFlags.push_back(0);
+        return id;
+    }
 
+public:
     /**
-     * @brief Get the name of the stream.
-     * @return The name of the stream.
+     * @brief Добавить поток
+     * @param name Имя потока (автоматические имена "s<n>" хранятся одним номером)
+     * @param massFlow Начальный массовый расход
+     * @return Номер потока
      */
-    string getName() { return name; }
+    StreamId add(const string& name, double massFlow = 0.0) {
+        return addTagged(nameTag(name), massFlow);
+    }
 
     /**
-     * @brief Set the mass flow rate of the stream.
-     * @param m The new mass flow rate value.
+     * @brief Добавить поток с автоматическим именем "s<number>", не строя строку
+     * @throws string если номер не меньше 2^31 (такое имя не хранится номером)
      */
-    void setMassFlow(double m) { mass_flow = m; }
+    StreamId addNumbered(uint32_t number, double massFlow = 0.0) {
+        if (number & CUSTOM_NAME) {
+            throw string("Stream number out of range");
+        }
+        return addTagged(number, massFlow);
+    }
+
+    size_t size() const { return nameIds.size(); }
 
     /**
-     * @brief Get the mass flow rate of the stream.
-     * @return The mass flow rate of the stream.
+     * @brief Количество хранимых строк имен (автоматические имена строк не занимают)
      */
-    double getMassFlow() const { return mass_flow; }
+    size_t nameCount() const { return names.size(); }
 
     /**
-     * @brief Print information about the stream.
+     * @brief Память строк таблицы в байтах: расходы, имена, признаки изменения
      */
-    void print() { cout << "Stream " << getName() << " flow = " << getMassFlow() << endl; }
-};
-
-// ============ КЛАСС Device ============
-/**
- * @class Device
- * @brief Represents a device that manipulates chemical streams.
- */
-class Device : public CalculatedDevice
-{
-protected:
-    vector<shared_ptr<Stream>> inputs;  ///< Input streams connected to the device.
-    vector<shared_ptr<Stream>> outputs; ///< Output streams produced by the device.
-    int inputAmount = 0;
-    int outputAmount = 0;
-    
-public:
-    Device() : CalculatedDevice() {} 
-    virtual ~Device() = default;
+    size_t memoryBytes() const {
+        size_t bytes = massFlows.capacity() * sizeof(double) + nameIds.capacity() * sizeof(uint32_t) +
+                       dirtyFlags.capacity() + dirtyList.capacity() * sizeof(StreamId);
+        for (const string& name : names) {
+            bytes += sizeof(string) + name.capacity();
+        }
+        return bytes;
+    }
 
-    string getDeviceType() const override { return "Device"; }
-    
     /**
-     * @brief Add an input stream to the device.
-     * @param s A shared pointer to the input stream.
+     * @brief Задать количество вариантов расчета
+     *
+     * Каждый новый вариант получает расходы варианта 0.
      */
-    virtual void addInput(shared_ptr<Stream> s) {
-        if (inputAmount > 0 && inputs.size() >= inputAmount) {
-            throw string("INPUT STREAM LIMIT!");
+    void setCaseCount(size_t count) {
+        count = max<size_t>(count, 1);
+        if (count != cases) {
+            relayout(count, stride);
         }
-        inputs.push_back(s);
     }
-    
+
+    size_t caseCount() const { return cases; }
+
     /**
-     * @brief Add an output stream to the device.
-     * @param s A shared pointer to the output stream.
+     * @brief Задать число компонентов (0 - только общий расход)
+     *
+     * Если компонентов не было, текущий расход становится расходом компонента 0.
      */
-    virtual void addOutput(shared_ptr<Stream> s) {
-        if (outputAmount > 0 && outputs.size() >= outputAmount) {
-            throw string("OUTPUT STREAM LIMIT!");
+    void setComponentCount(size_t count) {
+        if (count + 1 != stride) {
+            relayout(cases, count + 1);
         }
-        outputs.push_back(s);
     }
 
-    // Геттеры для доступа к protected полям
-    const vector<shared_ptr<Stream>>& getInputs() const { return inputs; }
-    const vector<shared_ptr<Stream>>& getOutputs() const { return outputs; }
-    
-    // Методы для получения количества потоков
-    int getInputCount() const { return inputs.size(); }
-    int getOutputCount() const { return outputs.size(); }
+    size_t componentCount() const { return stride - 1; }
 
     /**
-     * @brief Update the output streams of the device (to be implemented by derived classes).
+     * @brief Дорожек в строке потока: caseCount() * (componentCount() + 1)
      */
-    virtual void updateOutputs() {
-        checkForRecycle();  // Проверка перед обновлением
-    }
+    size_t laneCount() const { return width; }
 
     /**
-     * @brief Проверка на рецикл перед обновлением выходов
-     * @throws RecycleException если обнаружен рецикл
+     * @brief Расход потока в варианте 0
      */
-    virtual void checkForRecycle() {
-        for (const auto& output : outputs) {
-            if (isCalculated()) {
-                throw RecycleException(getDeviceType(), output->getName());
+    double massFlow(StreamId id) const { return massFlows[id * width]; }
+
+    /**
+     * @brief Задать расход потока сразу во всех вариантах и пометить поток измененным
+     *
+     * Состав многокомпонентного потока сохраняется, компоненты масштабируются.
+     */
+    void setMassFlow(StreamId id, double m) {
+        if (stride == 1) {
+            fill_n(row(id), width, m);
+        } else {
+            for (size_t c = 0; c < cases; c++) {
+                setCaseTotal(row(id) + c * stride, m);
             }
         }
+        markDirty(id);
     }
-};
 
-// ============ КЛАСС Mixer ============
-class Mixer : public Device
-{
-private:
-    int _inputs_count = 0;
-    
-public:
-    Mixer(int inputs_count) : Device() {
-        _inputs_count = inputs_count;
-        inputAmount = inputs_count;
-        outputAmount = MIXER_OUTPUTS;
+    double massFlow(StreamId id, size_t c) const { return massFlows[id * width + c * stride]; }
+    void setMassFlow(StreamId id, size_t c, double m) {
+        setCaseTotal(row(id) + c * stride, m);
+        markDirty(id);
     }
-    
-    string getDeviceType() const override { return "Mixer"; }
-    
-    void addInput(shared_ptr<Stream> s) override {
-        if (inputs.size() >= _inputs_count) {
-            throw string("Too much inputs");
-        }
-        inputs.push_back(s);
+
+    double componentFlow(StreamId id, size_t c, size_t j) const {
+        return massFlows[id * width + c * stride + 1 + j];
     }
-    
-    void addOutput(shared_ptr<Stream> s) override {
-        if (outputs.size() >= MIXER_OUTPUTS) {
-            throw string("Too much outputs");
+
+    /**
+     * @brief Задать расход компонента j в варианте c; общий расход пересчитывается
+     */
+    void setComponentFlow(StreamId id, size_t c, size_t j, double m) {
+        double* lanes = row(id) + c * stride;
+        lanes[1 + j] = m;
+        double total = 0;
+        for (size_t k = 1; k < stride; k++) {
+            total += lanes[k];
         }
-        outputs.push_back(s);
+        lanes[0] = total;
+        markDirty(id);
     }
-    
-    void updateOutputs() override {
-        checkForRecycle();  
-        double sum_mass_flow = 0;
-        for (const auto& input_stream : inputs) {
-            sum_mass_flow += input_stream->getMassFlow();
-        }
 
-        if (outputs.empty()) {
-            throw string("Should set outputs before update");
-        }
+    /**
+     * @brief Пометить поток измененным, не меняя расходов (изменились параметры потребителя)
+     */
+    void touch(StreamId id) { markDirty(id); }
 
-        double output_mass = sum_mass_flow / outputs.size();
+    /**
+     * @brief Потоки, измененные через setMassFlow() после последнего clearDirty()
+     *
+     * Ядра устройств пишут в row() напрямую и потоки не помечают.
+     */
+    const vector<StreamId>& dirtyStreams() const { return dirtyList; }
+    bool isDirty(StreamId id) const { return dirtyFlags[id] != 0; }
 
-        for (auto& output_stream : outputs) {
-            output_stream->setMassFlow(output_mass);
+    void clearDirty() {
+        for (StreamId id : dirtyList) {
+            dirtyFlags[id] = 0;
         }
+        dirtyList.clear();
+    }
 
-        setCalculated(true);  // После успешного обновления помечаем как рассчитанный
+    /**
+     * @brief Имя потока; автоматическое имя строится при каждом вызове
+     */
+    string name(StreamId id) const {
+        uint32_t tag = nameIds[id];
+        return (tag & CUSTOM_NAME) ? names[tag & ~CUSTOM_NAME] : streamName(tag);
     }
+    void setName(StreamId id, const string& name) { nameIds[id] = nameTag(name); }
+
+    /**
+     * @brief Непрерывный массив расходов для расчетных ядер
+     */
+    double* data() { return massFlows.data(); }
+    const double* data() const { return massFlows.data(); }
+
+    /**
+     * @brief Все дорожки потока (laneCount() значений подряд)
+     */
+    double* row(StreamId id) { return massFlows.data() + id * width; }
+    const double* row(StreamId id) const { return massFlows.data() + id * width; }
 };
 
-// ============ КЛАСС Reactor ============
-class Reactor : public Device {
-public:
-    Reactor(bool isDoubleReactor) : Device() {
-        inputAmount = 1;
-        outputAmount = isDoubleReactor ? 2 : 1;
-    }
+// ============ ВЕКТОРИЗОВАННЫЕ ЯДРА ============
+constexpr size_t LANE_BLOCK = 8; ///< Вариантов за один шаг ядра (один регистр AVX-512 или два AVX2)
 
-    string getDeviceType() const override { return "Reactor"; }
-    
-    void updateOutputs() override {
-        checkForRecycle();
-        if (inputs.empty()) {
-            throw string("No input stream");
-        }
-        if (outputs.size() != outputAmount) {
-            throw string("Wrong number of outputs");
+/**
+ * @brief out_j[k] = scale * sum_i in_i[k] для всех дорожек k (варианты и компоненты)
+ *
+ * Варианты обрабатываются блоками по LANE_BLOCK: все входы блока читаются до записи
+ * выходов, поэтому выход может совпадать со входом. Циклы фиксированной длины
+ * компилятор разворачивает в SIMD-инструкции.
+ */
+inline void sumLanes(StreamTable& table, const StreamId* in, size_t inCount,
+                     const StreamId* out, size_t outCount, double scale) {
+    const size_t width = table.laneCount();
+    if (width == 1) {
+        double* flow = table.data();
+        double sum = 0;
+        for (size_t i = 0; i < inCount; i++) {
+            sum += flow[in[i]];
         }
-        
-        double inputMass = inputs.at(0)->getMassFlow();
-        for (int i = 0; i < outputAmount; i++) {
-            double outputLocal = inputMass / outputAmount;
-            outputs.at(i)->setMassFlow(outputLocal);
+        for (size_t j = 0; j < outCount; j++) {
+            flow[out[j]] = sum * scale;
         }
-        setCalculated(true);
+        return;
     }
-};
-
-// ============ ТЕСТЫ ДЛЯ MIXER ============
-void shouldSetOutputsCorrectlyWithOneOutput() {
-    streamcounter = 0;
-    Mixer d1(2);
-    
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
-
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
 
-    d1.updateOutputs();
-
-    if (abs(s3->getMassFlow() - 15.0) < POSSIBLE_ERROR) {
-        cout << "Test 1 passed" << endl;
-    } else {
-        cout << "Test 1 failed" << endl;
+    for (size_t k = 0; k < width; k += LANE_BLOCK) {
+        double acc[LANE_BLOCK] = {};
+        if (k + LANE_BLOCK <= width) {
+            for (size_t i = 0; i < inCount; i++) {
+                const double* src = table.row(in[i]) + k;
+                for (size_t l = 0; l < LANE_BLOCK; l++) {
+                    acc[l] += src[l];
+                }
+            }
+            for (size_t j = 0; j < outCount; j++) {
+                double* dst = table.row(out[j]) + k;
+                for (size_t l = 0; l < LANE_BLOCK; l++) {
+                    dst[l] = acc[l] * scale;
+                }
+            }
+        } else {
+            size_t tail = width - k;
+            for (size_t i = 0; i < inCount; i++) {
+                const double* src = table.row(in[i]) + k;
+                for (size_t l = 0; l < tail; l++) {
+                    acc[l] += src[l];
+                }
+            }
+            for (size_t j = 0; j < outCount; j++) {
+                double* dst = table.row(out[j]) + k;
+                for (size_t l = 0; l < tail; l++) {
+                    dst[l] = acc[l] * scale;
+                }
+            }
+        }
     }
 }
 
-void shouldCorrectOutputs() {
-    streamcounter = 0;
-    Mixer d1(2);
-    
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    auto s4 = make_shared<Stream>(++streamcounter);
+/**
+ * @brief out_j[k] = fractions[j] * in[k] для всех дорожек k
+ *
+ * Вход читается блоком до записи выходов, поэтому выход может совпадать со входом.
+ */
+inline void splitLanes(StreamTable& table, StreamId in, const StreamId* out, const double* fractions,
+                       size_t outCount) {
+    const size_t width = table.laneCount();
+    if (width == 1) {
+        double* flow = table.data();
+        const double feed = flow[in];
+        for (size_t j = 0; j < outCount; j++) {
+            flow[out[j]] = feed * fractions[j];
+        }
+        return;
+    }
+
+    for (size_t k = 0; k < width; k += LANE_BLOCK) {
+        double src[LANE_BLOCK];
+        if (k + LANE_BLOCK <= width) {
+            copy_n(table.row(in) + k, LANE_BLOCK, src);
+            for (size_t j = 0; j < outCount; j++) {
+                double* dst = table.row(out[j]) + k;
+                const double f = fractions[j];
+                for (size_t l = 0; l < LANE_BLOCK; l++) {
+                    dst[l] = src[l] * f;
+                }
+            }
+        } else {
+            size_t tail = width - k;
+            copy_n(table.row(in) + k, tail, src);
+            for (size_t j = 0; j < outCount; j++) {
+                double* dst = table.row(out[j]) + k;
+                const double f = fractions[j];
+                for (size_t l = 0; l < tail; l++) {
+                    dst[l] = src[l] * f;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Превратить компоненты входа по матрице и поделить результат между выходами
+ *
+ * В каждом варианте p_j = sum_i M[j][i] * f_i, общий расход выхода - scale * sum_j p_j.
+ * Матрица хранится по столбцам (columns[i * n + j] = M[j][i]): внутренний цикл -
+ * axpy по компонентам, он векторизуется без -ffast-math. Вход читается целиком до
+ * записи выходов, поэтому выход может совпадать со входом.
+ * @param product Рабочий буфер на componentCount() значений
+ */
+inline void convertLanes(StreamTable& table, StreamId in, const StreamId* out, size_t outCount,
+                         const double* columns, double* product, double scale) {
+    const size_t n = table.componentCount();
+    const size_t stride = n + 1;
+    for (size_t c = 0; c < table.caseCount(); c++) {
+        const double* feed = table.row(in) + c * stride + 1;
+        fill_n(product, n, 0.0);
+        for (size_t i = 0; i < n; i++) {
+            const double f = feed[i];
+            const double* column = columns + i * n;
+            for (size_t j = 0; j < n; j++) {
+                product[j] += f * column[j];
+            }
+        }
+        double total = 0;
+        for (size_t j = 0; j < n; j++) {
+            total += product[j];
+        }
+        for (size_t o = 0; o < outCount; o++) {
+            double* lanes = table.row(out[o]) + c * stride;
+            lanes[0] = total * scale;
+            for (size_t j = 0; j < n; j++) {
+                lanes[1 + j] = product[j] * scale;
+            }
+        }
+    }
+}
+
+// ============ КЛАСС Stream ============
+/**
+ * @class Stream
+ * @brief Represents a chemical stream with a name and mass flow.
+ */
+class Stream
+{
+private:
+    static constexpr uint32_t CUSTOM = UINT32_MAX; ///< number для имени из customName
+
+    double mass_flow = 0.0; ///< The mass flow rate of the stream.
+    StreamTable* table = nullptr; ///< Flowsheet storage holding the data while bound.
+    StreamId id = 0;              ///< Index of the stream in the bound table.
+    uint32_t number = CUSTOM;     ///< Automatic name "s<number>" of an unbound stream.
+    unique_ptr<string> customName; ///< Explicit name of an unbound stream (number == CUSTOM), else empty.
+
+    void setLocalName(const string& s) {
+        if (parseStreamName(s, number)) {
+            customName.reset();
+        } else {
+            number = CUSTOM;
+            customName = make_unique<string>(s);
+        }
+    }
+
+public:
+    /**
+     * @brief Constructor to create a Stream with a unique name.
+     * @param s A non-negative integer used to generate a unique name "s<s>"; only the number is stored.
+     * @throws string if s is negative.
+     */
+    Stream(int s) : number(uint32_t(s)) {
+        if (s < 0) {
+            throw string("Stream number must not be negative");
+        }
+    }
+
+    /**
+     * @brief Constructor to create a Stream with a given name.
+     * @param s The name of the stream.
+     */
+    explicit Stream(const string& s) { setLocalName(s); }
+
+    /**
+     * @brief Copy a stream; a bound copy refers to the same table row.
+     */
+    Stream(const Stream& other)
+        : mass_flow(other.mass_flow), table(other.table), id(other.id), number(other.number),
+          customName(other.customName ? make_unique<string>(*other.customName) : nullptr) {}
+
+    Stream& operator=(const Stream& other) {
+        if (this != &other) {
+            mass_flow = other.mass_flow;
+            table = other.table;
+            id = other.id;
+            number = other.number;
+            customName = other.customName ? make_unique<string>(*other.customName) : nullptr;
+        }
+        return *this;
+    }
+
+    /**
+     * @brief Set the name of the stream.
+     * @param s The new name for the stream.
+     */
+    void setName(const string& s) {
+        if (table) {
+            table->setName(id, s);
+        } else {
+            setLocalName(s);
+        }
+    }
+
+    /**
+     * @brief Get the name of the stream, built on demand for automatic names.
+     * @return The name of the stream.
+     */
+    string getName() const {
+        if (table) {
+            return table->name(id);
+        }
+        if (number != CUSTOM) {
+            return streamName(number);
+        }
+        return customName ? *customName : string();
+    }
+
+    /**
+     * @brief Set the mass flow rate of the stream.
+     * @param m The new mass flow rate value.
+     */
+    void setMassFlow(double m) {
+        if (table) {
+            table->setMassFlow(id, m);
+        } else {
+            mass_flow = m;
+        }
+    }
+
+    /**
+     * @brief Get the mass flow rate of the stream.
+     * @return The mass flow rate of the stream.
+     */
+    double getMassFlow() const { return table ? table->massFlow(id) : mass_flow; }
+
+    /**
+     * @brief Set the mass flow rate for one case of a batched flowsheet.
+     * @param c The case index (only case 0 exists for an unbound stream).
+     * @param m The new mass flow rate value.
+     */
+    void setCaseMassFlow(size_t c, double m) {
+        if (table) {
+            table->setMassFlow(id, c, m);
+        } else if (c == 0) {
+            mass_flow = m;
+        } else {
+            throw string("Stream is not batched");
+        }
+    }
+
+    /**
+     * @brief Get the mass flow rate for one case of a batched flowsheet.
+     * @param c The case index.
+     */
+    double getCaseMassFlow(size_t c) const {
+        if (table) {
+            return table->massFlow(id, c);
+        }
+        if (c != 0) {
+            throw string("Stream is not batched");
+        }
+        return mass_flow;
+    }
+
+    /**
+     * @brief Set the flow of one component in every case; the total flow follows.
+     * @param j The component index.
+     * @param m The new component flow.
+     */
+    void setComponentFlow(size_t j, double m) {
+        if (!table || j >= table->componentCount()) {
+            throw string("Stream has no such component");
+        }
+        for (size_t c = 0; c < table->caseCount(); c++) {
+            table->setComponentFlow(id, c, j, m);
+        }
+    }
+
+    /**
+     * @brief Get the flow of one component.
+     * @param j The component index.
+     * @param c The case index.
+     */
+    double getComponentFlow(size_t j, size_t c = 0) const {
+        if (!table || j >= table->componentCount()) {
+            throw string("Stream has no such component");
+        }
+        return table->componentFlow(id, c, j);
+    }
+
+    /**
+     * @brief Move the stream data into a table and keep only its index.
+     * @param t The table that will own the data.
+     */
+    void bind(StreamTable* t) {
+        id = number == CUSTOM ? t->add(customName ? *customName : string(), mass_flow)
+                              : t->addNumbered(number, mass_flow);
+        table = t;
+        customName.reset();
+    }
+
+    /**
+     * @brief Copy the data back from the table and detach from it.
+     */
+    void unbind() {
+        if (table) {
+            setLocalName(table->name(id));
+            mass_flow = table->massFlow(id);
+            table = nullptr;
+        }
+    }
+
+    /**
+     * @brief Mark the stream as changed, so solveIncremental() recalculates its consumers.
+     */
+    void markChanged() {
+        if (table) {
+            table->touch(id);
+        }
+    }
+
+    bool isBound() const { return table != nullptr; }
+    const StreamTable* getTable() const { return table; }
+    StreamId getId() const { return id; }
+
+    /**
+     * @brief Print information about the stream.
+     */
+    void print() { cout << "Stream " << getName() << " flow = " << getMassFlow() << endl; }
+};
+
+// ============ ИНТЕРФЕЙС TopologyListener ============
+/**
+ * @class TopologyListener
+ * @brief Получатель уведомлений об изменении связей устройства (addInput/addOutput)
+ *        и его параметров (доли делителя, матрица превращения)
+ */
+class TopologyListener {
+public:
+    virtual ~TopologyListener() = default;
+    virtual void onTopologyChanged() = 0;
+    virtual void onParametersChanged() = 0;
+};
+
+// ============ КЛАСС Device ============
+/**
+ * @class Device
+ * @brief Represents a device that manipulates chemical streams.
+ */
+class Device : public CalculatedDevice
+{
+protected:
+    vector<shared_ptr<Stream>> inputs;  ///< Input streams connected to the device.
+    vector<shared_ptr<Stream>> outputs; ///< Output streams produced by the device.
+    vector<StreamId> inputIds;          ///< Номера входных потоков в StreamTable схемы
+    vector<StreamId> outputIds;         ///< Номера выходных потоков в StreamTable схемы
+    int inputAmount = 0;
+    int outputAmount = 0;
+    TopologyListener* topologyListener = nullptr; ///< Владелец схемы, которому сообщаем о смене связей
+    bool recycleChecked = false;        ///< Рециклы уже найдены схемой по графу связей - проверка при расчете не нужна
+
+    /**
+     * @brief Вызывается после подключения нового входа или выхода
+     */
+    virtual void onPortsChanged() {}
+
+    /**
+     * @brief Сообщить владельцу схемы, что набор потоков устройства изменился
+     */
+    void notifyTopologyChanged() {
+        onPortsChanged();
+        if (topologyListener) {
+            topologyListener->onTopologyChanged();
+        }
+    }
+
+    /**
+     * @brief Сообщить, что параметры устройства изменились
+     *
+     * Входы помечаются измененными, чтобы solveIncremental() пересчитал устройство,
+     * а владелец схемы забывает все, что запомнил по старым параметрам.
+     */
+    void notifyParametersChanged() {
+        for (const auto& input : inputs) {
+            input->markChanged();
+        }
+        if (topologyListener) {
+            topologyListener->onParametersChanged();
+        }
+    }
     
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
+public:
+    Device() : CalculatedDevice() {} 
+    virtual ~Device() = default;
+
+    string_view getDeviceType() const override { return "Device"; }
+    
+    /**
+     * @brief Можно ли подключить еще один вход
+     */
+    virtual bool canAddInput() const { return inputAmount <= 0 || inputs.size() < size_t(inputAmount); }
+
+    /**
+     * @brief Можно ли подключить еще один выход
+     */
+    virtual bool canAddOutput() const { return outputAmount <= 0 || outputs.size() < size_t(outputAmount); }
+
+    /**
+     * @brief Подключить вход без исключений
+     * @return DeviceError::InputLimit если входы заняты
+     */
+    DeviceError tryAddInput(shared_ptr<Stream> s) {
+        if (!canAddInput()) {
+            return DeviceError::InputLimit;
+        }
+        inputs.push_back(s);
+        notifyTopologyChanged();
+        return DeviceError::None;
+    }
+
+    /**
+     * @brief Подключить выход без исключений
+     * @return DeviceError::OutputLimit если выходы заняты
+     */
+    DeviceError tryAddOutput(shared_ptr<Stream> s) {
+        if (!canAddOutput()) {
+            return DeviceError::OutputLimit;
+        }
+        outputs.push_back(s);
+        notifyTopologyChanged();
+        return DeviceError::None;
+    }
+
+    /**
+     * @brief Add an input stream to the device.
+     * @param s A shared pointer to the input stream.
+     */
+    virtual void addInput(shared_ptr<Stream> s) {
+        if (tryAddInput(s) != DeviceError::None) {
+            throw string("INPUT STREAM LIMIT!");
+        }
+    }
+    
+    /**
+     * @brief Add an output stream to the device.
+     * @param s A shared pointer to the output stream.
+     */
+    virtual void addOutput(shared_ptr<Stream> s) {
+        if (tryAddOutput(s) != DeviceError::None) {
+            throw string("OUTPUT STREAM LIMIT!");
+        }
+    }
+
+    /**
+     * @brief Проверить, что устройство готово к расчету
+     * @return Первая найденная ошибка подключения или DeviceError::None
+     */
+    virtual DeviceError validate() const { return DeviceError::None; }
+
+    /**
+     * @brief Обновить выходы без исключений
+     * @return Ошибка подключения, DeviceError::Recycle для уже рассчитанного устройства
+     */
+    DeviceError tryUpdateOutputs() {
+        if (isCalculated()) {
+            return DeviceError::Recycle;
+        }
+        DeviceError error = validate();
+        if (error == DeviceError::None) {
+            updateOutputs();
+        }
+        return error;
+    }
+
+    // Геттеры для доступа к protected полям
+    const vector<shared_ptr<Stream>>& getInputs() const { return inputs; }
+    const vector<shared_ptr<Stream>>& getOutputs() const { return outputs; }
+    
+    // Методы для получения количества потоков
+    int getInputCount() const { return inputs.size(); }
+    int getOutputCount() const { return outputs.size(); }
+
+    // Допустимое количество потоков (0 - без ограничения)
+    int getInputAmount() const { return inputAmount; }
+    int getOutputAmount() const { return outputAmount; }
+
+    /**
+     * @brief Подписать владельца схемы на изменения связей устройства
+     * @param listener Получатель уведомлений (nullptr - отписать)
+     */
+    void setTopologyListener(TopologyListener* listener) { topologyListener = listener; }
+
+    /**
+     * @brief Отметить, что рециклы с участием устройства найдены заранее по графу схемы
+     *
+     * Схема сама сбрасывает признаки рассчитанности перед каждым проходом и итерацией
+     * контура, поэтому checkForRecycle() для такого устройства ничего не проверяет.
+     */
+    void setRecycleChecked(bool checked) { recycleChecked = checked; }
+    bool isRecycleChecked() const { return recycleChecked; }
+
+    /**
+     * @brief Запомнить номера потоков в StreamTable (все потоки должны быть привязаны к таблице)
+     */
+    void bindPorts() {
+        inputIds.clear();
+        outputIds.clear();
+        for (const auto& input : inputs) {
+            inputIds.push_back(input->getId());
+        }
+        for (const auto& output : outputs) {
+            outputIds.push_back(output->getId());
+        }
+    }
+
+    const vector<StreamId>& getInputIds() const { return inputIds; }
+    const vector<StreamId>& getOutputIds() const { return outputIds; }
+
+    /**
+     * @brief Update the output streams of the device (to be implemented by derived classes).
+     */
+    virtual void updateOutputs() {
+        checkForRecycle();  // Проверка перед обновлением
+    }
+
+    /**
+     * @brief Обновить выходы по номерам потоков напрямую в таблице схемы
+     *
+     * По умолчанию идет через updateOutputs(): привязанные потоки и так читают таблицу.
+     * В пакетном режиме так считается только вариант 0 с копированием результата во все
+     * варианты - устройства с пакетной поддержкой переопределяют этот метод.
+     * @param table Таблица потоков, к которой привязаны порты (см. bindPorts)
+     */
+    virtual void updateTableOutputs(StreamTable& table) {
+        (void)table;
+        updateOutputs();
+    }
+
+    /**
+     * @brief Линейная модель устройства для расчета схемы как системы уравнений
+     *
+     * Выход o равен sum_i coefficients[o * getInputCount() + i] * вход i - во всех
+     * дорожках таблицы одинаково. Линейное устройство, по-разному смешивающее компоненты
+     * (реактор с матрицей превращения), в такую модель не укладывается.
+     * @return false если модель не одна на все дорожки или не задана (по умолчанию)
+     */
+    virtual bool linearize(vector<double>& coefficients) const {
+        (void)coefficients;
+        return false;
+    }
+
+    /**
+     * @brief updateTableOutputs() линеен и одинаково обрабатывает все дорожки таблицы
+     *
+     * Тогда варианты расчета можно использовать как касательные направления
+     * (Flowsheet::computeJacobian): производные распространяются теми же ядрами.
+     */
+    virtual bool propagatesTangents() const { return false; }
+
+    /**
+     * @brief Устройство с состоянием, меняющимся во времени (см. Flowsheet::step)
+     */
+    virtual bool isDynamic() const { return false; }
+
+    /**
+     * @brief Задать шаг времени текущего расчета (0 - стационарный расчет)
+     */
+    virtual void setTimeStep(double dt) { (void)dt; }
+
+    /**
+     * @brief Проинтегрировать состояние за шаг dt после расчета схемы (без выделения памяти)
+     */
+    virtual void advance(const StreamTable& table, double dt) {
+        (void)table;
+        (void)dt;
+    }
+
+    /**
+     * @brief Скорость накопления массы в дорожке lane за последний шаг advance()
+     *
+     * Для материального баланса: входы минус выходы равны накоплению. После
+     * стационарного расчета накопление нулевое.
+     */
+    virtual double accumulation(size_t lane) const {
+        (void)lane;
+        return 0.0;
+    }
+
+    /**
+     * @brief Проверка на рецикл перед обновлением выходов
+     * @throws RecycleException если обнаружен рецикл
+     */
+    virtual void checkForRecycle() {
+        if (!recycleChecked && isCalculated() && !outputs.empty()) {
+            throw RecycleException(getDeviceType(), outputs.front()->getName());
+        }
+    }
+};
+
+// ============ КЛАСС Mixer ============
+class Mixer : public Device
+{
+private:
+    int _inputs_count = 0;
+    
+public:
+    Mixer(int inputs_count) : Device() {
+        _inputs_count = inputs_count;
+        inputAmount = inputs_count;
+        outputAmount = MIXER_OUTPUTS;
+    }
+    
+    string_view getDeviceType() const override { return "Mixer"; }
+    
+    bool canAddInput() const override { return inputs.size() < size_t(_inputs_count); }
+    bool canAddOutput() const override { return outputs.size() < MIXER_OUTPUTS; }
+
+    void addInput(shared_ptr<Stream> s) override {
+        if (tryAddInput(s) != DeviceError::None) {
+            throw string("Too much inputs");
+        }
+    }
+    
+    void addOutput(shared_ptr<Stream> s) override {
+        if (tryAddOutput(s) != DeviceError::None) {
+            throw string("Too much outputs");
+        }
+    }
+
+    DeviceError validate() const override {
+        return outputs.empty() ? DeviceError::NoOutputs : DeviceError::None;
+    }
+    
+    void updateOutputs() override {
+        checkForRecycle();  
+        double sum_mass_flow = 0;
+        for (const auto& input_stream : inputs) {
+            sum_mass_flow += input_stream->getMassFlow();
+        }
+
+        if (outputs.empty()) {
+            throw string(describe(DeviceError::NoOutputs));
+        }
+
+        double output_mass = sum_mass_flow / outputs.size();
+
+        for (auto& output_stream : outputs) {
+            output_stream->setMassFlow(output_mass);
+        }
+
+        setCalculated(true);  // После успешного обновления помечаем как рассчитанный
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        if (outputIds.empty()) {
+            throw string(describe(DeviceError::NoOutputs));
+        }
+
+        sumLanes(table, inputIds.data(), inputIds.size(), outputIds.data(), outputIds.size(),
+                 1.0 / outputIds.size());
+        setCalculated(true);
+    }
+
+    bool linearize(vector<double>& coefficients) const override {
+        coefficients.assign(outputs.size() * inputs.size(), 1.0 / max<size_t>(outputs.size(), 1));
+        return true;
+    }
+
+    bool propagatesTangents() const override { return true; }
+};
+
+// ============ КЛАСС Reactor ============
+class Reactor : public Device {
+private:
+    vector<double> conversionColumns; ///< Матрица превращения по столбцам (пусто - без реакции)
+    vector<double> product;           ///< Рабочий буфер convertLanes()
+
+public:
+    Reactor(bool isDoubleReactor) : Device() {
+        inputAmount = 1;
+        outputAmount = isDoubleReactor ? 2 : 1;
+    }
+
+    /**
+     * @brief Задать стехиометрическую матрицу превращения компонентов
+     *
+     * Применяется при расчете в таблице схемы с тем же числом компонентов; без матрицы
+     * состав проходит через реактор без изменений. Схема узнает об изменении
+     * (notifyParametersChanged), и solveIncremental() пересчитывает реактор.
+     * @param matrix matrix[j * n + i] - доля компонента i питания, переходящая в компонент j
+     * @param n Число компонентов
+     * @throws string если в матрице не n * n элементов, есть отрицательные доли или доли
+     *         одного компонента питания не дают в сумме 1 (реактор не создает и не теряет массу)
+     */
+    void setConversion(const vector<double>& matrix, size_t n) {
+        if (matrix.size() != n * n) {
+            throw string("Conversion matrix must be n x n");
+        }
+        for (size_t i = 0; i < n; i++) {
+            double sum = 0;
+            for (size_t j = 0; j < n; j++) {
+                if (matrix[j * n + i] < 0) {
+                    throw string("Conversion fractions must not be negative");
+                }
+                sum += matrix[j * n + i];
+            }
+            if (abs(sum - 1.0) > 1e-9) {
+                throw string("Conversion fractions of each feed component must sum to 1");
+            }
+        }
+        conversionColumns.resize(n * n);
+        for (size_t j = 0; j < n; j++) {
+            for (size_t i = 0; i < n; i++) {
+                conversionColumns[i * n + j] = matrix[j * n + i];
+            }
+        }
+        product.assign(n, 0.0);
+        notifyParametersChanged();
+    }
+
+    size_t getConversionSize() const { return product.size(); }
+
+    /**
+     * @brief Матрица превращения в том же виде, что и для setConversion() (пусто - без реакции)
+     */
+    vector<double> getConversion() const {
+        const size_t n = product.size();
+        vector<double> matrix(n * n);
+        for (size_t j = 0; j < n; j++) {
+            for (size_t i = 0; i < n; i++) {
+                matrix[j * n + i] = conversionColumns[i * n + j];
+            }
+        }
+        return matrix;
+    }
+
+    string_view getDeviceType() const override { return "Reactor"; }
+
+    DeviceError validate() const override {
+        if (inputs.empty()) {
+            return DeviceError::NoInput;
+        }
+        if (outputs.size() != size_t(outputAmount)) {
+            return DeviceError::WrongOutputCount;
+        }
+        return DeviceError::None;
+    }
+    
+    void updateOutputs() override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        
+        double inputMass = inputs.at(0)->getMassFlow();
+        for (int i = 0; i < outputAmount; i++) {
+            double outputLocal = inputMass / outputAmount;
+            outputs.at(i)->setMassFlow(outputLocal);
+        }
+        setCalculated(true);
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+
+        if (conversionColumns.empty()) {
+            sumLanes(table, inputIds.data(), 1, outputIds.data(), outputIds.size(), 1.0 / outputAmount);
+        } else if (table.componentCount() == product.size()) {
+            convertLanes(table, inputIds[0], outputIds.data(), outputIds.size(), conversionColumns.data(),
+                         product.data(), 1.0 / outputAmount);
+        } else {
+            throw string("Conversion matrix does not match component count");
+        }
+        setCalculated(true);
+    }
+
+    /**
+     * @brief Модель, одинаковая для всех дорожек, есть только без матрицы превращения
+     *
+     * С матрицей реактор тоже линеен, но компоненты выхода зависят от разных компонентов
+     * входа, а система уравнений схемы и операции Sum/Split плана общие для всех дорожек.
+     */
+    bool linearize(vector<double>& coefficients) const override {
+        if (!conversionColumns.empty()) {
+            return false;
+        }
+        coefficients.assign(outputs.size() * inputs.size(), 1.0 / outputAmount);
+        return true;
+    }
+
+    bool propagatesTangents() const override { return true; }
+};
+
+// ============ КЛАСС Splitter ============
+/**
+ * @class Splitter
+ * @brief Делитель одного входа на N выходов в заданных долях.
+ *
+ * Доли хранятся в векторе фиксированного размера: setFractions() между расчетами только
+ * перезаписывает значения. Все дорожки (варианты и компоненты) делятся одинаково.
+ */
+class Splitter : public Device {
+private:
+    vector<double> fractions; ///< Доля входа для каждого выхода, сумма - 1
+
+public:
+    explicit Splitter(int outputs_count) : Device() {
+        if (outputs_count < 1) {
+            throw string("Splitter needs at least one output");
+        }
+        inputAmount = 1;
+        outputAmount = outputs_count;
+        fractions.assign(outputs_count, 1.0 / outputs_count);
+    }
+
+    string_view getDeviceType() const override { return "Splitter"; }
+
+    /**
+     * @brief Задать доли выходов без перераспределения памяти
+     *
+     * Схема узнает об изменении (notifyParametersChanged), и solveIncremental()
+     * пересчитывает делитель.
+     * @throws string если число долей не равно числу выходов или доли не дают в сумме 1
+     */
+    void setFractions(const vector<double>& values) {
+        if (values.size() != fractions.size()) {
+            throw string("Wrong number of split fractions");
+        }
+        double sum = 0;
+        for (double f : values) {
+            if (f < 0) {
+                throw string("Split fractions must not be negative");
+            }
+            sum += f;
+        }
+        if (abs(sum - 1.0) > 1e-9) {
+            throw string("Split fractions must sum to 1");
+        }
+        copy(values.begin(), values.end(), fractions.begin());
+        notifyParametersChanged();
+    }
+
+    const vector<double>& getFractions() const { return fractions; }
+
+    DeviceError validate() const override {
+        if (inputs.empty()) {
+            return DeviceError::NoInput;
+        }
+        if (outputs.size() != size_t(outputAmount)) {
+            return DeviceError::WrongOutputCount;
+        }
+        return DeviceError::None;
+    }
+
+    void updateOutputs() override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+
+        double inputMass = inputs[0]->getMassFlow();
+        for (int i = 0; i < outputAmount; i++) {
+            outputs[i]->setMassFlow(inputMass * fractions[i]);
+        }
+        setCalculated(true);
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+
+        splitLanes(table, inputIds[0], outputIds.data(), fractions.data(), outputIds.size());
+        setCalculated(true);
+    }
+
+    bool linearize(vector<double>& coefficients) const override {
+        coefficients.assign(outputs.size() * inputs.size(), 0.0);
+        for (size_t o = 0; o < outputs.size() && !inputs.empty(); o++) {
+            coefficients[o * inputs.size()] = fractions[o];
+        }
+        return true;
+    }
+
+    bool propagatesTangents() const override { return true; }
+};
+
+// ============ КЛАСС Tank ============
+/**
+ * @class Tank
+ * @brief Емкость с запасом: в динамике выход пропорционален запасу, out = holdup / residenceTime
+ *
+ * В стационарном расчете (шаг времени 0) выход равен входу, а запас становится
+ * установившимся: in * residenceTime. В динамике (Flowsheet::step) выход шага берется
+ * из запаса на начало шага, а advance() интегрирует запас явным методом Эйлера:
+ * holdup += dt * (in - out). Запас хранится для каждой дорожки таблицы.
+ */
+class Tank : public Device {
+private:
+    double residenceTime;
+    double timeStep = 0.0;  ///< 0 - стационарный расчет
+    vector<double> holdup;  ///< Запас по дорожкам строки потока
+    vector<double> rate;    ///< Скорость изменения запаса за последний шаг (in - out)
+
+    /**
+     * @brief Задать число дорожек запаса; rate всегда того же размера, что и holdup
+     */
+    void resizeLanes(size_t width) {
+        if (holdup.size() != width) {
+            holdup.resize(width, holdup.empty() ? 0.0 : holdup[0]);
+        }
+        if (rate.size() != width) {
+            rate.assign(width, 0.0);
+        }
+    }
+
+public:
+    /**
+     * @param residence Время пребывания (больше нуля)
+     * @throws string если время пребывания не положительно
+     */
+    explicit Tank(double residence) : Device(), residenceTime(residence) {
+        if (!(residence > 0)) {
+            throw string("Tank residence time must be positive");
+        }
+        inputAmount = 1;
+        outputAmount = 1;
+    }
+
+    string_view getDeviceType() const override { return "Tank"; }
+
+    double getResidenceTime() const { return residenceTime; }
+
+    /**
+     * @brief Запас дорожки lane (0 - общий запас варианта 0)
+     */
+    double getHoldup(size_t lane = 0) const { return lane < holdup.size() ? holdup[lane] : 0.0; }
+
+    /**
+     * @brief Задать одинаковый запас всем дорожкам (схема без компонентов)
+     */
+    void setHoldup(double mass) {
+        if (holdup.empty()) {
+            resizeLanes(1);
+        }
+        fill(holdup.begin(), holdup.end(), mass);
+    }
+
+    bool isDynamic() const override { return true; }
+    void setTimeStep(double dt) override { timeStep = dt; }
+
+    DeviceError validate() const override {
+        if (inputs.empty()) {
+            return DeviceError::NoInput;
+        }
+        if (outputs.size() != 1) {
+            return DeviceError::WrongOutputCount;
+        }
+        return DeviceError::None;
+    }
+
+    void updateOutputs() override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        if (holdup.empty()) {
+            resizeLanes(1);
+        }
+        if (timeStep == 0.0) {
+            holdup[0] = inputs[0]->getMassFlow() * residenceTime;
+        }
+        outputs[0]->setMassFlow(holdup[0] / residenceTime);
+        setCalculated(true);
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        const size_t width = table.laneCount();
+        resizeLanes(width);
+        const double* in = table.row(inputIds[0]);
+        double* out = table.row(outputIds[0]);
+        if (timeStep == 0.0) {
+            for (size_t k = 0; k < width; k++) {
+                holdup[k] = in[k] * residenceTime;
+                out[k] = in[k];
+            }
+            fill(rate.begin(), rate.end(), 0.0);
+        } else {
+            for (size_t k = 0; k < width; k++) {
+                out[k] = holdup[k] / residenceTime;
+            }
+        }
+        setCalculated(true);
+    }
+
+    void advance(const StreamTable& table, double dt) override {
+        const double* in = table.row(inputIds[0]);
+        const double* out = table.row(outputIds[0]);
+        for (size_t k = 0; k < holdup.size(); k++) {
+            rate[k] = in[k] - out[k];
+            holdup[k] += dt * rate[k];
+        }
+    }
+
+    double accumulation(size_t lane) const override { return lane < rate.size() ? rate[lane] : 0.0; }
+
+    /**
+     * @brief Линейна только в стационарном расчете (выход равен входу)
+     */
+    bool linearize(vector<double>& coefficients) const override {
+        coefficients.assign(1, 1.0);
+        return timeStep == 0.0;
+    }
+
+    bool propagatesTangents() const override { return timeStep == 0.0; }
+};
+
+// ============ ШАБЛОНЫ FixedMixer / FixedReactor ============
+/**
+ * @brief sumLanes() с числом входов и выходов, известным при компиляции
+ */
+template <size_t In, size_t Out>
+inline void sumLanesFixed(StreamTable& table, const StreamId* in, const StreamId* out) {
+    constexpr double scale = 1.0 / Out;
+    if (table.laneCount() != 1) {
+        sumLanes(table, in, In, out, Out, scale);
+        return;
+    }
+    double* flow = table.data();
+    double sum = 0;
+    for (size_t i = 0; i < In; i++) {
+        sum += flow[in[i]];
+    }
+    for (size_t j = 0; j < Out; j++) {
+        flow[out[j]] = sum * scale;
+    }
+}
+
+/**
+ * @class FixedMixer
+ * @brief Смеситель ровно на N входов и один выход.
+ *
+ * Порты хранятся в std::array, циклы имеют длину N, класс final - при статически
+ * собранной схеме компилятор разворачивает сумму и убирает виртуальный вызов.
+ */
+template <size_t N>
+class FixedMixer final : public Device
+{
+    static_assert(N > 0, "FixedMixer needs at least one input");
+
+private:
+    array<Stream*, N> inputPorts{};
+    Stream* outputPort = nullptr;
+
+protected:
+    void onPortsChanged() override {
+        for (size_t i = 0; i < inputs.size(); i++) {
+            inputPorts[i] = inputs[i].get();
+        }
+        outputPort = outputs.empty() ? nullptr : outputs[0].get();
+    }
+
+public:
+    FixedMixer() : Device() {
+        inputAmount = N;
+        outputAmount = MIXER_OUTPUTS;
+    }
+
+    string_view getDeviceType() const override { return "FixedMixer"; }
+
+    DeviceError validate() const override {
+        if (inputs.size() != N) {
+            return DeviceError::NoInput;
+        }
+        return outputs.empty() ? DeviceError::NoOutputs : DeviceError::None;
+    }
+
+    /**
+     * @brief Расчет без проверок: все порты должны быть подключены
+     */
+    void update() {
+        double sum = 0;
+        for (size_t i = 0; i < N; i++) {
+            sum += inputPorts[i]->getMassFlow();
+        }
+        outputPort->setMassFlow(sum);
+    }
+
+    void updateOutputs() override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        update();
+        setCalculated(true);
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        sumLanesFixed<N, MIXER_OUTPUTS>(table, inputIds.data(), outputIds.data());
+        setCalculated(true);
+    }
+
+    bool linearize(vector<double>& coefficients) const override {
+        coefficients.assign(outputs.size() * inputs.size(), 1.0);
+        return true;
+    }
+
+    bool propagatesTangents() const override { return true; }
+};
+
+/**
+ * @class FixedReactor
+ * @brief Реактор с одним входом и Outputs выходами, делящий расход поровну.
+ */
+template <size_t Outputs>
+class FixedReactor final : public Device
+{
+    static_assert(Outputs > 0, "FixedReactor needs at least one output");
+
+private:
+    Stream* inputPort = nullptr;
+    array<Stream*, Outputs> outputPorts{};
+
+protected:
+    void onPortsChanged() override {
+        inputPort = inputs.empty() ? nullptr : inputs[0].get();
+        for (size_t i = 0; i < outputs.size(); i++) {
+            outputPorts[i] = outputs[i].get();
+        }
+    }
+
+public:
+    FixedReactor() : Device() {
+        inputAmount = 1;
+        outputAmount = Outputs;
+    }
+
+    string_view getDeviceType() const override { return "FixedReactor"; }
+
+    DeviceError validate() const override {
+        if (inputs.empty()) {
+            return DeviceError::NoInput;
+        }
+        return outputs.size() != Outputs ? DeviceError::WrongOutputCount : DeviceError::None;
+    }
+
+    /**
+     * @brief Расчет без проверок: все порты должны быть подключены
+     */
+    void update() {
+        double outputLocal = inputPort->getMassFlow() / Outputs;
+        for (size_t i = 0; i < Outputs; i++) {
+            outputPorts[i]->setMassFlow(outputLocal);
+        }
+    }
+
+    void updateOutputs() override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        update();
+        setCalculated(true);
+    }
+
+    void updateTableOutputs(StreamTable& table) override {
+        checkForRecycle();
+        DeviceError error = validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        sumLanesFixed<1, Outputs>(table, inputIds.data(), outputIds.data());
+        setCalculated(true);
+    }
+
+    bool linearize(vector<double>& coefficients) const override {
+        coefficients.assign(outputs.size() * inputs.size(), 1.0 / Outputs);
+        return true;
+    }
+
+    bool propagatesTangents() const override { return true; }
+};
+
+// ============ КЛАСС WegsteinAccelerator ============
+/**
+ * @class WegsteinAccelerator
+ * @brief Ускорение сходимости рецикла по Вегштейну.
+ *
+ * Для каждого разрываемого потока x - принятое значение, g(x) - рассчитанное после
+ * прохода по контуру. Первый шаг - простая итерация, далее
+ * x' = q*x + (1-q)*g(x), где q = s/(s-1), s - наклон по двум последним шагам.
+ */
+class WegsteinAccelerator
+{
+private:
+    vector<double> previousGuess;
+    vector<double> previousResult;
+    bool hasHistory = false;
+    
+public:
+    static constexpr double Q_MIN = -5.0; ///< Ограничение ускорения
+    static constexpr double Q_MAX = 0.0;  ///< q = 0 - простая итерация
+
+    /**
+     * @brief Сбросить историю перед новым расчетом контура
+     * @param size Количество разрываемых потоков
+     */
+    void reset(size_t size) {
+        previousGuess.assign(size, 0.0);
+        previousResult.assign(size, 0.0);
+        hasHistory = false;
+    }
+
+    /**
+     * @brief Получить следующее приближение
+     * @param guess Принятые значения, заменяются новым приближением
+     * @param result Значения, рассчитанные по принятым
+     */
+    void next(vector<double>& guess, const vector<double>& result) {
+        for (size_t i = 0; i < guess.size(); i++) {
+            double x = guess[i];
+            double g = result[i];
+            double updated = g;
+            if (hasHistory) {
+                double dx = x - previousGuess[i];
+                if (abs(dx) > 1e-12) {
+                    double slope = (g - previousResult[i]) / dx;
+                    if (abs(slope - 1.0) > 1e-12) {
+                        double q = slope / (slope - 1.0);
+                        q = min(max(q, Q_MIN), Q_MAX);
+                        updated = q * x + (1.0 - q) * g;
+                    }
+                }
+            }
+            previousGuess[i] = x;
+            previousResult[i] = g;
+            guess[i] = updated;
+        }
+        hasHistory = true;
+    }
+};
+
+// ============ КЛАСС ThreadPool ============
+/**
+ * @class ThreadPool
+ * @brief Пул потоков с собственной очередью у каждого рабочего и кражей задач.
+ *
+ * Рабочий берет задачи с конца своей очереди, а когда она пуста - забирает с начала
+ * чужих. Поток, вызвавший parallelFor(), тоже выполняет задачи, пока ждет завершения.
+ */
+class ThreadPool
+{
+private:
+    struct WorkQueue {
+        mutex lock;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<WorkQueue>> queues;
+    vector<thread> workers;
+    mutex wakeLock;
+    condition_variable wake;
+    atomic<size_t> queued{0};
+    atomic<size_t> nextQueue{0};
+    bool stopping = false;
+
+    /**
+     * @brief Взять задачу из своей очереди или украсть из чужой
+     * @param self Номер очереди рабочего (queues.size() - поток-заказчик)
+     */
+    bool tryPop(size_t self, function<void()>& task) {
+        if (self < queues.size()) {
+            WorkQueue& own = *queues[self];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t i = 1; i <= queues.size(); i++) {
+            WorkQueue& victim = *queues[(self + i) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t self) {
+        function<void()> task;
+        while (true) {
+            if (tryPop(self, task)) {
+                task();
+                continue;
+            }
+            unique_lock<mutex> guard(wakeLock);
+            wake.wait(guard, [this] { return stopping || queued > 0; });
+            if (stopping && queued == 0) {
+                return;
+            }
+        }
+    }
+
+public:
+    /**
+     * @param threadCount Количество рабочих потоков (не меньше одного)
+     */
+    explicit ThreadPool(size_t threadCount) {
+        threadCount = max<size_t>(threadCount, 1);
+        for (size_t i = 0; i < threadCount; i++) {
+            queues.push_back(make_unique<WorkQueue>());
+        }
+        for (size_t i = 0; i < threadCount; i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(wakeLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    size_t getThreadCount() const { return workers.size(); }
+
+    /**
+     * @brief Поставить задачу в очередь одного из рабочих
+     */
+    void submit(function<void()> task) {
+        WorkQueue& target = *queues[nextQueue++ % queues.size()];
+        {
+            lock_guard<mutex> guard(target.lock);
+            target.tasks.push_back(std::move(task));
+        }
+        {
+            lock_guard<mutex> guard(wakeLock);
+            queued++;
+        }
+        wake.notify_one();
+    }
+
+    /**
+     * @brief Выполнить body(i) для i из [0, count) и дождаться завершения
+     *
+     * Диапазон режется на несколько кусков на поток, чтобы было что красть.
+     * @throws Первое исключение, брошенное body
+     */
+    template <class Body>
+    void parallelFor(size_t count, const Body& body) {
+        if (count == 0) {
+            return;
+        }
+        size_t chunks = min(count, workers.size() * 4);
+        size_t chunkSize = (count + chunks - 1) / chunks;
+        chunks = (count + chunkSize - 1) / chunkSize;
+
+        struct Batch {
+            atomic<size_t> remaining;
+            mutex lock;
+            condition_variable done;
+            exception_ptr error;
+        } batch;
+        batch.remaining = chunks;
+
+        for (size_t c = 0; c < chunks; c++) {
+            size_t begin = c * chunkSize;
+            size_t end = min(count, begin + chunkSize);
+            submit([&batch, &body, begin, end] {
+                try {
+                    for (size_t i = begin; i < end; i++) {
+                        body(i);
+                    }
+                } catch (...) {
+                    lock_guard<mutex> guard(batch.lock);
+                    if (!batch.error) {
+                        batch.error = current_exception();
+                    }
+                }
+                // Уменьшение и оповещение под одной блокировкой: иначе заказчик
+                // может увидеть ноль, выйти и разрушить batch раньше notify
+                lock_guard<mutex> guard(batch.lock);
+                if (--batch.remaining == 0) {
+                    batch.done.notify_all();
+                }
+            });
+        }
+
+        function<void()> task;
+        while (batch.remaining > 0 && tryPop(queues.size(), task)) {
+            task();
+        }
+        unique_lock<mutex> guard(batch.lock);
+        batch.done.wait(guard, [&batch] { return batch.remaining == 0; });
+        if (batch.error) {
+            rethrow_exception(batch.error);
+        }
+    }
+};
+
+// ============ КЛАСС Arena ============
+/**
+ * @class Arena
+ * @brief Область памяти схемы: потоки и устройства размещаются подряд в одном буфере.
+ *
+ * Объекты создаются через allocate_shared поверх pmr::monotonic_buffer_resource:
+ * создание объекта не обращается к глобальной куче, а release() возвращает память
+ * области одним вызовом и снова начинает с исходного буфера.
+ *
+ * Разбор схемы при этом остается O(n) по числу объектов: каждый shared_ptr атомарно
+ * уменьшает счетчик ссылок объекта и счетчик региона в своем аллокаторе, выполняет
+ * деструктор (Stream, Device с виртуальными деструкторами) и вызывает deallocate, который
+ * ничего не делает. Векторы внутри объектов (порты устройств) живут в общей куче
+ * и освобождаются по одному. Одним вызовом освобождается только сама память области.
+ *
+ * Буфер принадлежит региону, который каждый объект держит через свой аллокатор:
+ * объект, который еще кто-то держит, остается действительным и после release()
+ * и после уничтожения области.
+ */
+class Arena
+{
+private:
+    /// Источник блоков для области, считающий обращения к глобальной куче
+    class CountingResource : public pmr::memory_resource {
+    public:
+        size_t allocations = 0;
+        size_t bytes = 0;
+
+    private:
+        void* do_allocate(size_t size, size_t alignment) override {
+            allocations++;
+            bytes += size;
+            return pmr::new_delete_resource()->allocate(size, alignment);
+        }
+        void do_deallocate(void* p, size_t size, size_t alignment) override {
+            bytes -= size;
+            pmr::new_delete_resource()->deallocate(p, size, alignment);
+        }
+        bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+            return this == &other;
+        }
+    };
+
+    /// Буфер с блоками, взятыми сверх него; живет, пока жив хотя бы один объект из него
+    struct Region {
+        CountingResource upstream;
+        vector<byte> initial;
+        pmr::monotonic_buffer_resource resource;
+
+        explicit Region(size_t initialBytes)
+            : initial(max<size_t>(initialBytes, 1)),
+              resource(initial.data(), initial.size(), &upstream) {}
+    };
+
+    /// Аллокатор allocate_shared: копия в управляющем блоке объекта держит регион
+    template <class T>
+    struct RegionAllocator {
+        using value_type = T;
+        shared_ptr<Region> region;
+
+        explicit RegionAllocator(shared_ptr<Region> r) : region(std::move(r)) {}
+        template <class U>
+        RegionAllocator(const RegionAllocator<U>& other) : region(other.region) {}
+
+        T* allocate(size_t n) { return static_cast<T*>(region->resource.allocate(n * sizeof(T), alignof(T))); }
+        void deallocate(T* p, size_t n) { region->resource.deallocate(p, n * sizeof(T), alignof(T)); }
+
+        template <class U>
+        bool operator==(const RegionAllocator<U>& other) const { return region == other.region; }
+        template <class U>
+        bool operator!=(const RegionAllocator<U>& other) const { return region != other.region; }
+    };
+
+    size_t initialBytes;
+    shared_ptr<Region> region;
+    size_t retired = 0;
+
+public:
+    /**
+     * @param bytes Размер исходного буфера; при нехватке область берет новые блоки
+     */
+    explicit Arena(size_t bytes) : initialBytes(bytes), region(make_shared<Region>(bytes)) {}
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template <class T, class... Args>
+    shared_ptr<T> make(Args&&... args) {
+        return allocate_shared<T>(RegionAllocator<T>(region), std::forward<Args>(args)...);
+    }
+
+    /**
+     * @brief Освободить всю память области разом
+     *
+     * Объекты, которые никто не держит, к этому моменту уже уничтожены по одному
+     * своими shared_ptr; release() только возвращает буфер и дополнительные блоки.
+     * Если объекты области еще кто-то держит, память не переиспользуется: область
+     * начинает новый регион в куче, а старый освобождается вместе с последним объектом.
+     * @return true если исходный буфер снова свободен
+     */
+    bool release() {
+        if (region.use_count() == 1) {
+            region->resource.release();
+            return true;
+        }
+        region = make_shared<Region>(initialBytes);
+        retired++;
+        return false;
+    }
+
+    /**
+     * @brief Сколько раз release() оставил регион удерживаемым объектам
+     */
+    size_t getRetiredRegions() const { return retired; }
+
+    /**
+     * @brief Сколько дополнительных блоков текущий регион взял из кучи сверх исходного буфера
+     */
+    size_t getUpstreamAllocations() const { return region->upstream.allocations; }
+    size_t getUpstreamBytes() const { return region->upstream.bytes; }
+};
+
+// ============ КЛАСС SolveProfiler ============
+/**
+ * @class SolveProfiler
+ * @brief Статистика расчета по устройствам и типам устройств
+ *
+ * Flowsheet вызывает recordUpdate()/recordLoop() только в сборке с -DDEVICE_PROFILE;
+ * без этого флага точки замера не компилируются и setProfiler() ни на что не влияет.
+ * События сохраняются для writeChromeTrace() (chrome://tracing, Perfetto, speedscope),
+ * их число ограничено maxEvents, агрегированная статистика собирается всегда.
+ */
+class SolveProfiler
+{
+public:
+    struct Stats {
+        string label;          ///< "Mixer#3" - тип и порядковый номер устройства в профиле
+        string type;
+        uint64_t calls = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+    };
+
+private:
+    struct Event {
+        uint32_t device;       ///< Индекс в deviceStats или ~0u для контура рецикла
+        uint32_t thread;
+        uint64_t startNs;
+        uint64_t durationNs;
+        int iterations;
+    };
+
+    mutable mutex lock;
+    unordered_map<const Device*, uint32_t> deviceIndex;
+    unordered_map<thread::id, uint32_t> threadIndex;
+    vector<Stats> deviceStats;
+    vector<Event> events;
+    size_t maxEvents;
+    size_t droppedEvents = 0;
+    uint64_t loops = 0;
+    uint64_t recycleIterations = 0;
+    uint64_t origin;
+
+    uint32_t threadNumber() {
+        return threadIndex.emplace(this_thread::get_id(), uint32_t(threadIndex.size())).first->second;
+    }
+
+    void addEvent(const Event& event) {
+        if (events.size() < maxEvents) {
+            events.push_back(event);
+        } else {
+            droppedEvents++;
+        }
+    }
+
+    static void accumulate(Stats& stats, uint64_t durationNs) {
+        stats.calls++;
+        stats.totalNs += durationNs;
+        stats.maxNs = max(stats.maxNs, durationNs);
+    }
+
+public:
+    explicit SolveProfiler(size_t eventLimit = 1 << 20) : maxEvents(eventLimit), origin(now()) {}
+
+    static uint64_t now() {
+        return chrono::duration_cast<chrono::nanoseconds>(
+            chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /**
+     * @brief Учесть один расчет устройства
+     */
+    void recordUpdate(const Device* device, uint64_t startNs, uint64_t durationNs) {
+        lock_guard<mutex> guard(lock);
+        auto found = deviceIndex.find(device);
+        uint32_t index;
+        if (found == deviceIndex.end()) {
+            index = uint32_t(deviceStats.size());
+            deviceIndex.emplace(device, index);
+            Stats stats;
+            stats.type = string(device->getDeviceType());
+            stats.label = stats.type + "#" + to_string(index);
+            deviceStats.push_back(move(stats));
+        } else {
+            index = found->second;
+        }
+        accumulate(deviceStats[index], durationNs);
+        addEvent({index, threadNumber(), startNs, durationNs, 0});
+    }
+
+    /**
+     * @brief Учесть расчет контура рецикла (включает вложенные recordUpdate())
+     */
+    void recordLoop(int iterations, uint64_t startNs, uint64_t durationNs) {
+        lock_guard<mutex> guard(lock);
+        loops++;
+        recycleIterations += iterations;
+        addEvent({~0u, threadNumber(), startNs, durationNs, iterations});
+    }
+
+    /// Статистика по устройствам в порядке первого расчета
+    vector<Stats> getDeviceStats() const {
+        lock_guard<mutex> guard(lock);
+        return deviceStats;
+    }
+
+    /// Статистика по типам устройств (label = type)
+    vector<Stats> getTypeStats() const {
+        lock_guard<mutex> guard(lock);
+        vector<Stats> result;
+        for (const Stats& device : deviceStats) {
+            auto it = find_if(result.begin(), result.end(),
+                              [&device](const Stats& s) { return s.type == device.type; });
+            if (it == result.end()) {
+                Stats stats;
+                stats.label = stats.type = device.type;
+                it = result.insert(result.end(), stats);
+            }
+            it->calls += device.calls;
+            it->totalNs += device.totalNs;
+            it->maxNs = max(it->maxNs, device.maxNs);
+        }
+        return result;
+    }
+
+    uint64_t getLoopCount() const { lock_guard<mutex> guard(lock); return loops; }
+    uint64_t getRecycleIterations() const { lock_guard<mutex> guard(lock); return recycleIterations; }
+    size_t getDroppedEvents() const { lock_guard<mutex> guard(lock); return droppedEvents; }
+
+    /**
+     * @brief Записать события в формате Chrome Trace Event (JSON, события "X")
+     */
+    void writeChromeTrace(ostream& out) const {
+        lock_guard<mutex> guard(lock);
+        out << "{\"traceEvents\":[";
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& e = events[i];
+            bool loop = e.device == ~0u;
+            out << (i ? ",\n" : "\n") << "{\"name\":\"" << (loop ? string("Recycle") : deviceStats[e.device].label)
+                << "\",\"cat\":\"" << (loop ? string("recycle") : deviceStats[e.device].type)
+                << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                << ",\"ts\":" << (e.startNs - origin) / 1000.0 << ",\"dur\":" << e.durationNs / 1000.0;
+            if (loop) {
+                out << ",\"args\":{\"iterations\":" << e.iterations << "}";
+            }
+            out << "}";
+        }
+        out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+    }
+
+    void reset() {
+        lock_guard<mutex> guard(lock);
+        deviceIndex.clear();
+        threadIndex.clear();
+        deviceStats.clear();
+        events.clear();
+        droppedEvents = 0;
+        loops = 0;
+        recycleIterations = 0;
+        origin = now();
+    }
+};
+
+// ============ КЛАСС StreamHistory ============
+/**
+ * @class StreamHistory
+ * @brief Кольцевые буферы последних общих расходов потоков (вариант 0) по шагам времени
+ *
+ * Буфер потока id - length() значений подряд: ring(id)[slot(age)] - расход age шагов
+ * назад (0 - последний шаг). Запись шага пишет по одному значению на поток и память
+ * не выделяет; чтение тренда не копирует данные.
+ */
+class StreamHistory
+{
+private:
+    vector<double> values;  ///< Буфер потока id - values[id * capacity .. (id + 1) * capacity)
+    vector<double> times;   ///< Время записи каждого слота
+    size_t capacity = 0;
+    size_t streams = 0;
+    size_t recorded = 0;    ///< Всего записанных шагов
+
+public:
+    /**
+     * @brief Выделить буферы заново (записанная история теряется)
+     */
+    void reset(size_t streamCount, size_t length) {
+        capacity = length;
+        streams = streamCount;
+        recorded = 0;
+        values.assign(streams * capacity, 0.0);
+        times.assign(capacity, 0.0);
+    }
+
+    /**
+     * @brief Записать текущие расходы всех потоков таблицы
+     */
+    void record(const StreamTable& table, double time) {
+        if (capacity == 0) {
+            return;
+        }
+        if (table.size() != streams) {
+            reset(table.size(), capacity); // связи изменились
+        }
+        const size_t slot = recorded % capacity;
+        for (StreamId id = 0; id < streams; id++) {
+            values[id * capacity + slot] = table.massFlow(id);
+        }
+        times[slot] = time;
+        recorded++;
+    }
+
+    size_t length() const { return capacity; }
+    size_t size() const { return min(recorded, capacity); }
+
+    /**
+     * @brief Слот буфера для записи age шагов назад (age < size())
+     */
+    size_t slot(size_t age) const { return (recorded - 1 - age) % capacity; }
+
+    const double* ring(StreamId id) const { return values.data() + id * capacity; }
+    double at(StreamId id, size_t age) const { return ring(id)[slot(age)]; }
+    double timeAt(size_t age) const { return times[slot(age)]; }
+};
+
+// ============ КЛАСС ResultCache ============
+/**
+ * @class ResultCache
+ * @brief LRU-кэш результатов расчета схемы по квантованным расходам питаний
+ *
+ * Ключ - расходы всех дорожек потоков-питаний, округленные до шага POSSIBLE_ERROR:
+ * питания, отличающиеся меньше чем на шаг, обычно попадают в одну ячейку (кроме
+ * значений по разные стороны границы ячейки). Значение - дорожки всех
+ * рассчитываемых потоков. Полные ключи сравниваются, поэтому коллизия хэша - промах.
+ */
+class ResultCache
+{
+private:
+    struct Entry {
+        uint64_t hash;
+        vector<int64_t> key;
+        vector<double> values;
+    };
+
+    size_t capacity;
+    list<Entry> entries;                                    ///< В начале - последний использованный
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t payloadBytes = 0;                                ///< Байт в ключах и значениях
+
+    static uint64_t hashKey(const vector<int64_t>& key) {
+        uint64_t hash = 1469598103934665603ull; // FNV-1a по 64-битным словам
+        for (int64_t word : key) {
+            hash = (hash ^ uint64_t(word)) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    void erase(list<Entry>::iterator it) {
+        payloadBytes -= (it->key.size() + it->values.size()) * sizeof(double);
+        index.erase(it->hash);
+        entries.erase(it);
+    }
+
+public:
+    /**
+     * @param entryCount Наибольшее число хранимых результатов (не меньше одного)
+     */
+    explicit ResultCache(size_t entryCount) : capacity(max<size_t>(entryCount, 1)) {}
+
+    /**
+     * @brief Найти результат и сделать его последним использованным
+     * @return Значения, сохраненные insert(), или nullptr при промахе
+     */
+    const vector<double>* find(const vector<int64_t>& key) {
+        auto it = index.find(hashKey(key));
+        if (it == index.end() || it->second->key != key) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->values;
+    }
+
+    /**
+     * @brief Сохранить результат, вытеснив давно не использованный при переполнении
+     */
+    void insert(const vector<int64_t>& key, vector<double> values) {
+        uint64_t hash = hashKey(key);
+        auto it = index.find(hash);
+        if (it != index.end()) {
+            erase(it->second);
+        } else if (entries.size() >= capacity) {
+            erase(prev(entries.end()));
+        }
+        payloadBytes += (key.size() + values.size()) * sizeof(double);
+        entries.push_front({hash, key, std::move(values)});
+        index.emplace(hash, entries.begin());
+    }
+
+    /**
+     * @brief Забыть все результаты (счетчики попаданий сохраняются)
+     */
+    void clear() {
+        entries.clear();
+        index.clear();
+        payloadBytes = 0;
+    }
+
+    size_t size() const { return entries.size(); }
+    size_t getCapacity() const { return capacity; }
+    size_t getHits() const { return hits; }
+    size_t getMisses() const { return misses; }
+    double getHitRate() const { return hits + misses == 0 ? 0.0 : double(hits) / (hits + misses); }
+
+    /**
+     * @brief Оценка занятой памяти: данные, узлы списка и индекса
+     */
+    size_t getMemoryBytes() const {
+        const size_t nodeBytes = sizeof(Entry) + 2 * sizeof(void*) +                     // узел списка
+                                 sizeof(pair<uint64_t, list<Entry>::iterator>) + 2 * sizeof(void*); // узел индекса
+        return payloadBytes + entries.size() * nodeBytes + index.bucket_count() * sizeof(void*);
+    }
+};
+
+// ============ КЛАСС SparseLU ============
+/**
+ * @class SparseLU
+ * @brief Разреженное LU-разложение без выбора ведущего элемента.
+ *
+ * Строки задаются в порядке исключения (CSR, номера столбцов - в том же порядке).
+ * Исключение идет построчно (вариант IKJ) с плотным рабочим вектором, поэтому
+ * заполнение появляется только там, где его создает сама структура матрицы. Для схемы
+ * в порядке расчета матрица блочно-нижнетреугольная и заполняются только контуры рецикла.
+ *
+ * Выбор ведущего элемента не нужен для M-матриц вида I - C с C >= 0: их LU существует
+ * и устойчиво, пока матрица невырождена.
+ */
+class SparseLU
+{
+private:
+    size_t n = 0;
+    vector<size_t> lowerStart;   ///< Строка k множителей L: [lowerStart[k], lowerStart[k + 1])
+    vector<uint32_t> lowerCols;
+    vector<double> lowerValues;
+    vector<size_t> upperStart;   ///< Строка k матрицы U без диагонали
+    vector<uint32_t> upperCols;
+    vector<double> upperValues;
+    vector<double> diagonal;
+
+public:
+    /**
+     * @brief Разложить матрицу
+     * @param size Порядок матрицы
+     * @param rowStart Начала строк в cols/values (size + 1 значений)
+     * @param cols Номера столбцов; повторы в строке складываются
+     * @param values Значения
+     * @throws string если ведущий элемент обратился в ноль (матрица вырождена)
+     */
+    void factorize(size_t size, const vector<size_t>& rowStart, const vector<uint32_t>& cols,
+                   const vector<double>& values) {
+        n = size;
+        lowerStart.assign(1, 0);
+        upperStart.assign(1, 0);
+        lowerCols.clear();
+        lowerValues.clear();
+        upperCols.clear();
+        upperValues.clear();
+        diagonal.assign(n, 0.0);
+
+        vector<double> work(n, 0.0);
+        vector<char> used(n, 0);
+        vector<uint32_t> pattern;
+        vector<uint32_t> pending;   ///< Куча столбцов левее диагонали, ожидающих исключения
+        for (size_t k = 0; k < n; k++) {
+            pattern.clear();
+            pending.clear();
+            auto touch = [&](uint32_t c) {
+                if (!used[c]) {
+                    used[c] = 1;
+                    work[c] = 0.0;
+                    pattern.push_back(c);
+                    if (c < k) {
+                        pending.push_back(c);
+                        push_heap(pending.begin(), pending.end(), greater<uint32_t>());
+                    }
+                }
+            };
+            touch(uint32_t(k));
+            for (size_t e = rowStart[k]; e < rowStart[k + 1]; e++) {
+                touch(cols[e]);
+                work[cols[e]] += values[e];
+            }
+
+            while (!pending.empty()) {
+                pop_heap(pending.begin(), pending.end(), greater<uint32_t>());
+                uint32_t j = pending.back();
+                pending.pop_back();
+                double factor = work[j] / diagonal[j];
+                if (factor == 0.0) {
+                    continue;
+                }
+                lowerCols.push_back(j);
+                lowerValues.push_back(factor);
+                for (size_t e = upperStart[j]; e < upperStart[j + 1]; e++) {
+                    touch(upperCols[e]);
+                    work[upperCols[e]] -= factor * upperValues[e];
+                }
+            }
+
+            double pivot = work[k];
+            if (abs(pivot) < 1e-12) {
+                throw string("Equation-oriented system is singular");
+            }
+            diagonal[k] = pivot;
+            sort(pattern.begin(), pattern.end());
+            for (uint32_t c : pattern) {
+                if (c > k && work[c] != 0.0) {
+                    upperCols.push_back(c);
+                    upperValues.push_back(work[c]);
+                }
+                used[c] = 0;
+            }
+            lowerStart.push_back(lowerCols.size());
+            upperStart.push_back(upperCols.size());
+        }
+    }
+
+    /**
+     * @brief Решить LUx = b сразу для width правых частей на месте
+     * @param data Строка k системы - width значений по адресу data + rowOf[k] * width
+     * @param width Число правых частей (дорожек таблицы потоков)
+     * @param rowOf Строка хранилища для строки k системы
+     */
+    void solve(double* data, size_t width, const StreamId* rowOf) const {
+        for (size_t k = 0; k < n; k++) {
+            double* x = data + size_t(rowOf[k]) * width;
+            for (size_t e = lowerStart[k]; e < lowerStart[k + 1]; e++) {
+                const double* y = data + size_t(rowOf[lowerCols[e]]) * width;
+                const double factor = lowerValues[e];
+                for (size_t l = 0; l < width; l++) {
+                    x[l] -= factor * y[l];
+                }
+            }
+        }
+        for (size_t k = n; k-- > 0;) {
+            double* x = data + size_t(rowOf[k]) * width;
+            for (size_t e = upperStart[k]; e < upperStart[k + 1]; e++) {
+                const double* y = data + size_t(rowOf[upperCols[e]]) * width;
+                const double value = upperValues[e];
+                for (size_t l = 0; l < width; l++) {
+                    x[l] -= value * y[l];
+                }
+            }
+            const double inverse = 1.0 / diagonal[k];
+            for (size_t l = 0; l < width; l++) {
+                x[l] *= inverse;
+            }
+        }
+    }
+
+    size_t size() const { return n; }
+    size_t nonZeros() const { return lowerCols.size() + upperCols.size() + n; }
+};
+
+// ============ КЛАСС FlowSnapshot ============
+/**
+ * @class FlowSnapshot
+ * @brief Неизменяемая копия всех расходов схемы после завершенного расчета.
+ *
+ * Схема с setPublishing(true) копирует таблицу потоков в свободный снимок и публикует
+ * его заменой указателя (Flowsheet::getSnapshot). Читатели из других потоков держат
+ * shared_ptr и видят согласованное состояние целиком; расчет их не ждет.
+ *
+ * Указатель читается и заменяется через atomic_load/atomic_store для shared_ptr,
+ * которые в libstdc++ не lock-free: они берут мьютекс из общего пула по адресу указателя.
+ * Мьютекс держится только на время копирования shared_ptr (и в publish() на время
+ * замены, без копирования расходов), поэтому читатель может коротко ждать публикацию.
+ */
+class FlowSnapshot
+{
+private:
+    friend class Flowsheet;
+
+    vector<double> flows;   ///< Копия StreamTable::data()
+    size_t streams = 0;
+    size_t width = 1;
+    size_t cases = 1;
+    size_t stride = 1;
+    uint64_t epoch = 0;
+
+public:
+    /// Номер расчета: растет с каждой публикацией
+    uint64_t getEpoch() const { return epoch; }
+    size_t size() const { return streams; }
+    size_t caseCount() const { return cases; }
+    size_t componentCount() const { return stride - 1; }
+
+    double massFlow(StreamId id, size_t c = 0) const { return flows[id * width + c * stride]; }
+    double componentFlow(StreamId id, size_t j, size_t c = 0) const {
+        return flows[id * width + c * stride + 1 + j];
+    }
+    const double* row(StreamId id) const { return flows.data() + id * width; }
+};
+
+// ============ КЛАСС Flowsheet ============
+/**
+ * @brief Поведение схемы при обнаружении рецикла
+ */
+enum class RecycleMode {
+    Detect,  ///< Бросить RecycleException (как Device::checkForRecycle)
+    Converge ///< Разорвать контур и итерировать до сходимости
+};
+
+/**
+ * @brief Способ расчета схемы
+ */
+enum class SolveMode {
+    SequentialModular, ///< Устройства по очереди, контуры рецикла - итерациями
+    EquationOriented   ///< Вся схема - одна разреженная линейная система (Device::linearize)
+};
+
+/**
+ * @brief Способ обновления разрываемых потоков
+ */
+enum class RecycleAcceleration {
+    DirectSubstitution, ///< Простая итерация x' = g(x)
+    Wegstein            ///< Ускорение Вегштейна
+};
+
+/**
+ * @brief Код операции скомпилированного плана расчета (Flowsheet::compile)
+ */
+enum class OpCode : uint8_t {
+    Sum,   ///< out_j = scale * sum_i in_i - смеситель, реактор без превращения
+    Split, ///< out_j = params[j] * in_0 - делитель
+    Call,  ///< device->updateTableOutputs() - устройство без простой линейной модели
+    Loop   ///< Контур рецикла: тело - следующие count инструкций
+};
+
+/**
+ * @struct Instruction
+ * @brief Инструкция плана: код операции и номера потоков в общем массиве операндов
+ */
+struct Instruction {
+    OpCode op = OpCode::Call;
+    uint32_t firstIn = 0;     ///< Входы - operands[firstIn .. firstIn + inCount)
+    uint32_t inCount = 0;
+    uint32_t firstOut = 0;    ///< Выходы - operands[firstOut .. firstOut + outCount)
+    uint32_t outCount = 0;
+    uint32_t firstParam = 0;  ///< Split: доли выходов в params
+    uint32_t count = 0;       ///< Loop: длина тела; block - номер SolveBlock
+    uint32_t block = 0;
+    double scale = 1.0;       ///< Sum: множитель суммы
+    Device* device = nullptr; ///< Call: устройство
+};
+
+/**
+ * @struct SolveBlock
+ * @brief Шаг расчета: одно устройство или целый контур рецикла (сильно связная компонента)
+ */
+struct SolveBlock {
+    vector<Device*> devices; ///< Устройства в порядке расчета
+    vector<StreamId> tears;  ///< Разрываемые потоки (пусто для устройства без рецикла)
+    int level = 0;           ///< Уровень зависимости: блоки одного уровня независимы
+};
+
+/**
+ * @struct Jacobian
+ * @brief Производные общих расходов выходов устройств по общим расходам питаний
+ */
+struct Jacobian {
+    vector<StreamId> feeds;   ///< Столбцы: питания (потоки без производителя, читаемые устройствами)
+    vector<StreamId> outputs; ///< Строки: выходы устройств
+    vector<double> values;    ///< d outputs[o] / d feeds[f] = values[o * feeds.size() + f]
+
+    double at(size_t o, size_t f) const { return values[o * feeds.size() + f]; }
+};
+
+/**
+ * @struct BalanceViolation
+ * @brief Невязка материального баланса устройства в одном варианте расчета
+ */
+struct BalanceViolation {
+    Device* device = nullptr; ///< Устройство (nullptr - схема в целом)
+    size_t caseIndex = 0;     ///< Вариант расчета с наибольшей невязкой
+    double residual = 0.0;    ///< Сумма выходов минус сумма входов плюс накопление в запасах
+    double inflow = 0.0;      ///< Сумма входов того же варианта
+};
+
+/**
+ * @struct BalanceReport
+ * @brief Результат Flowsheet::validateBalance()
+ */
+struct BalanceReport {
+    vector<BalanceViolation> worst; ///< Наибольшие невязки устройств по убыванию |residual|
+    size_t violations = 0;          ///< Устройств с невязкой больше допуска
+    BalanceViolation sheet;         ///< Невязка схемы: продукты минус питания
+    bool sheetClosed = true;        ///< Невязка схемы в пределах допуска
+
+    bool ok() const { return violations == 0 && sheetClosed; }
+};
+
+/**
+ * @class SolveControl
+ * @brief Управление долгим расчетом: отмена, крайний срок и отчет о ходе
+ *
+ * Схема проверяет отмену и срок перед каждым блоком и каждой итерацией контура
+ * рецикла, отчет о ходе вызывается после каждого блока (после уровня при расчете в пуле).
+ */
+class SolveControl {
+private:
+    atomic<bool> cancelled{false};
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+    function<void(size_t, size_t)> progress;
+
+public:
+    /**
+     * @brief Отменить расчет (из любого потока)
+     */
+    void cancel() { cancelled.store(true, memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(memory_order_relaxed); }
+
+    /**
+     * @brief Задать крайний срок; задается до начала расчета
+     */
+    void setDeadline(chrono::steady_clock::time_point time) { deadline = time; }
+    void setTimeout(chrono::steady_clock::duration timeout) { deadline = chrono::steady_clock::now() + timeout; }
+
+    /**
+     * @brief Задать обработчик хода расчета: (блоков рассчитано, всего блоков)
+     *
+     * Вызывается в потоке, который считает схему.
+     */
+    void setProgress(function<void(size_t, size_t)> callback) { progress = std::move(callback); }
+
+    /**
+     * @throws SolveCancelledException если расчет отменен или срок истек
+     */
+    void check() const {
+        if (isCancelled()) {
+            throw SolveCancelledException(false);
+        }
+        if (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= deadline) {
+            throw SolveCancelledException(true);
+        }
+    }
+
+    void report(size_t done, size_t total) const {
+        if (progress) {
+            progress(done, total);
+        }
+    }
+};
+
+/**
+ * @struct PartBoundary
+ * @brief Граничные потоки одной части распределенной схемы
+ *
+ * Потоки называются по именам: имя - общий ключ для всех узлов, а номера StreamId
+ * у каждой части свои. inbound производят части с меньшими номерами, их значения
+ * принимаются в том же раунде; lagged производят части с большими номерами (разрезанный
+ * рецикл), их значения берутся с предыдущего раунда; outbound часть производит сама
+ * и отправляет в каждом раунде.
+ */
+struct PartBoundary {
+    vector<string> inbound;
+    vector<string> lagged;
+    vector<string> outbound;
+    bool cyclic = false;          ///< В разбиении есть разрезанные рециклы: нужны внешние раунды
+
+    bool empty() const { return inbound.empty() && lagged.empty() && outbound.empty(); }
+};
+
+/**
+ * @struct FlowPartition
+ * @brief Разбиение устройств схемы на части для расчета на разных узлах
+ *
+ * Часть p - устройства getSchedule() с номерами [firstDevice[p], firstDevice[p + 1]).
+ * FlowsheetFile::savePart сохраняет каждую часть отдельным файлом только с ее устройствами
+ * и потоками, а узел считает загруженную часть через Flowsheet::solvePart.
+ */
+struct FlowPartition {
+    vector<size_t> firstDevice;           ///< Границы частей, parts + 1 значений
+    vector<PartBoundary> boundary;        ///< Граничные потоки каждой части
+    vector<size_t> weight;                ///< Устройств в каждой части
+
+    size_t partCount() const { return weight.size(); }
+
+    /**
+     * @brief Количество разрезанных потоков (каждый считается один раз)
+     */
+    size_t cutCount() const {
+        size_t count = 0;
+        for (const PartBoundary& part : boundary) {
+            count += part.outbound.size();
+        }
+        return count;
+    }
+
+    /**
+     * @brief Количество разрезанных потоков, идущих в часть с меньшим номером
+     *
+     * Каждый такой поток - разрыв рецикла между узлами: он требует внешних раундов обмена.
+     */
+    size_t recycleCutCount() const {
+        set<string> names;
+        for (const PartBoundary& part : boundary) {
+            names.insert(part.lagged.begin(), part.lagged.end());
+        }
+        return names.size();
+    }
+};
+
+/**
+ * @class BoundaryExchange
+ * @brief Транспорт граничных потоков между узлами распределенного расчета
+ *
+ * Значение потока - width = laneCount() чисел - отправляется под именем потока
+ * и номером раунда внешней итерации. agree() - коллективная операция всех частей.
+ */
+class BoundaryExchange {
+public:
+    virtual ~BoundaryExchange() = default;
+
+    /**
+     * @brief Отправить значения граничного потока за раунд round
+     */
+    virtual void send(const string& stream, uint32_t round, const double* lanes, size_t width) = 0;
+
+    /**
+     * @brief Получить значения граничного потока за раунд round (ждет, пока производитель их отправит)
+     * @throws string если обмен прерван или у потока другое число дорожек
+     */
+    virtual void receive(const string& stream, uint32_t round, double* lanes, size_t width) = 0;
+
+    /**
+     * @brief Дождаться голосов всех частей за раунд round
+     * @return true, если сошлись все части
+     */
+    virtual bool agree(uint32_t round, bool converged) = 0;
+
+    /**
+     * @brief Прервать обмен: ожидающие и последующие вызовы всех частей бросают исключение
+     */
+    virtual void abort() = 0;
+};
+
+/**
+ * @class LocalExchange
+ * @brief BoundaryExchange внутри одного процесса: части считаются в разных потоках
+ *
+ * Также хранит обмен на стороне ExchangeServer.
+ */
+class LocalExchange : public BoundaryExchange {
+private:
+    struct Vote {
+        size_t count = 0;
+        bool converged = true;
+    };
+
+    const size_t parts;
+    mutex lock;
+    condition_variable arrived;
+    map<pair<string, uint32_t>, vector<double>> values;
+    unordered_map<uint32_t, Vote> votes;
+    bool aborted = false;
+
+    void checkAborted() const {
+        if (aborted) {
+            throw string("Boundary exchange aborted");
+        }
+    }
+
+public:
+    /**
+     * @param partCount Количество частей, голосующих в agree()
+     * @throws string если частей нет
+     */
+    explicit LocalExchange(size_t partCount) : parts(partCount) {
+        if (partCount == 0) {
+            throw string("Invalid partition count");
+        }
+    }
+
+    void send(const string& stream, uint32_t round, const double* lanes, size_t width) override {
+        {
+            lock_guard<mutex> guard(lock);
+            checkAborted();
+            values[{stream, round}].assign(lanes, lanes + width);
+            // Отправитель раунда round прошел agree(round - 1): все части прочитали прошлый раунд
+            if (round > 0) {
+                values.erase({stream, round - 1});
+            }
+        }
+        arrived.notify_all();
+    }
+
+    void receive(const string& stream, uint32_t round, double* lanes, size_t width) override {
+        unique_lock<mutex> guard(lock);
+        const auto key = make_pair(stream, round);
+        arrived.wait(guard, [this, &key] { return aborted || values.count(key) != 0; });
+        checkAborted();
+        const vector<double>& value = values[key];
+        if (value.size() != width) {
+            throw string("Boundary stream has another lane count");
+        }
+        copy(value.begin(), value.end(), lanes);
+    }
+
+    bool agree(uint32_t round, bool converged) override {
+        unique_lock<mutex> guard(lock);
+        checkAborted();
+        // Голосующий за round прошел agree(round - 1), значит все вышли из agree(round - 2)
+        if (round >= 2) {
+            votes.erase(round - 2);
+        }
+        Vote& vote = votes[round];
+        vote.count++;
+        vote.converged = vote.converged && converged;
+        if (vote.count == parts) {
+            arrived.notify_all();
+        }
+        arrived.wait(guard, [this, &vote] { return aborted || vote.count == parts; });
+        checkAborted();
+        return vote.converged;
+    }
+
+    void abort() override {
+        {
+            lock_guard<mutex> guard(lock);
+            aborted = true;
+        }
+        arrived.notify_all();
+    }
+
+    /**
+     * @brief Забыть отправленные значения и голоса перед следующим расчетом
+     */
+    void reset() {
+        lock_guard<mutex> guard(lock);
+        values.clear();
+        votes.clear();
+        aborted = false;
+    }
+};
+
+#ifndef _WIN32
+// ============ ОБМЕН ГРАНИЧНЫМИ ПОТОКАМИ ПО TCP ============
+/**
+ * @struct ExchangeProtocol
+ * @brief Сообщения между SocketExchange (узел) и ExchangeServer
+ *
+ * Запрос - Message, за ним имя потока (nameLength байт) и для SEND width чисел double.
+ * Ответ - код Status, за ним для RECEIVE width чисел, для AGREE - uint32_t (1 - сошлись).
+ * HELLO передает ENDIAN_TAG в round и ключ сеанса (8 байт) вместо имени: порядок байт
+ * родной, а запросы соединения без принятого HELLO сервер не выполняет.
+ */
+struct ExchangeProtocol {
+    static constexpr uint32_t ENDIAN_TAG = 0x01020304;
+    static constexpr uint32_t MAX_NAME = 4096;
+
+    enum Op : uint32_t {
+        OP_HELLO = 1,
+        OP_SEND = 2,
+        OP_RECEIVE = 3,
+        OP_AGREE = 4,   ///< width - голос: 1, если часть сошлась
+        OP_ABORT = 5,
+        OP_CLOSE = 6    ///< Узел закончил; разрыв соединения без CLOSE прерывает обмен
+    };
+
+    enum Status : uint32_t {
+        STATUS_OK = 0,
+        STATUS_ABORTED = 1,
+        STATUS_LANES = 2,       ///< У потока другое число дорожек
+        STATUS_BAD_REQUEST = 3  ///< Неизвестный поток, неверный ключ или порядок байт
+    };
+
+    struct Message {
+        uint32_t op;
+        uint32_t round;
+        uint32_t nameLength;
+        uint32_t width;
+    };
+
+    static bool writeAll(int fd, const void* data, size_t bytes) {
+        const char* at = static_cast<const char*>(data);
+        while (bytes > 0) {
+#ifdef MSG_NOSIGNAL
+            ssize_t written = ::send(fd, at, bytes, MSG_NOSIGNAL);
+#else
+            ssize_t written = ::send(fd, at, bytes, 0);
+#endif
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            at += written;
+            bytes -= written;
+        }
+        return true;
+    }
+
+    static bool readAll(int fd, void* data, size_t bytes) {
+        char* at = static_cast<char*>(data);
+        while (bytes > 0) {
+            ssize_t got = ::recv(fd, at, bytes, 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            at += got;
+            bytes -= got;
+        }
+        return true;
+    }
+};
+
+/**
+ * @class ExchangeServer
+ * @brief TCP-сервер обмена граничными потоками: узлы подключаются к нему через SocketExchange
+ *
+ * Каждое соединение обслуживает свой поток; значения и голоса хранит LocalExchange.
+ * По умолчанию сервер слушает только loopback: для узлов на других машинах адрес
+ * задается явно. Узел должен предъявить ключ сеанса getToken(), а принимаются только
+ * граничные потоки разбиения ровно с width дорожками, поэтому память сервера
+ * ограничена размером границы. Сервер может работать в процессе одного из узлов или отдельно.
+ */
+class ExchangeServer {
+private:
+    LocalExchange exchange;
+    set<string> boundaryNames;   ///< Допустимые имена потоков
+    size_t width;
+    uint64_t token;
+    int listener = -1;
+    uint16_t port = 0;
+    mutex lock;
+    bool stopping = false;
+    vector<int> connections;
+    vector<thread> workers;
+    thread acceptor;
+
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0 && errno == EINTR) {
+                continue;
+            }
+            if (fd < 0) {
+                return;
+            }
+            lock_guard<mutex> guard(lock);
+            if (stopping) {
+                close(fd);
+                return;
+            }
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            connections.push_back(fd);
+            workers.emplace_back([this, fd] { serve(fd); });
+        }
+    }
+
+    /**
+     * @brief Разбор запросов одного соединения
+     *
+     * Соединение без принятого HELLO закрывается при первой ошибке и на обмен не влияет;
+     * обрыв соединения узла без OP_CLOSE прерывает обмен остальных узлов.
+     */
+    void serve(int fd) {
+        using P = ExchangeProtocol;
+        vector<double> lanes(width);
+        string name;
+        P::Message message;
+        bool greeted = false;
+        while (P::readAll(fd, &message, sizeof(message))) {
+            if (message.op == P::OP_CLOSE) {
+                return;
+            }
+            if (message.nameLength > P::MAX_NAME) {
+                break;
+            }
+            name.resize(message.nameLength);
+            if (!P::readAll(fd, &name[0], name.size())) {
+                break;
+            }
+            uint32_t status = P::STATUS_OK;
+            uint32_t agreed = 0;
+            const bool boundary = boundaryNames.count(name) != 0;
+            if (message.op == P::OP_HELLO) {
+                uint64_t offered = 0;
+                if (name.size() == sizeof(offered)) {
+                    memcpy(&offered, name.data(), sizeof(offered));
+                }
+                greeted = message.round == P::ENDIAN_TAG && name.size() == sizeof(offered) && offered == token;
+                status = greeted ? P::STATUS_OK : P::STATUS_BAD_REQUEST;
+            } else if (!greeted) {
+                status = P::STATUS_BAD_REQUEST;
+            } else if ((message.op == P::OP_SEND || message.op == P::OP_RECEIVE) && !boundary) {
+                status = P::STATUS_BAD_REQUEST;
+            } else if ((message.op == P::OP_SEND || message.op == P::OP_RECEIVE) && message.width != width) {
+                status = P::STATUS_LANES;
+            } else {
+                try {
+                    switch (message.op) {
+                    case P::OP_SEND:
+                        if (!P::readAll(fd, lanes.data(), width * sizeof(double))) {
+                            exchange.abort();
+                            return;
+                        }
+                        exchange.send(name, message.round, lanes.data(), width);
+                        break;
+                    case P::OP_RECEIVE:
+                        exchange.receive(name, message.round, lanes.data(), width);
+                        break;
+                    case P::OP_AGREE:
+                        agreed = exchange.agree(message.round, message.width != 0) ? 1 : 0;
+                        break;
+                    case P::OP_ABORT:
+                        exchange.abort();
+                        break;
+                    default:
+                        status = P::STATUS_BAD_REQUEST;
+                    }
+                } catch (const string&) {
+                    status = P::STATUS_ABORTED;
+                }
+            }
+            bool written = P::writeAll(fd, &status, sizeof(status));
+            if (written && status == P::STATUS_OK && message.op == P::OP_RECEIVE) {
+                written = P::writeAll(fd, lanes.data(), width * sizeof(double));
+            } else if (written && status == P::STATUS_OK && message.op == P::OP_AGREE) {
+                written = P::writeAll(fd, &agreed, sizeof(agreed));
+            }
+            // Отвергнутый SEND оставил значения в канале: дальше поток запросов не разобрать
+            if (!written || !greeted || (status != P::STATUS_OK && message.op == P::OP_SEND)) {
+                break;
+            }
+        }
+        shutdown(fd, SHUT_RDWR); // дескриптор закрывает деструктор
+        if (greeted) {
+            exchange.abort();
+        }
+    }
+
+public:
+    /**
+     * @brief Открыть сервер для разбиения parts
+     * @param parts Разбиение: задает число узлов и допустимые граничные потоки
+     * @param laneCount Дорожек в строке потока (StreamTable::laneCount() схемы)
+     * @param bindAddress Адрес, который слушает сервер ("0.0.0.0" - все адреса узла)
+     * @param listenPort Порт (0 - любой свободный, см. getPort())
+     * @throws string если адрес не найден или порт не открылся
+     */
+    ExchangeServer(const FlowPartition& parts, size_t laneCount, const string& bindAddress = "127.0.0.1",
+                   uint16_t listenPort = 0)
+        : exchange(parts.partCount()), width(laneCount) {
+        for (const PartBoundary& part : parts.boundary) {
+            for (const string& name : part.outbound) {
+                boundaryNames.insert(name);
+            }
+        }
+        random_device entropy;
+        token = (uint64_t(entropy()) << 32) ^ entropy();
+
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(bindAddress.c_str(), to_string(listenPort).c_str(), &hints, &found) != 0) {
+            throw string("Cannot resolve exchange address " + bindAddress);
+        }
+        for (addrinfo* candidate = found; candidate && listener < 0; candidate = candidate->ai_next) {
+            listener = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (listener < 0) {
+                continue;
+            }
+            int on = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (bind(listener, candidate->ai_addr, candidate->ai_addrlen) != 0 || listen(listener, SOMAXCONN) != 0) {
+                close(listener);
+                listener = -1;
+            }
+        }
+        freeaddrinfo(found);
+        sockaddr_storage address{};
+        socklen_t length = sizeof(address);
+        if (listener < 0 || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0) {
+            if (listener >= 0) {
+                close(listener);
+            }
+            throw string("Cannot listen on exchange address " + bindAddress + ":" + to_string(listenPort));
+        }
+        port = address.ss_family == AF_INET6 ? ntohs(reinterpret_cast<sockaddr_in6&>(address).sin6_port)
+                                             : ntohs(reinterpret_cast<sockaddr_in&>(address).sin_port);
+        acceptor = thread([this] { acceptLoop(); });
+    }
+
+    ExchangeServer(const ExchangeServer&) = delete;
+    ExchangeServer& operator=(const ExchangeServer&) = delete;
+
+    /**
+     * @brief Закрыть соединения; узлы, ожидающие обмена, получают исключение
+     */
+    ~ExchangeServer() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+            for (int fd : connections) {
+                shutdown(fd, SHUT_RDWR);
+            }
+        }
+        shutdown(listener, SHUT_RDWR);
+        exchange.abort();
+        acceptor.join();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        for (int fd : connections) {
+            close(fd);
+        }
+        close(listener);
+    }
+
+    uint16_t getPort() const { return port; }
+
+    /**
+     * @brief Ключ сеанса: узлы передают его в SocketExchange вместе с файлами частей
+     */
+    uint64_t getToken() const { return token; }
+
+    /**
+     * @brief Забыть значения и голоса перед следующим расчетом (узлы еще не подключились)
+     */
+    void reset() { exchange.reset(); }
+};
+
+/**
+ * @class SocketExchange
+ * @brief BoundaryExchange узла, подключенного к ExchangeServer по TCP
+ */
+class SocketExchange : public BoundaryExchange {
+private:
+    int fd = -1;
+
+    /**
+     * @brief Отправить запрос и прочитать код ответа
+     * @throws string если соединение потеряно или сервер отклонил запрос
+     */
+    void request(uint32_t op, uint32_t round, const string& stream, uint32_t width, const double* lanes) {
+        using P = ExchangeProtocol;
+        P::Message message{op, round, uint32_t(stream.size()), width};
+        uint32_t status = P::STATUS_OK;
+        if (!P::writeAll(fd, &message, sizeof(message)) || !P::writeAll(fd, stream.data(), stream.size()) ||
+            (lanes && !P::writeAll(fd, lanes, width * sizeof(double))) || !P::readAll(fd, &status, sizeof(status))) {
+            throw string("Boundary exchange connection lost");
+        }
+        if (status == P::STATUS_ABORTED) {
+            throw string("Boundary exchange aborted");
+        }
+        if (status == P::STATUS_LANES) {
+            throw string("Boundary stream has another lane count");
+        }
+        if (status != P::STATUS_OK) {
+            throw string("Boundary exchange rejected the request");
+        }
+    }
+
+    void readReply(void* data, size_t bytes) {
+        if (!ExchangeProtocol::readAll(fd, data, bytes)) {
+            throw string("Boundary exchange connection lost");
+        }
+    }
+
+    static uint32_t checkedWidth(size_t width) {
+        if (width > numeric_limits<uint32_t>::max() / sizeof(double)) {
+            throw string("Boundary stream has too many lanes");
+        }
+        return uint32_t(width);
+    }
+
+public:
+    /**
+     * @brief Подключиться к серверу обмена
+     * @param token Ключ сеанса ExchangeServer::getToken()
+     * @throws string если сервер недоступен или отверг ключ
+     */
+    SocketExchange(const string& host, uint16_t port, uint64_t token) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &found) != 0) {
+            throw string("Cannot resolve exchange host " + host);
+        }
+        for (addrinfo* candidate = found; candidate && fd < 0; candidate = candidate->ai_next) {
+            fd = socket(candidate->ai_family, candidate->ai_socktype, candidate->ai_protocol);
+            if (fd >= 0 && connect(fd, candidate->ai_addr, candidate->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (fd < 0) {
+            throw string("Cannot connect to exchange " + host + ":" + to_string(port));
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        try {
+            request(ExchangeProtocol::OP_HELLO, ExchangeProtocol::ENDIAN_TAG,
+                    string(reinterpret_cast<const char*>(&token), sizeof(token)), 0, nullptr);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+    }
+
+    SocketExchange(const SocketExchange&) = delete;
+    SocketExchange& operator=(const SocketExchange&) = delete;
+
+    ~SocketExchange() override {
+        ExchangeProtocol::Message message{ExchangeProtocol::OP_CLOSE, 0, 0, 0};
+        ExchangeProtocol::writeAll(fd, &message, sizeof(message));
+        close(fd);
+    }
+
+    void send(const string& stream, uint32_t round, const double* lanes, size_t width) override {
+        request(ExchangeProtocol::OP_SEND, round, stream, checkedWidth(width), lanes);
+    }
+
+    void receive(const string& stream, uint32_t round, double* lanes, size_t width) override {
+        request(ExchangeProtocol::OP_RECEIVE, round, stream, checkedWidth(width), nullptr);
+        readReply(lanes, width * sizeof(double));
+    }
+
+    bool agree(uint32_t round, bool converged) override {
+        request(ExchangeProtocol::OP_AGREE, round, "", converged ? 1 : 0, nullptr);
+        uint32_t agreed = 0;
+        readReply(&agreed, sizeof(agreed));
+        return agreed != 0;
+    }
+
+    void abort() override {
+        try {
+            request(ExchangeProtocol::OP_ABORT, 0, "", 0, nullptr);
+        } catch (const string&) {
+            // Сервер недоступен - остальные узлы прервет разрыв соединения
+        }
+    }
+};
+#endif
+
+/**
+ * @class Flowsheet
+ * @brief Технологическая схема: владеет устройствами и потоками и рассчитывает их
+ *        в топологическом порядке за один проход.
+ *
+ * Порядок расчета строится по графу "производитель -> потребитель" из
+ * Device::getInputs()/getOutputs() и кэшируется до тех пор, пока addInput/addOutput
+ * любого устройства схемы не изменит связи. Контуры рецикла выделяются алгоритмом
+ * Тарьяна и в режиме RecycleMode::Converge рассчитываются итерационно.
+ */
+class Flowsheet : public TopologyListener
+{
+private:
+    /// Связь "производитель -> потребитель" через поток
+    struct Link {
+        int consumer;
+        StreamId stream;
+    };
+
+    unique_ptr<Arena> arena;            ///< Память потоков и устройств (nullptr - обычная куча); объявлена первой, освобождается последней
+    StreamTable table;                  ///< Данные всех потоков схемы
+    vector<shared_ptr<Device>> devices; ///< Устройства схемы в порядке добавления
+    vector<shared_ptr<Stream>> streams; ///< Потоки схемы, привязанные к table
+    vector<Device*> schedule;           ///< Кэшированный порядок расчета
+    vector<SolveBlock> blocks;          ///< Кэшированные шаги расчета
+    vector<vector<int>> levels;         ///< Номера блоков по уровням зависимости, внутри уровня - по типу устройства
+    vector<int> sweep;                  ///< Порядок последовательного прохода: уровни подряд
+    vector<size_t> consumerStart;       ///< Блоки-потребители потока id: consumerBlocks[consumerStart[id]..consumerStart[id + 1])
+    vector<int> consumerBlocks;
+    bool scheduleValid = false;         ///< false - связи изменились, порядок нужно перестроить
+    bool solved = false;                ///< true - все потоки соответствуют последнему полному расчету
+    int lastRecomputed = 0;             ///< Устройств пересчитано последним solveIncremental()
+    vector<int> pendingBlocks;          ///< Куча номеров блоков для solveIncremental()
+    vector<char> blockQueued;
+
+    RecycleMode recycleMode = RecycleMode::Detect;
+    SolveMode solveMode = SolveMode::SequentialModular;
+    SparseLU equations;                 ///< Разложение системы последнего solveEquations()
+    vector<StreamId> equationRows;      ///< Поток строки k системы: питания, затем выходы в порядке расчета
+    size_t equationFeeds = 0;           ///< Строк питаний в начале equationRows
+
+    bool compiled = false;              ///< План (tape или разложение) соответствует расписанию
+    vector<Instruction> tape;           ///< Скомпилированный план расчета
+    vector<StreamId> tapeOperands;
+    vector<double> tapeParams;
+    vector<double> coefficients;        ///< Рабочий буфер Device::linearize()
+
+    bool publishing = false;            ///< Публиковать снимок после каждого расчета
+    uint64_t epoch = 0;
+    shared_ptr<const FlowSnapshot> published;          ///< Читается и заменяется только atomic_load/atomic_store (не lock-free, см. FlowSnapshot)
+    vector<shared_ptr<FlowSnapshot>> spareSnapshots;   ///< Прежние снимки для повторного использования
+    RecycleAcceleration acceleration = RecycleAcceleration::Wegstein;
+    double tolerance = POSSIBLE_ERROR;
+    int maxIterations = 100;
+    int lastIterations = 0;             ///< Максимум итераций по контурам в последнем расчете
+
+    /// Рабочие буферы итераций рецикла - свои у каждого блока, чтобы контуры считались параллельно
+    struct LoopWorkspace {
+        vector<double> guess;
+        vector<double> result;
+        WegsteinAccelerator wegstein;
+        int iterations = 0;
+    };
+    vector<LoopWorkspace> workspaces;
+
+    shared_ptr<ThreadPool> pool;        ///< Пул для параллельного расчета (nullptr - последовательно)
+    atomic<int> streamNumber{0};        ///< Номер последнего потока addStream(): имена "s1", "s2", ... свои в каждой схеме
+    SolveProfiler* profiler = nullptr;  ///< Учитывается только в сборке с -DDEVICE_PROFILE
+    const SolveControl* control = nullptr; ///< Управление текущим расчетом solve(SolveControl&)
+    mutex asyncLock;
+    condition_variable asyncFinished;
+    size_t asyncPending = 0;               ///< Запущенные solveAsync(), которые еще обращаются к схеме
+    unique_ptr<ResultCache> resultCache;   ///< Кэш solveCached() (nullptr - выключен)
+    vector<StreamId> feedIds;              ///< Потоки без производителя - ключ кэша
+    vector<StreamId> producedIds;          ///< Выходы устройств - значение кэша
+    vector<int64_t> cacheKey;              ///< Рабочий буфер ключа
+    vector<size_t> balanceStart;           ///< Слагаемые баланса устройства d: [balanceStart[d], balanceStart[d + 1]),
+    vector<StreamId> balanceIds;           ///< после последнего устройства - слагаемые схемы в целом
+    vector<double> balanceSigns;           ///< +1 выход, -1 вход
+    vector<Device*> dynamicDevices;        ///< Устройства с isDynamic() в порядке расчета
+    double stepping = 0.0;                 ///< Шаг текущего step() (0 - стационарный расчет)
+    double appliedStep = 0.0;              ///< Шаг, переданный устройствам setTimeStep()
+    double simulationTime = 0.0;
+    StreamHistory history;
+    PartBoundary boundary;                 ///< Граничные потоки, если схема - часть распределенной
+
+    /**
+     * @brief Привязать к таблице потоки, подключенные к устройствам в обход addStream()
+     * @throws string если поток уже принадлежит другой схеме
+     */
+    void adoptStream(const shared_ptr<Stream>& s) {
+        if (!s->isBound()) {
+            s->bind(&table);
+            streams.push_back(s);
+        } else if (s->getTable() != &table) {
+            throw string("Stream belongs to another flowsheet");
+        }
+    }
+
+    /**
+     * @brief Привязать порты всех устройств к таблице потоков
+     */
+    void bindDevices() {
+        for (auto& device : devices) {
+            for (const auto& input : device->getInputs()) {
+                adoptStream(input);
+            }
+            for (const auto& output : device->getOutputs()) {
+                adoptStream(output);
+            }
+            device->bindPorts();
+        }
+    }
+
+    /**
+     * @brief Построить связи между устройствами
+     * @throws string если у потока несколько производителей
+     */
+    vector<vector<Link>> buildLinks() const {
+        vector<int> producer(table.size(), -1);
+        for (int i = 0; i < (int)devices.size(); i++) {
+            for (StreamId output : devices[i]->getOutputIds()) {
+                if (producer[output] != -1) {
+                    throw string("Stream has several producers");
+                }
+                producer[output] = i;
+            }
+        }
+
+        vector<vector<Link>> links(devices.size());
+        for (int i = 0; i < (int)devices.size(); i++) {
+            for (StreamId input : devices[i]->getInputIds()) {
+                if (producer[input] != -1) {
+                    links[producer[input]].push_back({i, input});
+                }
+            }
+        }
+        return links;
+    }
+
+    /**
+     * @brief Найти сильно связные компоненты (итеративный алгоритм Тарьяна)
+     * @return Компоненты в топологическом порядке
+     */
+    vector<vector<int>> findComponents(const vector<vector<Link>>& links) const {
+        int n = devices.size();
+        int counter = 0;
+        vector<int> index(n, -1);
+        vector<int> low(n, 0);
+        vector<char> onStack(n, 0);
+        vector<int> stack;
+        vector<pair<int, size_t>> calls; // устройство и номер следующей связи
+        vector<vector<int>> components;
+
+        for (int root = 0; root < n; root++) {
+            if (index[root] != -1) {
+                continue;
+            }
+            index[root] = low[root] = counter++;
+            stack.push_back(root);
+            onStack[root] = 1;
+            calls.push_back({root, 0});
+
+            while (!calls.empty()) {
+                int v = calls.back().first;
+                size_t next = calls.back().second;
+                if (next < links[v].size()) {
+                    calls.back().second++;
+                    int w = links[v][next].consumer;
+                    if (index[w] == -1) {
+                        index[w] = low[w] = counter++;
+                        stack.push_back(w);
+                        onStack[w] = 1;
+                        calls.push_back({w, 0});
+                    } else if (onStack[w]) {
+                        low[v] = min(low[v], index[w]);
+                    }
+                    continue;
+                }
+
+                calls.pop_back();
+                if (!calls.empty()) {
+                    int parent = calls.back().first;
+                    low[parent] = min(low[parent], low[v]);
+                }
+                if (low[v] == index[v]) {
+                    vector<int> component;
+                    int w;
+                    do {
+                        w = stack.back();
+                        stack.pop_back();
+                        onStack[w] = 0;
+                        component.push_back(w);
+                    } while (w != v);
+                    components.push_back(component);
+                }
+            }
+        }
+
+        // Тарьян выдает компоненты в обратном топологическом порядке
+        reverse(components.begin(), components.end());
+        return components;
+    }
+
+    /**
+     * @brief Компонента - контур рецикла: несколько устройств или устройство, читающее свой выход
+     */
+    bool isLoop(const vector<int>& component, const vector<vector<Link>>& links) const {
+        if (component.size() > 1) {
+            return true;
+        }
+        int first = component.front();
+        for (const Link& link : links[first]) {
+            if (link.consumer == first) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Упорядочить устройства контура и выбрать разрываемые потоки
+     *
+     * Обход в глубину внутри компоненты: потоки обратных связей становятся разрываемыми,
+     * устройства рассчитываются в обратном порядке выхода из обхода.
+     */
+    SolveBlock buildLoopBlock(const vector<int>& component, const vector<vector<Link>>& links) const {
+        unordered_map<int, int> state; // 0 - не посещено, 1 - в обходе, 2 - завершено
+        for (int member : component) {
+            state[member] = 0;
+        }
+        int root = *min_element(component.begin(), component.end());
+
+        SolveBlock block;
+        vector<int> finished;
+        vector<pair<int, size_t>> calls{{root, 0}};
+        state[root] = 1;
+        while (!calls.empty()) {
+            int v = calls.back().first;
+            size_t next = calls.back().second;
+            if (next < links[v].size()) {
+                calls.back().second++;
+                const Link& link = links[v][next];
+                auto it = state.find(link.consumer);
+                if (it == state.end()) {
+                    continue; // связь ведет за пределы контура
+                }
+                if (it->second == 0) {
+                    it->second = 1;
+                    calls.push_back({link.consumer, 0});
+                } else if (it->second == 1 &&
+                           find(block.tears.begin(), block.tears.end(), link.stream) == block.tears.end()) {
+                    block.tears.push_back(link.stream);
+                }
+                continue;
+            }
+            state[v] = 2;
+            finished.push_back(v);
+            calls.pop_back();
+        }
+
+        for (auto it = finished.rbegin(); it != finished.rend(); ++it) {
+            block.devices.push_back(devices[*it].get());
+        }
+        return block;
+    }
+
+    /**
+     * @brief Построить порядок расчета
+     * @throws string если у потока несколько производителей
+     * @throws RecycleException если в схеме есть рецикл, а режим - RecycleMode::Detect
+     */
+    void buildSchedule() {
+        compiled = false;
+        // Результаты кэша записаны для прежнего набора выходов producedIds
+        if (resultCache) {
+            resultCache->clear();
+        }
+        bindDevices();
+        vector<vector<Link>> links = buildLinks();
+        vector<vector<int>> components = findComponents(links);
+
+        blocks.clear();
+        schedule.clear();
+        for (const auto& component : components) {
+            if (!isLoop(component, links)) {
+                blocks.push_back({{devices[component.front()].get()}, {}});
+            } else {
+                SolveBlock block = buildLoopBlock(component, links);
+                if (recycleMode == RecycleMode::Detect && solveMode == SolveMode::SequentialModular) {
+                    throw RecycleException(block.devices.front()->getDeviceType(),
+                                           table.name(block.tears.front()));
+                }
+                blocks.push_back(block);
+            }
+            for (Device* device : blocks.back().devices) {
+                schedule.push_back(device);
+            }
+        }
+
+        buildLevels(links);
+        buildConsumers();
+        workspaces.assign(blocks.size(), LoopWorkspace());
+        blockQueued.assign(blocks.size(), 0);
+        pendingBlocks.clear();
+        pendingBlocks.reserve(blocks.size()); // каждый блок в очереди не более одного раза
+        vector<char> produced(table.size(), 0);
+        for (Device* device : schedule) {
+            for (StreamId output : device->getOutputIds()) {
+                produced[output] = 1;
+            }
+        }
+        feedIds.clear();
+        producedIds.clear();
+        for (StreamId id = 0; id < table.size(); id++) {
+            (produced[id] ? producedIds : feedIds).push_back(id);
+        }
+        buildBalanceTerms(produced);
+        dynamicDevices.clear();
+        for (Device* device : schedule) {
+            if (device->isDynamic()) {
+                device->setTimeStep(appliedStep);
+                dynamicDevices.push_back(device);
+            }
+        }
+        for (auto& device : devices) {
+            device->setRecycleChecked(true);
+        }
+        scheduleValid = true;
+    }
+
+    /**
+     * @brief Собрать слагаемые материального баланса для validateBalance()
+     * @param produced produced[id] != 0 - у потока есть производитель
+     */
+    void buildBalanceTerms(const vector<char>& produced) {
+        balanceStart.clear();
+        balanceIds.clear();
+        balanceSigns.clear();
+        vector<char> consumed(table.size(), 0);
+        for (Device* device : schedule) {
+            balanceStart.push_back(balanceIds.size());
+            for (StreamId input : device->getInputIds()) {
+                balanceIds.push_back(input);
+                balanceSigns.push_back(-1.0);
+                consumed[input] = 1;
+            }
+            for (StreamId output : device->getOutputIds()) {
+                balanceIds.push_back(output);
+                balanceSigns.push_back(1.0);
+            }
+        }
+        balanceStart.push_back(balanceIds.size());
+        for (StreamId id = 0; id < table.size(); id++) {
+            if (!produced[id] && consumed[id]) {
+                balanceIds.push_back(id); // питание
+                balanceSigns.push_back(-1.0);
+            } else if (produced[id] && !consumed[id]) {
+                balanceIds.push_back(id); // продукт
+                balanceSigns.push_back(1.0);
+            }
+        }
+    }
+
+    /**
+     * @brief Для каждого потока запомнить блоки, которые его читают
+     */
+    void buildConsumers() {
+        consumerStart.assign(table.size() + 1, 0);
+        for (const SolveBlock& block : blocks) {
+            for (Device* device : block.devices) {
+                for (StreamId input : device->getInputIds()) {
+                    consumerStart[input + 1]++;
+                }
+            }
+        }
+        for (size_t id = 0; id < table.size(); id++) {
+            consumerStart[id + 1] += consumerStart[id];
+        }
+        consumerBlocks.assign(consumerStart.back(), 0);
+        vector<size_t> fill(consumerStart.begin(), consumerStart.end() - 1);
+        for (int b = 0; b < (int)blocks.size(); b++) {
+            for (Device* device : blocks[b].devices) {
+                for (StreamId input : device->getInputIds()) {
+                    consumerBlocks[fill[input]++] = b;
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Поставить в очередь пересчета блоки, читающие поток
+     * @param after Блоки с номером не больше after уже пересчитаны (контур читает свои же выходы)
+     */
+    void queueConsumers(StreamId id, int after) {
+        for (size_t i = consumerStart[id]; i < consumerStart[id + 1]; i++) {
+            int b = consumerBlocks[i];
+            if (b > after && !blockQueued[b]) {
+                blockQueued[b] = 1;
+                pendingBlocks.push_back(b);
+                push_heap(pendingBlocks.begin(), pendingBlocks.end(), greater<int>());
+            }
+        }
+    }
+
+    /**
+     * @brief Разложить блоки по уровням: уровень блока на единицу больше уровня его поставщиков
+     */
+    void buildLevels(const vector<vector<Link>>& links) {
+        unordered_map<const Device*, int> deviceIndex;
+        for (int i = 0; i < (int)devices.size(); i++) {
+            deviceIndex.emplace(devices[i].get(), i);
+        }
+        vector<int> blockOf(devices.size(), 0);
+        for (int b = 0; b < (int)blocks.size(); b++) {
+            for (Device* device : blocks[b].devices) {
+                blockOf[deviceIndex[device]] = b;
+            }
+        }
+
+        levels.clear();
+        for (int b = 0; b < (int)blocks.size(); b++) {
+            int level = blocks[b].level;
+            if (level >= (int)levels.size()) {
+                levels.resize(level + 1);
+            }
+            levels[level].push_back(b);
+            for (Device* device : blocks[b].devices) {
+                for (const Link& link : links[deviceIndex[device]]) {
+                    int consumer = blockOf[link.consumer];
+                    if (consumer != b) {
+                        blocks[consumer].level = max(blocks[consumer].level, level + 1);
+                    }
+                }
+            }
+        }
+
+        // Блоки уровня независимы: однотипные устройства идут подряд, и косвенный
+        // вызов updateTableOutputs() в проходе почти всегда предсказывается верно
+        auto dispatchKey = [this](int b) {
+            return make_pair(!blocks[b].tears.empty(), blocks[b].devices.front()->getDeviceType());
+        };
+        sweep.clear();
+        for (auto& level : levels) {
+            stable_sort(level.begin(), level.end(),
+                        [&dispatchKey](int a, int b) { return dispatchKey(a) < dispatchKey(b); });
+            sweep.insert(sweep.end(), level.begin(), level.end());
+        }
+    }
+
+    /**
+     * @brief Рассчитать один блок схемы
+     */
+    void solveBlock(size_t index) {
+        const SolveBlock& block = blocks[index];
+        if (block.tears.empty()) {
+            updateDevice(block.devices.front());
+            return;
+        }
+#ifdef DEVICE_PROFILE
+        uint64_t start = profiler ? SolveProfiler::now() : 0;
+        workspaces[index].iterations = solveLoop(block, workspaces[index]);
+        if (profiler) {
+            profiler->recordLoop(workspaces[index].iterations, start, SolveProfiler::now() - start);
+        }
+#else
+        workspaces[index].iterations = solveLoop(block, workspaces[index]);
+#endif
+    }
+
+    /**
+     * @brief Рассчитать одно устройство (с замером времени в сборке с DEVICE_PROFILE)
+     */
+    void updateDevice(Device* device) {
+#ifdef DEVICE_PROFILE
+        if (profiler) {
+            uint64_t start = SolveProfiler::now();
+            device->updateTableOutputs(table);
+            profiler->recordUpdate(device, start, SolveProfiler::now() - start);
+            return;
+        }
+#endif
+        device->updateTableOutputs(table);
+    }
+
+    /**
+     * @brief Рассчитать всю схему одной разреженной линейной системой
+     *
+     * Неизвестные - все потоки: строка питания x = текущий расход, строка выхода o
+     * устройства x_o - sum_i c_oi x_i = 0 (c - из Device::linearize). Питания идут
+     * первыми, выходы - в порядке расчета, поэтому вне контуров рецикла разложение
+     * не дает заполнения. Все дорожки таблицы решаются одним разложением.
+     * @throws string если у устройства нет общей для дорожек линейной модели или система
+     *         вырождена (контур без выхода)
+     */
+    void solveEquations() {
+        factorizeEquations();
+        solveFactorized();
+    }
+
+    /**
+     * @brief Собрать систему уравнений схемы и разложить ее (см. solveEquations)
+     */
+    void factorizeEquations() {
+        const size_t n = table.size();
+        vector<char> produced(n, 0);
+        for (Device* device : schedule) {
+            for (StreamId output : device->getOutputIds()) {
+                produced[output] = 1;
+            }
+        }
+        equationRows.clear();
+        for (StreamId id = 0; id < n; id++) {
+            if (!produced[id]) {
+                equationRows.push_back(id);
+            }
+        }
+        const size_t feedCount = equationRows.size();
+        equationFeeds = feedCount;
+        for (Device* device : schedule) {
+            const auto& outputIds = device->getOutputIds();
+            equationRows.insert(equationRows.end(), outputIds.begin(), outputIds.end());
+        }
+        vector<uint32_t> rowIndex(n);
+        for (size_t k = 0; k < n; k++) {
+            rowIndex[equationRows[k]] = k;
+        }
+
+        vector<size_t> rowStart(feedCount + 1);
+        vector<uint32_t> cols(feedCount);
+        vector<double> values(feedCount, 1.0);
+        for (size_t k = 0; k < feedCount; k++) {
+            rowStart[k + 1] = k + 1;
+            cols[k] = k;
+        }
+        for (Device* device : schedule) {
+            if (!device->linearize(coefficients)) {
+                throw string("Device cannot be solved in equation-oriented mode: ") +
+                      string(device->getDeviceType());
+            }
+            const auto& inputIds = device->getInputIds();
+            const auto& outputIds = device->getOutputIds();
+            for (size_t o = 0; o < outputIds.size(); o++) {
+                cols.push_back(rowIndex[outputIds[o]]);
+                values.push_back(1.0);
+                for (size_t i = 0; i < inputIds.size(); i++) {
+                    double c = coefficients[o * inputIds.size() + i];
+                    if (c != 0.0) {
+                        cols.push_back(rowIndex[inputIds[i]]);
+                        values.push_back(-c);
+                    }
+                }
+                rowStart.push_back(cols.size());
+            }
+        }
+
+        equations.factorize(equationRows.size(), rowStart, cols, values);
+    }
+
+    /**
+     * @brief Решить разложенную систему для текущих расходов питаний
+     */
+    void solveFactorized() {
+        const size_t width = table.laneCount();
+        for (size_t k = equationFeeds; k < equationRows.size(); k++) {
+            fill_n(table.row(equationRows[k]), width, 0.0);
+        }
+        equations.solve(table.data(), width, equationRows.data());
+
+        for (Device* device : schedule) {
+            device->setCalculated(true);
+        }
+        lastIterations = 0;
+        table.clearDirty();
+        solved = true;
+        publish();
+        lastRecomputed = schedule.size();
+    }
+
+    /**
+     * @brief Опубликовать расходы после завершенного расчета (если включено)
+     *
+     * Копия пишется в снимок, который никто не читает (use_count() == 1 - читатели
+     * получают только опубликованный), поэтому после прогрева память не выделяется.
+     * use_count() читается без упорядочения: acquire-барьер связывает его с освобождением
+     * ссылки читателем, и чтения снимка читателем завершаются до перезаписи.
+     */
+    void publish() {
+        if (!publishing) {
+            return;
+        }
+        shared_ptr<FlowSnapshot> snapshot;
+#ifndef __SANITIZE_THREAD__ // ThreadSanitizer не учитывает барьеры: в такой сборке снимки не переиспользуются
+        for (auto& spare : spareSnapshots) {
+            if (spare.use_count() == 1) {
+                atomic_thread_fence(memory_order_acquire);
+                snapshot.swap(spare);
+                spare = spareSnapshots.back();
+                spareSnapshots.pop_back();
+                break;
+            }
+        }
+#endif
+        if (!snapshot) {
+            snapshot = make_shared<FlowSnapshot>();
+        }
+        snapshot->flows.assign(table.data(), table.data() + table.size() * table.laneCount());
+        snapshot->streams = table.size();
+        snapshot->width = table.laneCount();
+        snapshot->cases = table.caseCount();
+        snapshot->stride = table.componentCount() + 1;
+        snapshot->epoch = ++epoch;
+
+        shared_ptr<const FlowSnapshot> previous = atomic_load(&published);
+        atomic_store(&published, shared_ptr<const FlowSnapshot>(snapshot));
+        if (previous && spareSnapshots.size() < MAX_SPARE_SNAPSHOTS) {
+            spareSnapshots.push_back(const_pointer_cast<FlowSnapshot>(previous));
+        }
+    }
+
+    /**
+     * @brief Добавить в план инструкцию расчета устройства
+     * @throws string если устройство не готово к расчету (Device::validate)
+     */
+    void emitDevice(Device* device) {
+        DeviceError error = device->validate();
+        if (error != DeviceError::None) {
+            throw string(describe(error));
+        }
+        const auto& inputIds = device->getInputIds();
+        const auto& outputIds = device->getOutputIds();
+        Instruction instruction;
+        instruction.device = device;
+        instruction.firstIn = tapeOperands.size();
+        instruction.inCount = inputIds.size();
+        tapeOperands.insert(tapeOperands.end(), inputIds.begin(), inputIds.end());
+        instruction.firstOut = tapeOperands.size();
+        instruction.outCount = outputIds.size();
+        tapeOperands.insert(tapeOperands.end(), outputIds.begin(), outputIds.end());
+
+        if (!device->isDynamic() && device->linearize(coefficients)) { // запас меняется и в стационаре
+            bool uniform = all_of(coefficients.begin(), coefficients.end(),
+                                  [this](double c) { return c == coefficients.front(); });
+            if (uniform) {
+                instruction.op = OpCode::Sum;
+                instruction.scale = coefficients.empty() ? 0.0 : coefficients.front();
+            } else if (inputIds.size() == 1) {
+                instruction.op = OpCode::Split;
+                instruction.firstParam = tapeParams.size();
+                tapeParams.insert(tapeParams.end(), coefficients.begin(), coefficients.end());
+            }
+        }
+        tape.push_back(instruction);
+    }
+
+    /**
+     * @brief Выполнить одну инструкцию плана (не Loop)
+     */
+    void execute(const Instruction& instruction) {
+        const StreamId* operands = tapeOperands.data();
+        switch (instruction.op) {
+            case OpCode::Sum:
+                sumLanes(table, operands + instruction.firstIn, instruction.inCount,
+                         operands + instruction.firstOut, instruction.outCount, instruction.scale);
+                break;
+            case OpCode::Split:
+                splitLanes(table, operands[instruction.firstIn], operands + instruction.firstOut,
+                           tapeParams.data() + instruction.firstParam, instruction.outCount);
+                break;
+            case OpCode::Call:
+                instruction.device->setCalculated(false);
+                instruction.device->updateTableOutputs(table);
+                break;
+            case OpCode::Loop:
+                break;
+        }
+    }
+
+    /**
+     * @brief Рассчитать контур рецикла до сходимости разрываемых потоков
+     * @return Количество итераций
+     * @throws ConvergenceException если контур не сошелся за maxIterations
+     */
+    int solveLoop(const SolveBlock& block, LoopWorkspace& workspace) {
+        return iterateLoop(block, workspace, [this, &block]() {
+            for (Device* device : block.devices) {
+                device->setCalculated(false);
+            }
+            for (Device* device : block.devices) {
+                updateDevice(device);
+            }
+        });
+    }
+
+    /**
+     * @brief Итерации контура: body() делает один проход по устройствам контура
+     */
+    template <class Body>
+    int iterateLoop(const SolveBlock& block, LoopWorkspace& workspace, Body body) {
+        // Все дорожки разрываемых потоков: значения потока i - [i * width, (i + 1) * width)
+        const size_t width = table.laneCount();
+        const size_t tearCount = block.tears.size();
+        const size_t valueCount = tearCount * width;
+        vector<double>& tearGuess = workspace.guess;
+        vector<double>& tearResult = workspace.result;
+        tearGuess.resize(valueCount);
+        tearResult.resize(valueCount);
+        for (size_t i = 0; i < tearCount; i++) {
+            copy_n(table.row(block.tears[i]), width, tearGuess.begin() + i * width);
+        }
+        workspace.wegstein.reset(valueCount);
+
+        for (int iteration = 1; iteration <= maxIterations; iteration++) {
+            if (control) {
+                control->check();
+            }
+            for (size_t i = 0; i < tearCount; i++) {
+                copy_n(tearGuess.begin() + i * width, width, table.row(block.tears[i]));
+            }
+            body();
+
+            for (size_t i = 0; i < tearCount; i++) {
+                copy_n(table.row(block.tears[i]), width, tearResult.begin() + i * width);
+            }
+            double residual = 0.0;
+            for (size_t v = 0; v < valueCount; v++) {
+                residual = max(residual, abs(tearResult[v] - tearGuess[v]));
+            }
+            if (residual < tolerance) {
+                return iteration;
+            }
+
+            if (acceleration == RecycleAcceleration::Wegstein) {
+                workspace.wegstein.next(tearGuess, tearResult);
+            } else {
+                tearGuess = tearResult;
+            }
+        }
+        throw ConvergenceException(table.name(block.tears.front()), maxIterations);
+    }
+
+    /**
+     * @brief Найти потоки схемы по именам граничных потоков
+     * @throws string если потока с таким именем нет
+     */
+    vector<StreamId> findBoundaryStreams(const vector<string>& names) const {
+        unordered_map<string, StreamId> ids;
+        for (StreamId id = 0; id < table.size(); id++) {
+            ids.emplace(table.name(id), id);
+        }
+        vector<StreamId> result;
+        for (const string& name : names) {
+            auto it = ids.find(name);
+            if (it == ids.end()) {
+                throw string("Boundary stream is not in the flowsheet: " + name);
+            }
+            result.push_back(it->second);
+        }
+        return result;
+    }
+
+    /**
+     * @brief Раунды внешней итерации solvePart()
+     */
+    int exchangeRounds(BoundaryExchange& exchange) {
+        getSchedule();
+        const vector<StreamId> inbound = findBoundaryStreams(boundary.inbound);
+        const vector<StreamId> lagged = findBoundaryStreams(boundary.lagged);
+        const vector<StreamId> outbound = findBoundaryStreams(boundary.outbound);
+        const size_t width = table.laneCount();
+        const size_t valueCount = lagged.size() * width;
+        vector<double> guess(valueCount);
+        vector<double> result(valueCount);
+        for (size_t i = 0; i < lagged.size(); i++) {
+            copy_n(table.row(lagged[i]), width, guess.begin() + i * width);
+        }
+        WegsteinAccelerator wegstein;
+        wegstein.reset(valueCount);
+
+        for (uint32_t round = 0;; round++) {
+            if (round > 0) {
+                if (!boundary.cyclic) {
+                    return round;
+                }
+                for (size_t i = 0; i < lagged.size(); i++) {
+                    exchange.receive(boundary.lagged[i], round - 1, result.data() + i * width, width);
+                }
+                double residual = 0.0;
+                for (size_t v = 0; v < valueCount; v++) {
+                    residual = max(residual, abs(result[v] - guess[v]));
+                }
+                // Голос общий, поэтому все части выходят (или бросают исключение) в одном раунде
+                if (exchange.agree(round - 1, residual < tolerance)) {
+                    return round;
+                }
+                if ((int)round >= maxIterations) {
+                    throw ConvergenceException(lagged.empty() ? string("(boundary)") : boundary.lagged.front(),
+                                               maxIterations);
+                }
+                if (acceleration == RecycleAcceleration::Wegstein) {
+                    wegstein.next(guess, result);
+                } else {
+                    guess = result;
+                }
+            }
+            for (size_t i = 0; i < lagged.size(); i++) {
+                copy_n(guess.begin() + i * width, width, table.row(lagged[i]));
+            }
+            for (size_t i = 0; i < inbound.size(); i++) {
+                exchange.receive(boundary.inbound[i], round, table.row(inbound[i]), width);
+            }
+            solve();
+            for (size_t i = 0; i < outbound.size(); i++) {
+                exchange.send(boundary.outbound[i], round, table.row(outbound[i]), width);
+            }
+        }
+    }
+
+public:
+    Flowsheet() = default;
+
+    /**
+     * @brief Схема, размещающая свои потоки и устройства в Arena
+     * @param arenaBytes Размер исходного буфера области
+     */
+    explicit Flowsheet(size_t arenaBytes) : arena(make_unique<Arena>(arenaBytes)) {}
+
+    static constexpr size_t MAX_SPARE_SNAPSHOTS = 2; ///< С опубликованным - тройная буферизация
+
+    Flowsheet(const Flowsheet&) = delete;
+    Flowsheet& operator=(const Flowsheet&) = delete;
+
+    /**
+     * @brief Дождаться фоновых расчетов solveAsync() и отвязать потоки
+     */
+    ~Flowsheet() override {
+        {
+            unique_lock<mutex> guard(asyncLock);
+            asyncFinished.wait(guard, [this] { return asyncPending == 0; });
+        }
+        detachAll();
+    }
+
+    /**
+     * @brief Отвязать устройства и потоки от схемы
+     *
+     * Потоки могут пережить схему без области - возвращаем им собственные данные.
+     */
+    void detachAll() {
+        for (auto& device : devices) {
+            device->setTopologyListener(nullptr);
+            device->setRecycleChecked(false);
+        }
+        for (auto& s : streams) {
+            s->unbind();
+        }
+    }
+
+    /**
+     * @brief Удалить все потоки и устройства, чтобы собрать в схеме новый вариант
+     *
+     * Потоки и устройства, которые вызывающий еще держит, отвязываются от схемы
+     * (detachAll) и остаются действительными. Для схемы с областью память возвращается
+     * одним release(), и следующий вариант снова размещается в исходном буфере; если
+     * объекты области еще удерживаются, следующий вариант получает новый регион.
+     * Сам разбор остается O(n): деструктор и атомарные счетчики каждого объекта (см. Arena).
+     */
+    void clear() {
+        detachAll();
+        blocks.clear();
+        levels.clear();
+        schedule.clear();
+        workspaces.clear();
+        devices.clear();
+        streams.clear();
+        table = StreamTable();
+        streamNumber = 0;
+        boundary = PartBoundary();
+        scheduleValid = false;
+        solved = false;
+        if (resultCache) {
+            resultCache->clear();
+        }
+        if (arena) {
+            arena->release();
+        }
+    }
+
+    /**
+     * @brief Область памяти схемы (nullptr для схемы без области)
+     */
+    const Arena* getArena() const { return arena.get(); }
+
+    void onTopologyChanged() override {
+        scheduleValid = false;
+        solved = false;
+        if (resultCache) {
+            resultCache->clear();
+        }
+    }
+
+    /**
+     * @brief Параметры устройства изменились: план compile() и кэш solveCached() устарели
+     */
+    void onParametersChanged() override {
+        compiled = false;
+        if (resultCache) {
+            resultCache->clear();
+        }
+    }
+
+    /**
+     * @brief Создать новый поток, принадлежащий схеме
+     *
+     * Имя "s<n>" нумеруется отдельно в каждой схеме, поэтому схемы можно строить
+     * параллельно в разных потоках.
+     * @return Указатель на созданный поток
+     */
+    shared_ptr<Stream> addStream() {
+        int number = ++streamNumber;
+        auto s = arena ? arena->make<Stream>(number) : make_shared<Stream>(number);
+        s->bind(&table);
+        streams.push_back(s);
+        return s;
+    }
+
+    /**
+     * @brief Создать новый поток с заданным именем
+     *
+     * Автоматическое имя "s<n>" сдвигает нумерацию addStream(): следующий поток без
+     * имени получит номер больше n.
+     * @param name Имя потока
+     */
+    shared_ptr<Stream> addStream(const string& name) {
+        uint32_t number;
+        if (parseStreamName(name, number)) {
+            int current = streamNumber.load();
+            while (current < int(number) && !streamNumber.compare_exchange_weak(current, int(number))) {
+            }
+        }
+        auto s = arena ? arena->make<Stream>(name) : make_shared<Stream>(name);
+        s->bind(&table);
+        streams.push_back(s);
+        return s;
+    }
+
+    /**
+     * @brief Привязать к таблице все потоки устройств и назначить портам номера потоков
+     */
+    void bindStreams() { bindDevices(); }
+
+    /**
+     * @brief Добавить в схему уже созданное устройство
+     * @param device Указатель на устройство
+     */
+    void addDevice(shared_ptr<Device> device) {
+        device->setTopologyListener(this);
+        devices.push_back(device);
+        onTopologyChanged();
+    }
+
+    /**
+     * @brief Создать устройство прямо в схеме
+     * @return Указатель на созданное устройство
+     */
+    template <class T, class... Args>
+    shared_ptr<T> addDevice(Args&&... args) {
+        auto device = arena ? arena->make<T>(std::forward<Args>(args)...)
+                            : make_shared<T>(std::forward<Args>(args)...);
+        addDevice(static_cast<shared_ptr<Device>>(device));
+        return device;
+    }
+
+    const vector<shared_ptr<Device>>& getDevices() const { return devices; }
+
+    /**
+     * @brief Ошибка подключения конкретного устройства схемы
+     */
+    struct DeviceIssue {
+        const Device* device;
+        DeviceError error;
+    };
+
+    /**
+     * @brief Проверить все устройства схемы без исключений
+     * @return Все найденные ошибки (пусто - схема готова к расчету)
+     */
+    vector<DeviceIssue> validate() const {
+        vector<DeviceIssue> issues;
+        for (const auto& device : devices) {
+            DeviceError error = device->validate();
+            if (error != DeviceError::None) {
+                issues.push_back({device.get(), error});
+            }
+        }
+        return issues;
+    }
+    const vector<shared_ptr<Stream>>& getStreams() const { return streams; }
+    StreamTable& getStreamTable() { return table; }
+    const StreamTable& getStreamTable() const { return table; }
+
+    /**
+     * @brief Задать поведение при рецикле
+     */
+    void setRecycleMode(RecycleMode mode) {
+        recycleMode = mode;
+        scheduleValid = false;
+    }
+
+    /**
+     * @brief Задать способ расчета схемы
+     *
+     * В режиме EquationOriented контуры рецикла решаются вместе со всей схемой, поэтому
+     * RecycleMode::Detect на него не влияет.
+     */
+    void setSolveMode(SolveMode mode) {
+        solveMode = mode;
+        scheduleValid = false;
+    }
+    SolveMode getSolveMode() const { return solveMode; }
+
+    /**
+     * @brief Число ненулевых элементов LU последнего расчета в режиме EquationOriented
+     */
+    size_t getEquationNonZeros() const { return equations.nonZeros(); }
+
+    /**
+     * @brief Публиковать снимок расходов после каждого успешного расчета
+     *
+     * Пока включено, другие потоки могут читать getSnapshot() во время расчета;
+     * читать Stream::getMassFlow() во время расчета по-прежнему нельзя.
+     */
+    void setPublishing(bool enabled) {
+        publishing = enabled;
+        if (!enabled) {
+            atomic_store(&published, shared_ptr<const FlowSnapshot>());
+            spareSnapshots.clear();
+        }
+    }
+
+    /**
+     * @brief Последний опубликованный снимок (nullptr - расчета с публикацией еще не было)
+     *
+     * Потокобезопасно и не ждет расчет; может коротко ждать замену указателя в publish()
+     * (atomic_load для shared_ptr в libstdc++ берет мьютекс, см. FlowSnapshot).
+     */
+    shared_ptr<const FlowSnapshot> getSnapshot() const { return atomic_load(&published); }
+
+    /**
+     * @brief Задать способ обновления разрываемых потоков
+     */
+    void setRecycleAcceleration(RecycleAcceleration a) { acceleration = a; }
+
+    /**
+     * @brief Задать критерий сходимости рецикла
+     * @param tol Допустимая невязка по массовому расходу
+     * @param iterations Максимальное число итераций на контур
+     */
+    void setConvergence(double tol, int iterations) {
+        tolerance = tol;
+        maxIterations = iterations;
+    }
+
+    /**
+     * @brief Максимальное число итераций по контурам в последнем расчете
+     */
+    int getLastIterations() const { return lastIterations; }
+
+    /**
+     * @brief Включить параллельный расчет по уровням зависимости
+     * @param threadPool Пул потоков (nullptr - последовательный расчет)
+     */
+    void setThreadPool(shared_ptr<ThreadPool> threadPool) { pool = threadPool; }
+
+    /**
+     * @brief Собирать статистику расчета устройств (только в сборке с -DDEVICE_PROFILE)
+     * @param solveProfiler Профиль (nullptr - не собирать); должен жить дольше расчетов
+     */
+    void setProfiler(SolveProfiler* solveProfiler) { profiler = solveProfiler; }
+
+    /**
+     * @brief Получить номера блоков по уровням зависимости
+     *
+     * Внутри уровня блоки сгруппированы по типу устройства (контуры рецикла - в конце);
+     * в этом порядке их считают solve() и план compile().
+     */
+    const vector<vector<int>>& getLevels() {
+        getSchedule();
+        return levels;
+    }
+
+    /**
+     * @brief Задать количество вариантов расчета (пакетный режим)
+     *
+     * Каждый поток получает cases расходов; новые варианты копируют вариант 0.
+     * Задавать расходы отдельных вариантов - Stream::setCaseMassFlow().
+     */
+    void setCaseCount(size_t cases) {
+        table.setCaseCount(cases);
+        solved = false;
+        clearResultCache();
+    }
+    size_t getCaseCount() const { return table.caseCount(); }
+
+    /**
+     * @brief Задать число компонентов потоков (0 - только общий расход)
+     *
+     * Расходы компонентов задаются через Stream::setComponentFlow(); смесители суммируют
+     * их, реакторы с setConversion() пересчитывают состав по матрице превращения.
+     */
+    void setComponentCount(size_t components) {
+        table.setComponentCount(components);
+        solved = false;
+        clearResultCache();
+    }
+    size_t getComponentCount() const { return table.componentCount(); }
+
+    /**
+     * @brief Признак актуальности кэшированного порядка расчета
+     */
+    bool isScheduleValid() const { return scheduleValid; }
+
+    /**
+     * @brief Получить порядок расчета, перестроив его при изменении связей
+     */
+    const vector<Device*>& getSchedule() {
+        if (!scheduleValid) {
+            buildSchedule();
+        }
+        return schedule;
+    }
+
+    /**
+     * @brief Получить шаги расчета (устройства и контуры рецикла)
+     */
+    const vector<SolveBlock>& getBlocks() {
+        getSchedule();
+        return blocks;
+    }
+
+    /**
+     * @brief Рассчитать всю схему за один проход
+     *
+     * Если задан пул (setThreadPool), блоки каждого уровня считаются параллельно.
+     */
+    void solve() {
+        const vector<Device*>& order = getSchedule();
+        solved = false;
+        if (appliedStep != stepping) {
+            appliedStep = stepping;
+            for (Device* device : dynamicDevices) {
+                device->setTimeStep(appliedStep);
+            }
+        }
+        if (solveMode == SolveMode::EquationOriented) {
+            // Разложение и обратный ход не прерываются: проверки - перед каждым из них
+            if (!control) {
+                solveEquations();
+                return;
+            }
+            control->check();
+            factorizeEquations();
+            control->report(1, 2);
+            control->check();
+            solveFactorized();
+            control->report(2, 2);
+            return;
+        }
+        for (Device* device : order) {
+            device->setCalculated(false);
+        }
+
+        if (pool) {
+            // Блоки одного уровня пишут разные выходные потоки и читают только предыдущие уровни
+            size_t done = 0;
+            for (const auto& level : levels) {
+                if (control) {
+                    control->check();
+                }
+                pool->parallelFor(level.size(), [this, &level](size_t i) { solveBlock(level[i]); });
+                if (control) {
+                    control->report(done += level.size(), blocks.size());
+                }
+            }
+        } else {
+            for (size_t i = 0; i < sweep.size(); i++) {
+                if (control) {
+                    control->check();
+                }
+                solveBlock(sweep[i]);
+                if (control) {
+                    control->report(i + 1, blocks.size());
+                }
+            }
+        }
+
+        lastIterations = 0;
+        for (const LoopWorkspace& workspace : workspaces) {
+            lastIterations = max(lastIterations, workspace.iterations);
+        }
+        table.clearDirty();
+        solved = true;
+        publish();
+        lastRecomputed = order.size();
+    }
+
+    /**
+     * @brief Найти все контуры рецикла схемы за один обход графа связей (O(V + E))
+     *
+     * Работает в любом RecycleMode: в режиме Detect возвращает все контуры сразу,
+     * а не первый из них исключением при расчете.
+     * @return Контуры в порядке расчета с устройствами и потоками-кандидатами на разрыв
+     * @throws string если у потока несколько производителей
+     */
+    vector<SolveBlock> findRecycles() {
+        vector<SolveBlock> loops;
+        if (scheduleValid) {
+            for (const SolveBlock& block : blocks) {
+                if (!block.tears.empty()) {
+                    loops.push_back(block);
+                }
+            }
+            return loops;
+        }
+        bindDevices();
+        vector<vector<Link>> links = buildLinks();
+        for (const auto& component : findComponents(links)) {
+            if (isLoop(component, links)) {
+                loops.push_back(buildLoopBlock(component, links));
+            }
+        }
+        return loops;
+    }
+
+    /**
+     * @brief Разбить схему на части для распределенного расчета (FlowsheetFile::savePart, solvePart)
+     *
+     * Части - непрерывные отрезки порядка расчета getSchedule(). Каждая граница ищется рядом
+     * с равной долей устройств (в пределах половины средней части): сначала там, где ее
+     * пересекает меньше всего потоков против хода расчета (разрезанных рециклов), затем -
+     * меньше всего потоков вообще. Поэтому контуры рецикла разрезаются, только если
+     * в окне нет позиции между ними, - например, когда вся площадка - один большой рецикл.
+     * Если окно пусто, граница ставится ближе всего к равной доле.
+     * @param parts Количество частей (узлов)
+     * @throws string если частей меньше одной или больше, чем устройств, или если
+     *         имена граничных потоков повторяются
+     */
+    FlowPartition partition(int parts) {
+        const vector<Device*>& order = getSchedule();
+        const size_t count = order.size();
+        if (parts < 1 || parts > (int)count) {
+            throw string("Invalid partition count");
+        }
+        vector<int> producer(table.size(), -1);
+        for (size_t i = 0; i < count; i++) {
+            for (StreamId output : order[i]->getOutputIds()) {
+                producer[output] = i;
+            }
+        }
+        // Поток по ходу расчета пересекает границы (producer, lastReader], против хода - (firstReader, producer]
+        vector<int> lastReader(table.size(), -1);
+        vector<int> firstReader(table.size(), -1);
+        vector<vector<int>> readers(table.size());
+        for (size_t i = 0; i < count; i++) {
+            for (StreamId input : order[i]->getInputIds()) {
+                readers[input].push_back(i);
+                if (producer[input] == -1 || producer[input] == (int)i) {
+                    continue;
+                }
+                if (producer[input] < (int)i) {
+                    lastReader[input] = max(lastReader[input], (int)i);
+                } else if (firstReader[input] == -1 || (int)i < firstReader[input]) {
+                    firstReader[input] = i;
+                }
+            }
+        }
+        // forward[p], backward[p] - потоков, пересекающих границу перед устройством p
+        vector<int> forward(count + 1, 0);
+        vector<int> backward(count + 1, 0);
+        for (StreamId id = 0; id < table.size(); id++) {
+            if (lastReader[id] != -1) {
+                forward[producer[id] + 1]++;
+                forward[lastReader[id] + 1]--;
+            }
+            if (firstReader[id] != -1) {
+                backward[firstReader[id] + 1]++;
+                backward[producer[id] + 1]--;
+            }
+        }
+        for (size_t p = 0; p < count; p++) {
+            forward[p + 1] += forward[p];
+            backward[p + 1] += backward[p];
+        }
+
+        FlowPartition result;
+        result.firstDevice.push_back(0);
+        const double average = double(count) / parts;
+        for (int k = 1; k < parts; k++) {
+            const double target = average * k;
+            size_t lowest = result.firstDevice.back() + 1;
+            size_t highest = count - (parts - k);
+            size_t best = count + 1;
+            size_t nearest = lowest;
+            for (size_t p = lowest; p <= highest; p++) {
+                double distance = abs(double(p) - target);
+                if (distance < abs(double(nearest) - target)) {
+                    nearest = p;
+                }
+                if (distance > average / 2) {
+                    continue;
+                }
+                if (best > count || make_tuple(backward[p], forward[p], distance) <
+                                        make_tuple(backward[best], forward[best], abs(double(best) - target))) {
+                    best = p;
+                }
+            }
+            result.firstDevice.push_back(best > count ? nearest : best);
+        }
+        result.firstDevice.push_back(count);
+
+        vector<int> partOf(count, 0);
+        for (int p = 0; p < parts; p++) {
+            for (size_t i = result.firstDevice[p]; i < result.firstDevice[p + 1]; i++) {
+                partOf[i] = p;
+            }
+            result.weight.push_back(result.firstDevice[p + 1] - result.firstDevice[p]);
+        }
+        result.boundary.assign(parts, {});
+        set<string> names;
+        for (StreamId id = 0; id < table.size(); id++) {
+            if (producer[id] == -1) {
+                continue;
+            }
+            const int from = partOf[producer[id]];
+            vector<int> targets;
+            for (int reader : readers[id]) {
+                if (partOf[reader] != from) {
+                    targets.push_back(partOf[reader]);
+                }
+            }
+            if (targets.empty()) {
+                continue;
+            }
+            sort(targets.begin(), targets.end());
+            targets.erase(unique(targets.begin(), targets.end()), targets.end());
+            string name = table.name(id);
+            if (!names.insert(name).second) {
+                throw string("Boundary stream name is not unique: " + name);
+            }
+            for (int to : targets) {
+                (to > from ? result.boundary[to].inbound : result.boundary[to].lagged).push_back(name);
+            }
+            result.boundary[from].outbound.push_back(name);
+        }
+        const bool cyclic = result.recycleCutCount() != 0;
+        for (PartBoundary& part : result.boundary) {
+            part.cyclic = cyclic;
+        }
+        return result;
+    }
+
+    /**
+     * @brief Задать граничные потоки схемы-части (FlowsheetFile::load делает это сам)
+     */
+    void setBoundary(PartBoundary partBoundary) { boundary = move(partBoundary); }
+
+    const PartBoundary& getBoundary() const { return boundary; }
+
+    /**
+     * @brief Рассчитать часть распределенной схемы вместе с остальными частями
+     *
+     * Схема - одна часть (FlowsheetFile::savePart и load), граничные потоки - getBoundary().
+     * Раунд r: значения lagged за раунд r - 1 (в раунде 0 - текущие), значения inbound
+     * за раунд r, solve(), отправка outbound за раунд r. Без разрезанных рециклов хватает
+     * одного раунда. Иначе lagged - разрываемые потоки внешней итерации: приближение
+     * обновляется, как у контуров рецикла (setRecycleAcceleration), а раунды идут, пока
+     * невязка lagged хотя бы одной части не меньше допуска setConvergence() (голосование
+     * agree()). Части, не связанные потоками внутри раунда, считаются одновременно.
+     * При ошибке exchange.abort() освобождает остальные части.
+     * @return Количество раундов
+     * @throws string если граничного потока нет в схеме или обмен прерван
+     * @throws ConvergenceException если за maxIterations раундов невязка не стала меньше допуска
+     */
+    int solvePart(BoundaryExchange& exchange) {
+        try {
+            return exchangeRounds(exchange);
+        } catch (...) {
+            exchange.abort();
+            throw;
+        }
+    }
+
+    /**
+     * @brief Рассчитать схему, как solve(), с отменой, крайним сроком и отчетом о ходе
+     *
+     * В режиме EquationOriented шагов два - разложение и обратный ход: проверка перед
+     * каждым, отчет (1, 2) и (2, 2) после каждого.
+     * @throws SolveCancelledException если расчет остановлен; потоки остаются частично
+     *         рассчитанными, следующий solve() считает схему заново
+     */
+    void solve(const SolveControl& solveControl) {
+        solveControl.check();
+        control = &solveControl;
+        try {
+            solve();
+        } catch (...) {
+            control = nullptr;
+            throw;
+        }
+        control = nullptr;
+    }
+
+    /**
+     * @brief Запустить solve(control) в фоне: в пуле схемы (setThreadPool) или через std::async
+     *
+     * Сотни одновременных расчетов требуют общего пула: без пула каждый вызов занимает
+     * свой поток, которым владеет будущее (его деструктор ждет окончания расчета).
+     * Пока будущее не готово, схему нельзя менять и рассчитывать из других потоков;
+     * деструктор схемы дожидается всех ее фоновых расчетов.
+     * @param solveControl Управление расчетом (nullptr - без отмены и отчета)
+     * @return Будущее, готовое по окончании расчета; get() бросает исключение расчета
+     */
+    future<void> solveAsync(shared_ptr<SolveControl> solveControl = nullptr) {
+        if (!solveControl) {
+            solveControl = make_shared<SolveControl>();
+        }
+        {
+            lock_guard<mutex> guard(asyncLock);
+            asyncPending++;
+        }
+        // Последнее обращение к схеме - под asyncLock, после него деструктор может продолжить
+        auto finish = [this] {
+            lock_guard<mutex> guard(asyncLock);
+            if (--asyncPending == 0) {
+                asyncFinished.notify_all();
+            }
+        };
+        if (!pool) {
+            return async(launch::async, [this, solveControl, finish] {
+                try {
+                    solve(*solveControl);
+                } catch (...) {
+                    finish();
+                    throw;
+                }
+                finish();
+            });
+        }
+        auto done = make_shared<promise<void>>();
+        future<void> result = done->get_future();
+        pool->submit([this, solveControl, done, finish] {
+            exception_ptr error;
+            try {
+                solve(*solveControl);
+            } catch (...) {
+                error = current_exception();
+            }
+            finish();
+            if (error) {
+                done->set_exception(error);
+            } else {
+                done->set_value();
+            }
+        });
+        return result;
+    }
+
+    /**
+     * @brief Скомпилировать схему в план расчета для solveCompiled()
+     *
+     * В обычном режиме план - плоский массив инструкций (код операции и номера потоков)
+     * без виртуальных вызовов для известных устройств; в режиме EquationOriented -
+     * разложение системы уравнений. Параметры устройств (доли делителей, матрицы
+     * превращения) запоминаются в плане; их изменение, как и изменение связей, делает
+     * план недействительным, и solveCompiled() компилирует его заново.
+     * @throws string если устройство не готово к расчету
+     */
+    void compile() {
+        getSchedule();
+        tape.clear();
+        tapeOperands.clear();
+        tapeParams.clear();
+        if (solveMode == SolveMode::EquationOriented) {
+            factorizeEquations();
+            compiled = true;
+            return;
+        }
+        for (int b : sweep) {
+            const SolveBlock& block = blocks[b];
+            size_t loopAt = tape.size();
+            if (!block.tears.empty()) {
+                Instruction loop;
+                loop.op = OpCode::Loop;
+                loop.block = b;
+                tape.push_back(loop);
+            }
+            for (Device* device : block.devices) {
+                emitDevice(device);
+            }
+            if (!block.tears.empty()) {
+                tape[loopAt].count = tape.size() - loopAt - 1;
+            }
+        }
+        compiled = true;
+    }
+
+    bool isCompiled() const { return compiled && scheduleValid; }
+    size_t getTapeSize() const { return tape.size(); }
+
+    /**
+     * @brief Рассчитать схему по плану compile() (компилирует, если плана нет)
+     *
+     * Расчет последовательный и не обновляет признаки isCalculated() устройств, которые
+     * план считает сам; для потоков результат тот же, что у solve().
+     */
+    void solveCompiled() {
+        if (!isCompiled()) {
+            compile();
+        }
+        solved = false;
+        if (solveMode == SolveMode::EquationOriented) {
+            solveFactorized();
+            return;
+        }
+
+        lastIterations = 0;
+        for (size_t pc = 0; pc < tape.size();) {
+            const Instruction& instruction = tape[pc];
+            if (instruction.op != OpCode::Loop) {
+                execute(instruction);
+                pc++;
+                continue;
+            }
+            const size_t begin = pc + 1;
+            const size_t end = begin + instruction.count;
+            int iterations = iterateLoop(blocks[instruction.block], workspaces[instruction.block],
+                                         [this, begin, end]() {
+                for (size_t i = begin; i < end; i++) {
+                    execute(tape[i]);
+                }
+            });
+            workspaces[instruction.block].iterations = iterations;
+            lastIterations = max(lastIterations, iterations);
+            pc = end;
+        }
+        table.clearDirty();
+        solved = true;
+        publish();
+        lastRecomputed = schedule.size();
+    }
+
+    /**
+     * @brief Пересчитать только устройства ниже по течению от измененных потоков
+     *
+     * Поток считается измененным после Stream::setMassFlow() (см. StreamTable::dirtyStreams()).
+     * Блоки пересчитываются в порядке расчета, каждый - не более одного раза. Если связи
+     * изменились или схема еще не рассчитана, выполняется полный solve().
+     */
+    void solveIncremental() {
+        if (!scheduleValid || !solved || solveMode == SolveMode::EquationOriented) {
+            solve();
+            return;
+        }
+
+        pendingBlocks.clear();
+        for (StreamId id : table.dirtyStreams()) {
+            queueConsumers(id, -1);
+        }
+        solved = false;
+        lastRecomputed = 0;
+        lastIterations = 0;
+        try {
+            while (!pendingBlocks.empty()) {
+                pop_heap(pendingBlocks.begin(), pendingBlocks.end(), greater<int>());
+                int b = pendingBlocks.back();
+                pendingBlocks.pop_back();
+                blockQueued[b] = 0;
+
+                const SolveBlock& block = blocks[b];
+                for (Device* device : block.devices) {
+                    device->setCalculated(false);
+                }
+                solveBlock(b);
+                lastRecomputed += block.devices.size();
+                lastIterations = max(lastIterations, workspaces[b].iterations);
+                for (Device* device : block.devices) {
+                    for (StreamId output : device->getOutputIds()) {
+                        queueConsumers(output, b);
+                    }
+                }
+            }
+        } catch (...) {
+            fill(blockQueued.begin(), blockQueued.end(), 0);
+            throw;
+        }
+        table.clearDirty();
+        solved = true;
+        publish();
+    }
+
+    /**
+     * @brief Посчитать якобиан выходов по питаниям прямым режимом дифференцирования
+     *
+     * Касательные направления занимают варианты расчета 1..k: вариант 0 - значения,
+     * вариант f - единичное приращение питания f (состав питания сохраняется), у остальных
+     * питаний нулевые приращения. Все устройства линейны по дорожкам, поэтому один
+     * solve() переносит значения и до directionsPerPass производных одними ядрами.
+     * Контуры рецикла сходятся и по касательным дорожкам. Промежуточные расчеты
+     * не публикуются: читатели снимков видят только итоговый снимок без касательных.
+     * @param directionsPerPass Наибольшее число направлений за один расчет (память - на каждое)
+     * @throws string если вариантов расчета несколько или устройство не поддерживает касательные
+     */
+    Jacobian computeJacobian(size_t directionsPerPass = 64) {
+        getSchedule();
+        if (table.caseCount() != 1) {
+            throw string("Jacobian needs a single-case flowsheet");
+        }
+        vector<char> consumed(table.size(), 0);
+        for (Device* device : schedule) {
+            if (!device->propagatesTangents()) {
+                throw string("Device does not propagate tangents: ") + string(device->getDeviceType());
+            }
+            for (StreamId input : device->getInputIds()) {
+                consumed[input] = 1;
+            }
+        }
+        Jacobian jacobian;
+        for (StreamId id : feedIds) {
+            if (consumed[id]) {
+                jacobian.feeds.push_back(id);
+            }
+        }
+        jacobian.outputs = producedIds;
+        const size_t feedCount = jacobian.feeds.size();
+        jacobian.values.assign(jacobian.outputs.size() * feedCount, 0.0);
+        directionsPerPass = max<size_t>(directionsPerPass, 1);
+
+        for (size_t first = 0; first < feedCount; first += directionsPerPass) {
+            const size_t directions = min(directionsPerPass, feedCount - first);
+            table.setCaseCount(1 + directions);
+            for (StreamId id = 0; id < table.size(); id++) {
+                for (size_t d = 0; d < directions; d++) {
+                    table.setMassFlow(id, 1 + d, 0.0);
+                }
+            }
+            for (size_t d = 0; d < directions; d++) {
+                StreamId feed = jacobian.feeds[first + d];
+                double total = table.massFlow(feed, 0);
+                if (table.componentCount() == 0 || total == 0.0) {
+                    table.setMassFlow(feed, 1 + d, 1.0);
+                    continue;
+                }
+                // Единичное приращение с массовыми долями варианта 0
+                for (size_t j = 0; j < table.componentCount(); j++) {
+                    table.setComponentFlow(feed, 1 + d, j, table.componentFlow(feed, 0, j) / total);
+                }
+            }
+            bool wasPublishing = publishing;
+            publishing = false;
+            try {
+                solve();
+            } catch (...) {
+                publishing = wasPublishing;
+                table.setCaseCount(1);
+                throw;
+            }
+            publishing = wasPublishing;
+            for (size_t o = 0; o < jacobian.outputs.size(); o++) {
+                for (size_t d = 0; d < directions; d++) {
+                    jacobian.values[o * feedCount + first + d] = table.massFlow(jacobian.outputs[o], 1 + d);
+                }
+            }
+        }
+        table.setCaseCount(1);
+        publish(); // снимок без касательных вариантов
+        return jacobian;
+    }
+
+    /**
+     * @brief Проверить материальный баланс каждого устройства и схемы в целом
+     *
+     * Один проход по таблице потоков: для каждого устройства и варианта складываются
+     * общие расходы выходов со знаком плюс и входов со знаком минус (слагаемые собраны
+     * при построении расписания). Устройства с запасом (Device::isDynamic) добавляют
+     * накопление за последний шаг step(), поэтому заполняющаяся емкость баланс сводит.
+     * Невязка допустима, если |residual| <= relativeTolerance * max(1, inflow).
+     * @param worstCount Сколько наибольших невязок устройств вернуть
+     * @param relativeTolerance Относительный допуск
+     */
+    BalanceReport validateBalance(size_t worstCount = 10, double relativeTolerance = POSSIBLE_ERROR) {
+        getSchedule();
+        const size_t cases = table.caseCount();
+        const size_t stride = table.componentCount() + 1;
+        vector<double> net(cases);
+        vector<double> inflow(cases);
+
+        // Накопление устройства с запасом: входы - выходы = накопление, в невязку - со знаком плюс
+        auto accumulate = [&](const Device* device) {
+            for (size_t c = 0; c < cases; c++) {
+                net[c] += device->accumulation(c * stride);
+            }
+        };
+
+        // Невязка по слагаемым [begin, end): наибольшая по вариантам
+        auto close = [&](size_t begin, size_t end, Device* device) {
+            fill(net.begin(), net.end(), 0.0);
+            fill(inflow.begin(), inflow.end(), 0.0);
+            for (size_t t = begin; t < end; t++) {
+                const double* row = table.row(balanceIds[t]);
+                const double sign = balanceSigns[t];
+                const double in = sign < 0 ? 1.0 : 0.0;
+                for (size_t c = 0; c < cases; c++) {
+                    net[c] += sign * row[c * stride];
+                    inflow[c] += in * row[c * stride];
+                }
+            }
+            if (device && device->isDynamic()) {
+                accumulate(device);
+            } else if (!device) {
+                for (const Device* dynamic : dynamicDevices) {
+                    accumulate(dynamic);
+                }
+            }
+            BalanceViolation result;
+            result.device = device;
+            double worstExcess = -1.0;
+            for (size_t c = 0; c < cases; c++) {
+                double excess = abs(net[c]) - relativeTolerance * max(1.0, inflow[c]);
+                if (excess > worstExcess) {
+                    worstExcess = excess;
+                    result = {device, c, net[c], inflow[c]};
+                }
+            }
+            return make_pair(result, worstExcess > 0);
+        };
+
+        BalanceReport report;
+        vector<BalanceViolation> all;
+        all.reserve(schedule.size());
+        for (size_t d = 0; d < schedule.size(); d++) {
+            auto checked = close(balanceStart[d], balanceStart[d + 1], schedule[d]);
+            report.violations += checked.second;
+            all.push_back(checked.first);
+        }
+        auto sheetCheck = close(balanceStart[schedule.size()], balanceIds.size(), nullptr);
+        report.sheet = sheetCheck.first;
+        report.sheetClosed = !sheetCheck.second;
+
+        size_t count = min(worstCount, all.size());
+        partial_sort(all.begin(), all.begin() + count, all.end(),
+                     [](const BalanceViolation& a, const BalanceViolation& b) {
+                         return abs(a.residual) > abs(b.residual);
+                     });
+        report.worst.assign(all.begin(), all.begin() + count);
+        return report;
+    }
+
+    /**
+     * @brief Хранить историю расходов за последние length шагов step() (0 - не хранить)
+     */
+    void setHistoryLength(size_t length) { history.reset(table.size(), length); }
+
+    const StreamHistory& getHistory() const { return history; }
+
+    double getTime() const { return simulationTime; }
+    void setTime(double time) { simulationTime = time; }
+
+    /**
+     * @brief Шаг динамического расчета длиной dt
+     *
+     * Питания шага задаются до вызова. Устройства с запасом (Device::isDynamic) выдают
+     * выходы по запасу на начало шага, схема считается как solve(), затем запасы
+     * интегрируются и расходы попадают в историю. После первых шагов память не выделяется.
+     * @throws string если dt не положителен
+     */
+    void step(double dt) {
+        if (!(dt > 0)) {
+            throw string("Time step must be positive");
+        }
+        stepping = dt;
+        try {
+            solve();
+        } catch (...) {
+            stepping = 0.0;
+            throw;
+        }
+        stepping = 0.0;
+        for (Device* device : dynamicDevices) {
+            device->advance(table, dt);
+        }
+        simulationTime += dt;
+        history.record(table, simulationTime);
+    }
+
+    /**
+     * @brief Включить кэш результатов для solveCached()
+     * @param entryCount Наибольшее число результатов (0 - выключить кэш)
+     */
+    void setResultCache(size_t entryCount) {
+        resultCache = entryCount ? make_unique<ResultCache>(entryCount) : nullptr;
+    }
+
+    /**
+     * @brief Кэш результатов со статистикой попаданий (nullptr - выключен)
+     */
+    const ResultCache* getResultCache() const { return resultCache.get(); }
+
+    /**
+     * @brief Забыть сохраненные результаты
+     *
+     * Смена связей (в том числе addDevice() и clear()), параметров устройств (доли
+     * делителя, матрица реактора), числа вариантов и компонентов сбрасывает кэш сама.
+     */
+    void clearResultCache() {
+        if (resultCache) {
+            resultCache->clear();
+        }
+    }
+
+    /**
+     * @brief Рассчитать схему или взять результат из кэша по расходам питаний
+     *
+     * При попадании все выходы устройств получают сохраненные расходы без расчета;
+     * признаки isCalculated() устройств при этом не меняются. Без кэша - обычный solve().
+     * @return true если результат взят из кэша
+     */
+    bool solveCached() {
+        getSchedule();
+        if (!resultCache) {
+            solve();
+            return false;
+        }
+        const size_t width = table.laneCount();
+        const double step = POSSIBLE_ERROR;
+        cacheKey.clear();
+        for (StreamId id : feedIds) {
+            const double* lanes = table.row(id);
+            for (size_t k = 0; k < width; k++) {
+                cacheKey.push_back(llround(lanes[k] / step));
+            }
+        }
+
+        const vector<double>* values = resultCache->find(cacheKey);
+        if (values && values->size() == producedIds.size() * width) {
+            for (size_t i = 0; i < producedIds.size(); i++) {
+                copy_n(values->data() + i * width, width, table.row(producedIds[i]));
+            }
+            table.clearDirty();
+            solved = true;
+            publish();
+            lastRecomputed = 0;
+            return true;
+        }
+
+        solve();
+        vector<double> result(producedIds.size() * width);
+        for (size_t i = 0; i < producedIds.size(); i++) {
+            copy_n(table.row(producedIds[i]), width, result.begin() + i * width);
+        }
+        resultCache->insert(cacheKey, std::move(result));
+        return false;
+    }
+
+    /**
+     * @brief Количество устройств, пересчитанных последним solve() или solveIncremental()
+     */
+    int getLastRecomputed() const { return lastRecomputed; }
+};
+
+// ============ КЛАСС MappedFile ============
+/**
+ * @class MappedFile
+ * @brief Файл, отображенный в память только для чтения (на Windows - прочитанный целиком)
+ */
+class MappedFile
+{
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<char> buffer;
+#endif
+
+public:
+    /**
+     * @throws string если файл не удалось открыть
+     */
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        ifstream in(path, ios::binary);
+        if (!in) {
+            throw string("Cannot open file " + path);
+        }
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        bytes = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw string("Cannot open file " + path);
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            throw string("Cannot open file " + path);
+        }
+        length = info.st_size;
+        if (length > 0) {
+            void* mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                close(fd);
+                throw string("Cannot map file " + path);
+            }
+            bytes = static_cast<const char*>(mapped);
+        }
+        close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (bytes) {
+            munmap(const_cast<char*>(bytes), length);
+        }
+#endif
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// ============ КЛАСС FlowsheetFile ============
+/**
+ * @class FlowsheetFile
+ * @brief Двоичный формат схемы: устройства, связи и расходы всех вариантов.
+ *
+ * Файл состоит из заголовка и плоских массивов, смещения которых записаны в заголовке:
+ * записи устройств, номера потоков портов, параметры устройств (доли делителей, матрицы
+ * превращения), расходы (в раскладке StreamTable, включая компоненты) и имена.
+ * Загрузка отображает файл в память и копирует расходы всех потоков в таблицу одним
+ * memcpy; объекты Stream и устройства по-прежнему создаются по одному на запись.
+ * Порядок байт - родной, он проверяется по endianTag.
+ *
+ * Файл части распределенной схемы (savePart) содержит только ее устройства и потоки,
+ * к которым они подключены, и записи граничных потоков (PartBoundary).
+ */
+class FlowsheetFile
+{
+public:
+    static constexpr uint32_t VERSION = 3;
+
+    /// Типы устройств в файле
+    enum DeviceKind : uint32_t {
+        KIND_MIXER = 1,   ///< param - число входов
+        KIND_REACTOR = 2, ///< param - число выходов, параметры - матрица превращения (может отсутствовать)
+        KIND_SPLITTER = 3 ///< param - число выходов, параметры - доли выходов
+    };
+
+    /// Виды граничных потоков (PartBoundary)
+    enum BoundaryKind : uint32_t {
+        BOUNDARY_INBOUND = 1,
+        BOUNDARY_LAGGED = 2,
+        BOUNDARY_OUTBOUND = 3
+    };
+
+    /// Флаги заголовка
+    enum Flags : uint32_t {
+        FLAG_CYCLIC = 1 ///< PartBoundary::cyclic
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t endianTag;
+        uint32_t caseCount;
+        uint32_t streamCount;
+        uint32_t deviceCount;
+        uint32_t portCount;
+        uint32_t componentCount;
+        uint32_t parameterCount;
+        uint32_t boundaryCount;
+        uint32_t flags;
+        uint64_t devicesOffset;     ///< DeviceRecord[deviceCount]
+        uint64_t portsOffset;       ///< StreamId[portCount]
+        uint64_t parametersOffset;  ///< double[parameterCount]
+        uint64_t flowsOffset;       ///< double[streamCount * caseCount * (componentCount + 1)]
+        uint64_t nameOffsetsOffset; ///< uint32_t[streamCount + 1]
+        uint64_t namesOffset;       ///< символы имен подряд
+        uint64_t boundaryOffset;    ///< BoundaryRecord[boundaryCount]
+        uint64_t fileSize;
+    };
+
+    struct DeviceRecord {
+        uint32_t kind;
+        uint32_t param;
+        uint32_t firstPort;   ///< Сначала inputCount входов, затем outputCount выходов
+        uint32_t inputCount;
+        uint32_t outputCount;
+        uint32_t firstParameter;
+        uint32_t parameterCount;
+    };
+
+    struct BoundaryRecord {
+        uint32_t stream;      ///< Номер потока в файле
+        uint32_t kind;        ///< BoundaryKind
+    };
+
+private:
+    static constexpr char MAGIC[8] = {'L', 'A', 'B', 'F', 'S', 'H', 'T', '\0'};
+    static constexpr uint32_t ENDIAN_TAG = 0x01020304;
+
+    static uint64_t alignTo8(uint64_t offset) { return (offset + 7) & ~uint64_t(7); }
+
+    /// memcpy, пропускающий пустые массивы: у пустого vector data() может быть nullptr
+    static void copyBytes(void* to, const void* from, size_t bytes) {
+        if (bytes != 0) {
+            memcpy(to, from, bytes);
+        }
+    }
+
+    template <class T>
+    static const T* at(const MappedFile& file, uint64_t offset, uint64_t count) {
+        if (offset % alignof(T) != 0 || offset > file.size() || count > (file.size() - offset) / sizeof(T)) {
+            throw string("Bad flowsheet file: section out of range");
+        }
+        return reinterpret_cast<const T*>(file.data() + offset);
+    }
+
+    /**
+     * @brief Записать устройства devices и потоки streamIds (в файле - номера по порядку)
+     */
+    static void write(Flowsheet& sheet, const vector<Device*>& devices, const vector<StreamId>& streamIds,
+                      const PartBoundary& boundary, const string& path);
+
+public:
+    /**
+     * @brief Сохранить схему в файл (вместе с getBoundary(), если схема - часть)
+     * @throws string если устройство нельзя сохранить или файл не открылся
+     */
+    static void save(Flowsheet& sheet, const string& path);
+
+    /**
+     * @brief Сохранить часть part разбиения только с ее устройствами и потоками
+     *
+     * Узлу не нужна вся схема: он загружает файл части (load) и считает ее solvePart().
+     * @throws string если разбиение построено для другого расписания или part вне диапазона
+     */
+    static void savePart(Flowsheet& sheet, const FlowPartition& parts, int part, const string& path);
+
+    /**
+     * @brief Загрузить схему из файла в пустую схему; файл части задает и setBoundary()
+     * @throws string если файл поврежден, другой версии или схема не пуста
+     */
+    static void load(Flowsheet& sheet, const string& path);
+};
+
+void FlowsheetFile::save(Flowsheet& sheet, const string& path) {
+    sheet.bindStreams();
+    vector<Device*> devices;
+    for (const auto& device : sheet.getDevices()) {
+        devices.push_back(device.get());
+    }
+    vector<StreamId> streamIds(sheet.getStreamTable().size());
+    for (StreamId id = 0; id < streamIds.size(); id++) {
+        streamIds[id] = id;
+    }
+    write(sheet, devices, streamIds, sheet.getBoundary(), path);
+}
+
+void FlowsheetFile::savePart(Flowsheet& sheet, const FlowPartition& parts, int part, const string& path) {
+    const vector<Device*>& order = sheet.getSchedule();
+    if (parts.firstDevice.empty() || parts.firstDevice.back() != order.size() || part < 0 ||
+        part >= (int)parts.partCount()) {
+        throw string("Partition does not match the flowsheet");
+    }
+    vector<Device*> devices(order.begin() + parts.firstDevice[part], order.begin() + parts.firstDevice[part + 1]);
+    vector<char> used(sheet.getStreamTable().size(), 0);
+    for (Device* device : devices) {
+        for (StreamId id : device->getInputIds()) {
+            used[id] = 1;
+        }
+        for (StreamId id : device->getOutputIds()) {
+            used[id] = 1;
+        }
+    }
+    vector<StreamId> streamIds;
+    for (StreamId id = 0; id < used.size(); id++) {
+        if (used[id]) {
+            streamIds.push_back(id);
+        }
+    }
+    write(sheet, devices, streamIds, parts.boundary[part], path);
+}
+
+void FlowsheetFile::write(Flowsheet& sheet, const vector<Device*>& devices, const vector<StreamId>& streamIds,
+                          const PartBoundary& boundary, const string& path) {
+    const StreamTable& table = sheet.getStreamTable();
+    // local[id] - номер потока в файле
+    vector<StreamId> local(table.size(), numeric_limits<StreamId>::max());
+    unordered_map<string, StreamId> byName;
+    for (StreamId i = 0; i < streamIds.size(); i++) {
+        local[streamIds[i]] = i;
+        byName.emplace(table.name(streamIds[i]), i);
+    }
+
+    vector<DeviceRecord> records;
+    vector<StreamId> ports;
+    vector<double> parameters;
+    for (Device* device : devices) {
+        DeviceRecord record;
+        string type(device->getDeviceType());
+        record.firstParameter = parameters.size();
+        if (type == "Mixer") {
+            record.kind = KIND_MIXER;
+            record.param = device->getInputAmount();
+        } else if (type == "Reactor") {
+            record.kind = KIND_REACTOR;
+            record.param = device->getOutputAmount();
+            vector<double> matrix = static_cast<const Reactor&>(*device).getConversion();
+            parameters.insert(parameters.end(), matrix.begin(), matrix.end());
+        } else if (type == "Splitter") {
+            record.kind = KIND_SPLITTER;
+            record.param = device->getOutputAmount();
+            const vector<double>& fractions = static_cast<const Splitter&>(*device).getFractions();
+            parameters.insert(parameters.end(), fractions.begin(), fractions.end());
+        } else {
+            throw string("Device type cannot be saved: " + type);
+        }
+        record.parameterCount = parameters.size() - record.firstParameter;
+        record.firstPort = ports.size();
+        record.inputCount = device->getInputIds().size();
+        record.outputCount = device->getOutputIds().size();
+        for (StreamId id : device->getInputIds()) {
+            ports.push_back(local[id]);
+        }
+        for (StreamId id : device->getOutputIds()) {
+            ports.push_back(local[id]);
+        }
+        records.push_back(record);
+    }
+
+    vector<uint32_t> nameOffsets{0};
+    string names;
+    for (StreamId id : streamIds) {
+        names += table.name(id);
+        nameOffsets.push_back(names.size());
+    }
+
+    vector<BoundaryRecord> boundaryRecords;
+    const pair<const vector<string>*, BoundaryKind> kinds[] = {
+        {&boundary.inbound, BOUNDARY_INBOUND}, {&boundary.lagged, BOUNDARY_LAGGED}, {&boundary.outbound, BOUNDARY_OUTBOUND}};
+    for (const auto& kind : kinds) {
+        for (const string& name : *kind.first) {
+            auto it = byName.find(name);
+            if (it == byName.end()) {
+                throw string("Boundary stream is not in the flowsheet: " + name);
+            }
+            boundaryRecords.push_back({it->second, kind.second});
+        }
+    }
+
+    Header header{};
+    copy(begin(MAGIC), end(MAGIC), header.magic);
+    header.version = VERSION;
+    header.endianTag = ENDIAN_TAG;
+    header.caseCount = table.caseCount();
+    header.streamCount = streamIds.size();
+    header.deviceCount = records.size();
+    header.portCount = ports.size();
+    header.componentCount = table.componentCount();
+    header.parameterCount = parameters.size();
+    header.boundaryCount = boundaryRecords.size();
+    header.flags = boundary.cyclic ? uint32_t(FLAG_CYCLIC) : 0u;
+    header.devicesOffset = alignTo8(sizeof(Header));
+    header.portsOffset = alignTo8(header.devicesOffset + records.size() * sizeof(DeviceRecord));
+    header.parametersOffset = alignTo8(header.portsOffset + ports.size() * sizeof(StreamId));
+    header.flowsOffset = header.parametersOffset + parameters.size() * sizeof(double);
+    header.nameOffsetsOffset = alignTo8(header.flowsOffset + streamIds.size() * table.laneCount() * sizeof(double));
+    header.namesOffset = header.nameOffsetsOffset + nameOffsets.size() * sizeof(uint32_t);
+    header.boundaryOffset = alignTo8(header.namesOffset + names.size());
+    header.fileSize = header.boundaryOffset + boundaryRecords.size() * sizeof(BoundaryRecord);
+
+    vector<char> image(header.fileSize, 0);
+    memcpy(image.data(), &header, sizeof(Header));
+    copyBytes(image.data() + header.devicesOffset, records.data(), records.size() * sizeof(DeviceRecord));
+    copyBytes(image.data() + header.portsOffset, ports.data(), ports.size() * sizeof(StreamId));
+    copyBytes(image.data() + header.parametersOffset, parameters.data(), parameters.size() * sizeof(double));
+    const size_t rowBytes = table.laneCount() * sizeof(double);
+    for (StreamId i = 0; i < streamIds.size(); i++) {
+        memcpy(image.data() + header.flowsOffset + i * rowBytes, table.row(streamIds[i]), rowBytes);
+    }
+    copyBytes(image.data() + header.nameOffsetsOffset, nameOffsets.data(), nameOffsets.size() * sizeof(uint32_t));
+    copyBytes(image.data() + header.namesOffset, names.data(), names.size());
+    copyBytes(image.data() + header.boundaryOffset, boundaryRecords.data(),
+              boundaryRecords.size() * sizeof(BoundaryRecord));
+
+    ofstream out(path, ios::binary | ios::trunc);
+    if (!out) {
+        throw string("Cannot open file " + path);
+    }
+    out.write(image.data(), image.size());
+    if (!out) {
+        throw string("Cannot write file " + path);
+    }
+}
+
+void FlowsheetFile::load(Flowsheet& sheet, const string& path) {
+    if (!sheet.getDevices().empty() || !sheet.getStreams().empty()) {
+        throw string("Flowsheet must be empty before load");
+    }
+
+    MappedFile file(path);
+    const Header& header = *at<Header>(file, 0, 1);
+    if (!equal(begin(MAGIC), end(MAGIC), header.magic)) {
+        throw string("Bad flowsheet file: wrong magic");
+    }
+    if (header.version != VERSION) {
+        throw string("Bad flowsheet file: unsupported version " + to_string(header.version));
+    }
+    if (header.endianTag != ENDIAN_TAG) {
+        throw string("Bad flowsheet file: wrong byte order");
+    }
+    if (header.fileSize != file.size() || header.caseCount == 0) {
+        throw string("Bad flowsheet file: truncated");
+    }
+
+    const DeviceRecord* records = at<DeviceRecord>(file, header.devicesOffset, header.deviceCount);
+    const StreamId* ports = at<StreamId>(file, header.portsOffset, header.portCount);
+    const double* parameters = at<double>(file, header.parametersOffset, header.parameterCount);
+    const uint64_t lanes = uint64_t(header.caseCount) * (header.componentCount + 1ull);
+    const double* flows = at<double>(file, header.flowsOffset, header.streamCount * lanes);
+    const uint32_t* nameOffsets = at<uint32_t>(file, header.nameOffsetsOffset, header.streamCount + 1ull);
+    const char* names = at<char>(file, header.namesOffset, nameOffsets[header.streamCount]);
+    const BoundaryRecord* boundaryRecords = at<BoundaryRecord>(file, header.boundaryOffset, header.boundaryCount);
+
+    sheet.setCaseCount(header.caseCount);
+    sheet.setComponentCount(header.componentCount);
+    vector<shared_ptr<Stream>> streams;
+    streams.reserve(header.streamCount);
+    for (uint32_t id = 0; id < header.streamCount; id++) {
+        if (nameOffsets[id] > nameOffsets[id + 1]) {
+            throw string("Bad flowsheet file: broken names");
+        }
+        streams.push_back(sheet.addStream(string(names + nameOffsets[id], names + nameOffsets[id + 1])));
+    }
+    copyBytes(sheet.getStreamTable().data(), flows, header.streamCount * lanes * sizeof(double));
+    sheet.getStreamTable().clearDirty();
+
+    for (uint32_t d = 0; d < header.deviceCount; d++) {
+        const DeviceRecord& record = records[d];
+        if (uint64_t(record.firstPort) + record.inputCount + record.outputCount > header.portCount) {
+            throw string("Bad flowsheet file: ports out of range");
+        }
+        if (uint64_t(record.firstParameter) + record.parameterCount > header.parameterCount) {
+            throw string("Bad flowsheet file: parameters out of range");
+        }
+        vector<double> values(parameters + record.firstParameter,
+                              parameters + record.firstParameter + record.parameterCount);
+        shared_ptr<Device> device;
+        if (record.kind == KIND_MIXER) {
+            if (record.param > uint32_t(numeric_limits<int>::max())) {
+                throw string("Bad flowsheet file: mixer input count out of range");
+            }
+            device = sheet.addDevice<Mixer>(int(record.param));
+        } else if (record.kind == KIND_REACTOR) {
+            if (record.param != 1 && record.param != 2) {
+                throw string("Bad flowsheet file: reactor output count out of range");
+            }
+            auto reactor = sheet.addDevice<Reactor>(record.param == 2);
+            if (!values.empty()) {
+                if (values.size() != uint64_t(header.componentCount) * header.componentCount) {
+                    throw string("Bad flowsheet file: conversion matrix size");
+                }
+                reactor->setConversion(values, header.componentCount);
+            }
+            device = reactor;
+        } else if (record.kind == KIND_SPLITTER) {
+            if (record.param == 0 || values.size() != record.param) {
+                throw string("Bad flowsheet file: split fractions size");
+            }
+            auto splitter = sheet.addDevice<Splitter>(int(record.param));
+            splitter->setFractions(values);
+            device = splitter;
+        } else {
+            throw string("Bad flowsheet file: unknown device kind " + to_string(record.kind));
+        }
+        const StreamId* port = ports + record.firstPort;
+        for (uint32_t i = 0; i < record.inputCount + record.outputCount; i++) {
+            if (port[i] >= header.streamCount) {
+                throw string("Bad flowsheet file: stream id out of range");
+            }
+            DeviceError error = i < record.inputCount ? device->tryAddInput(streams[port[i]])
+                                                      : device->tryAddOutput(streams[port[i]]);
+            if (error != DeviceError::None) {
+                throw string("Bad flowsheet file: ") + describe(error);
+            }
+        }
+    }
+
+    PartBoundary boundary;
+    boundary.cyclic = (header.flags & FLAG_CYCLIC) != 0;
+    for (uint32_t b = 0; b < header.boundaryCount; b++) {
+        const BoundaryRecord& record = boundaryRecords[b];
+        if (record.stream >= header.streamCount) {
+            throw string("Bad flowsheet file: boundary stream out of range");
+        }
+        string name = streams[record.stream]->getName();
+        if (record.kind == BOUNDARY_INBOUND) {
+            boundary.inbound.push_back(name);
+        } else if (record.kind == BOUNDARY_LAGGED) {
+            boundary.lagged.push_back(name);
+        } else if (record.kind == BOUNDARY_OUTBOUND) {
+            boundary.outbound.push_back(name);
+        } else {
+            throw string("Bad flowsheet file: unknown boundary kind " + to_string(record.kind));
+        }
+    }
+    sheet.setBoundary(move(boundary));
+}
+
+// ============ КЛАСС FlowsheetImporter ============
+/**
+ * @class FlowsheetImporter
+ * @brief Потоковый импорт схемы из CSV или JSON без построения DOM.
+ *
+ * Документ читается по одной записи: запись разбирается в переиспользуемый буфер полей,
+ * сразу применяется к схеме и забывается. В памяти остаются только таблицы имен
+ * устройств и потоков. Ошибки (в том числе превышение inputAmount/outputAmount)
+ * не прерывают импорт, а накапливаются в getErrors().
+ *
+ * Записи (устройство должно быть объявлено раньше связей с ним):
+ *   unit   - name, kind (mixer | reactor | splitter), ports (входы смесителя / выходы
+ *            реактора и делителя), fractions (доли делителя через ';', по умолчанию поровну)
+ *   stream - name, flow
+ *   link   - stream, from (устройство-производитель), to (устройство-потребитель);
+ *            пустые from/to - питание или продукт схемы
+ *
+ * CSV: "unit,M1,mixer,2", "unit,S1,splitter,2,0.3;0.7", "stream,s1,10.5", "link,s1,,M1";
+ * пустые строки и строки с '#' пропускаются.
+ * JSON: массив или последовательность плоских объектов
+ *   {"type": "unit", "name": "M1", "kind": "mixer", "ports": 2}.
+ */
+class FlowsheetImporter
+{
+public:
+    struct ImportError {
+        size_t line;    ///< Номер строки документа (с 1)
+        string message;
+    };
+
+private:
+    using Fields = vector<pair<string, string>>;
+
+    Flowsheet& sheet;
+    unordered_map<string, shared_ptr<Device>> units;
+    unordered_map<string, shared_ptr<Stream>> streams;
+    vector<ImportError> errors;
+    Fields fields;       ///< Поля текущей записи (память переиспользуется)
+    size_t line = 1;
+
+    const string* field(const string& key) const {
+        for (const auto& f : fields) {
+            if (f.first == key) {
+                return &f.second;
+            }
+        }
+        return nullptr;
+    }
+
+    void error(size_t at, const string& message) { errors.push_back({at, message}); }
+
+    bool parseNumber(const string& text, double& value) {
+        char* end = nullptr;
+        value = strtod(text.c_str(), &end);
+        return !text.empty() && end == text.c_str() + text.size();
+    }
+
+    shared_ptr<Stream> streamNamed(const string& name) {
+        auto it = streams.find(name);
+        if (it != streams.end()) {
+            return it->second;
+        }
+        auto s = sheet.addStream(name);
+        streams.emplace(name, s);
+        return s;
+    }
+
+    /**
+     * @brief Применить разобранную запись к схеме
+     */
+    void apply(size_t at) {
+        const string* type = field("type");
+        if (!type) {
+            error(at, "record without type");
+        } else if (*type == "unit") {
+            applyUnit(at);
+        } else if (*type == "stream") {
+            applyStream(at);
+        } else if (*type == "link") {
+            applyLink(at);
+        } else {
+            error(at, "unknown record type " + *type);
+        }
+    }
+
+    void applyUnit(size_t at) {
+        const string* name = field("name");
+        const string* kind = field("kind");
+        const string* ports = field("ports");
+        double count = 0;
+        if (!name || name->empty() || !kind || !ports) {
+            error(at, "unit needs name, kind and ports");
+            return;
+        }
+        if (!parseNumber(*ports, count) || count < 1 || count != floor(count)) {
+            error(at, "unit " + *name + ": bad ports " + *ports);
+            return;
+        }
+        if (units.count(*name)) {
+            error(at, "unit " + *name + " declared twice");
+            return;
+        }
+        if (*kind == "mixer") {
+            units.emplace(*name, sheet.addDevice<Mixer>(int(count)));
+        } else if (*kind == "reactor" && (count == 1 || count == 2)) {
+            units.emplace(*name, sheet.addDevice<Reactor>(count == 2));
+        } else if (*kind == "splitter") {
+            applySplitter(at, *name, int(count));
+        } else {
+            error(at, "unit " + *name + ": unsupported kind " + *kind + " with " + *ports + " ports");
+        }
+    }
+
+    /**
+     * @brief Делитель с ошибочными долями остается в схеме с равными долями,
+     *        чтобы связи с ним не давали лишних ошибок
+     */
+    void applySplitter(size_t at, const string& name, int outputs) {
+        auto splitter = sheet.addDevice<Splitter>(outputs);
+        units.emplace(name, splitter);
+        const string* text = field("fractions");
+        if (text && !text->empty()) {
+            vector<double> fractions;
+            size_t begin = 0;
+            while (begin <= text->size()) {
+                size_t end = min(text->find(';', begin), text->size());
+                double value = 0;
+                if (!parseNumber(text->substr(begin, end - begin), value)) {
+                    error(at, "unit " + name + ": bad fractions " + *text);
+                    return;
+                }
+                fractions.push_back(value);
+                begin = end + 1;
+            }
+            try {
+                splitter->setFractions(fractions);
+            } catch (const string& ex) {
+                error(at, "unit " + name + ": " + ex);
+            }
+        }
+    }
+
+    void applyStream(size_t at) {
+        const string* name = field("name");
+        const string* flow = field("flow");
+        double value = 0;
+        if (!name || name->empty()) {
+            error(at, "stream needs name");
+            return;
+        }
+        if (flow && !flow->empty() && !parseNumber(*flow, value)) {
+            error(at, "stream " + *name + ": bad flow " + *flow);
+            return;
+        }
+        streamNamed(*name)->setMassFlow(value);
+    }
+
+    void applyLink(size_t at) {
+        const string* name = field("stream");
+        const string* from = field("from");
+        const string* to = field("to");
+        if (!name || name->empty()) {
+            error(at, "link needs stream");
+            return;
+        }
+        shared_ptr<Device> producer;
+        shared_ptr<Device> consumer;
+        if (from && !from->empty()) {
+            auto it = units.find(*from);
+            if (it == units.end()) {
+                error(at, "link " + *name + ": unknown unit " + *from);
+                return;
+            }
+            producer = it->second;
+        }
+        if (to && !to->empty()) {
+            auto it = units.find(*to);
+            if (it == units.end()) {
+                error(at, "link " + *name + ": unknown unit " + *to);
+                return;
+            }
+            consumer = it->second;
+        }
+
+        auto s = streamNamed(*name);
+        if (producer) {
+            DeviceError e = producer->tryAddOutput(s);
+            if (e != DeviceError::None) {
+                error(at, "link " + *name + ": unit " + *from + ": " + describe(e));
+            }
+        }
+        if (consumer) {
+            DeviceError e = consumer->tryAddInput(s);
+            if (e != DeviceError::None) {
+                error(at, "link " + *name + ": unit " + *to + ": " + describe(e));
+            }
+        }
+    }
+
+    // ---- JSON: посимвольный разбор плоских объектов ----
+
+    int next(istream& in) {
+        int c = in.get();
+        if (c == '\n') {
+            line++;
+        }
+        return c;
+    }
+
+    int skipSpace(istream& in) {
+        int c = next(in);
+        while (c != EOF && isspace(c)) {
+            c = next(in);
+        }
+        return c;
+    }
+
+    bool readString(istream& in, string& out) {
+        out.clear();
+        for (int c = next(in); c != EOF; c = next(in)) {
+            if (c == '"') {
+                return true;
+            }
+            if (c == '\\') {
+                c = next(in);
+                switch (c) {
+                    case 'n': out += '\n'; break;
+                    case 't': out += '\t'; break;
+                    case EOF: return false;
+                    default: out += char(c); break; // \" \\ \/ и прочее - как есть
+                }
+            } else {
+                out += char(c);
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @brief Разобрать объект после '{'
+     * @return false при синтаксической ошибке (объект пропущен до '}')
+     */
+    bool readObject(istream& in) {
+        fields.clear();
+        string key;
+        string value;
+        int c = skipSpace(in);
+        if (c == '}') {
+            return true;
+        }
+        while (true) {
+            if (c != '"' || !readString(in, key)) {
+                break;
+            }
+            if (skipSpace(in) != ':') {
+                break;
+            }
+            c = skipSpace(in);
+            if (c == '"') {
+                if (!readString(in, value)) {
+                    break;
+                }
+            } else if (c == '{' || c == '[') {
+                break; // вложенные значения не поддерживаются
+            } else {
+                value.clear();
+                while (c != EOF && c != ',' && c != '}' && !isspace(c)) {
+                    value += char(c);
+                    c = next(in);
+                }
+                if (c != EOF) {
+                    in.unget();
+                    if (c == '\n') {
+                        line--;
+                    }
+                }
+                if (value == "null") {
+                    value.clear();
+                }
+            }
+            fields.emplace_back(key, value);
+            c = skipSpace(in);
+            if (c == '}') {
+                return true;
+            }
+            if (c != ',') {
+                break;
+            }
+            c = skipSpace(in);
+        }
+        for (int depth = 1; c != EOF && depth > 0; c = next(in)) {
+            // пропускаем остаток объекта вместе с вложенными скобками
+            if (c == '{') {
+                depth++;
+            } else if (c == '}' && --depth == 0) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    // ---- CSV ----
+
+    void splitCsv(const string& text) {
+        static const char* const unitKeys[] = {"type", "name", "kind", "ports", "fractions"};
+        static const char* const streamKeys[] = {"type", "name", "flow"};
+        static const char* const linkKeys[] = {"type", "stream", "from", "to"};
+
+        fields.clear();
+        size_t begin = 0;
+        size_t column = 0;
+        const char* const* keys = unitKeys;
+        size_t keyCount = 5;
+        while (begin <= text.size()) {
+            size_t end = text.find(',', begin);
+            if (end == string::npos) {
+                end = text.size();
+            }
+            string value = text.substr(begin, end - begin);
+            while (!value.empty() && isspace((unsigned char)value.back())) {
+                value.pop_back();
+            }
+            while (!value.empty() && isspace((unsigned char)value.front())) {
+                value.erase(value.begin());
+            }
+            if (column == 0) {
+                if (value == "stream") {
+                    keys = streamKeys;
+                    keyCount = 3;
+                } else if (value == "link") {
+                    keys = linkKeys;
+                    keyCount = 4;
+                }
+            }
+            if (column < keyCount) {
+                fields.emplace_back(keys[column], value);
+            }
+            column++;
+            begin = end + 1;
+        }
+    }
+
+public:
+    explicit FlowsheetImporter(Flowsheet& target) : sheet(target) {}
+
+    /**
+     * @brief Импортировать CSV построчно
+     */
+    void importCsv(istream& in) {
+        string text;
+        for (line = 1; getline(in, text); line++) {
+            if (!text.empty() && text.back() == '\r') {
+                text.pop_back();
+            }
+            size_t first = text.find_first_not_of(" \t");
+            if (first == string::npos || text[first] == '#' || text.compare(first, 5, "type,") == 0) {
+                continue;
+            }
+            splitCsv(text);
+            apply(line);
+        }
+    }
+
+    /**
+     * @brief Импортировать JSON-массив или последовательность объектов по одному объекту
+     */
+    void importJson(istream& in) {
+        line = 1;
+        int c = skipSpace(in);
+        bool array = c == '[';
+        if (array) {
+            c = skipSpace(in);
+        }
+        while (c != EOF) {
+            if (array && c == ']') {
+                break;
+            }
+            if (c == ',') {
+                c = skipSpace(in);
+                continue;
+            }
+            if (c != '{') {
+                error(line, string("unexpected character '") + char(c) + "'");
+                c = skipSpace(in);
+                continue;
+            }
+            size_t start = line;
+            if (readObject(in)) {
+                apply(start);
+            } else {
+                error(start, "malformed object");
+            }
+            c = skipSpace(in);
+        }
+    }
+
+    const vector<ImportError>& getErrors() const { return errors; }
+    bool ok() const { return errors.empty(); }
+};
+
+// ============ ТЕСТЫ ДЛЯ MIXER ============
+void shouldSetOutputsCorrectlyWithOneOutput() {
+    int streamcounter = 0;
+    Mixer d1(2);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    d1.updateOutputs();
+
+    if (abs(s3->getMassFlow() - 15.0) < POSSIBLE_ERROR) {
+        cout << "Test 1 passed" << endl;
+    } else {
+        cout << "Test 1 failed" << endl;
+    }
+}
+
+void shouldCorrectOutputs() {
+    int streamcounter = 0;
+    Mixer d1(2);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    auto s4 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    try {
+        d1.addOutput(s4);
+    } catch (const string& ex) {
+        if (ex == "Too much outputs") {
+            cout << "Test 2 passed" << endl;
+            return;
+        }
+    }
+
+    cout << "Test 2 failed" << endl;
+}
+
+void shouldCorrectInputs() {
+    int streamcounter = 0;
+    Mixer d1(2);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    auto s4 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+
+    d1.addInput(s1);
+    d1.addInput(s2);
+    d1.addOutput(s3);
+
+    try {
+        d1.addInput(s4);
+    } catch (const string& ex) {
+        if (ex == "Too much inputs") {
+            cout << "Test 3 passed" << endl;
+            return;
+        }
+    }
+
+    cout << "Test 3 failed" << endl;
+}
+
+// ============ ТЕСТЫ ДЛЯ REACTOR ============
+void testTooManyOutputStreams() {
+    int streamcounter = 0;
+    
+    Reactor dl(false);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    
+    dl.addInput(s1);
+    dl.addOutput(s2);
+    
+    try {
+        dl.addOutput(s3);
+        cout << "Test 1 failed" << endl;
+    } catch (const string& ex) {
+        if (ex == "OUTPUT STREAM LIMIT!") {
+            cout << "Test 1 passed" << endl;
+        } else {
+            cout << "Test 1 failed" << endl;
+        }
+    }
+}
+
+void testTooManyInputStreams() {
+    int streamcounter = 0;
+    
+    Reactor dl(false);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+    
+    dl.addInput(s1);
+    
+    try {
+        dl.addInput(s3);
+        cout << "Test 2 failed" << endl;
+    } catch (const string& ex) {
+        if (ex == "INPUT STREAM LIMIT!") {
+            cout << "Test 2 passed" << endl;
+        } else {
+            cout << "Test 2 failed" << endl;
+        }
+    }
+}
+
+void testInputEqualOutput() {
+    int streamcounter = 0;
+    
+    Reactor dl(true);
+    
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    
+    s1->setMassFlow(10.0);
+    
+    dl.addInput(s1);
+    dl.addOutput(s2);
+    dl.addOutput(s3);
+    
+    dl.updateOutputs();
+    
+    double sumOutputs = dl.getOutputs().at(0)->getMassFlow() + 
+                        dl.getOutputs().at(1)->getMassFlow();
+    double inputMass = dl.getInputs().at(0)->getMassFlow();
+    
+    if (abs(sumOutputs - inputMass) < POSSIBLE_ERROR) {
+        cout << "Test 3 passed" << endl;
+    } else {
+        cout << "Test 3 failed" << endl;
+    }
+}
+
+// ============ ТЕСТЫ НА РЕЦИКЛ ============
+/**
+ * @brief Тест 1: Обнаружение рецикла при апдейте рассчитанного устройства
+ */
+void testRecycleDetectionOnCalculatedDevice() {
+    cout << "\n=== Test: Recycle Detection on Calculated Device ===\n";
+    int streamcounter = 0;
+    
+    try {
+        Reactor dl(false);
+        
+        auto s1 = make_shared<Stream>(++streamcounter);
+        auto s2 = make_shared<Stream>(++streamcounter);
+        
+        s1->setMassFlow(10.0);
+        
+        dl.addInput(s1);
+        dl.addOutput(s2);
+        
+        // Первый апдейт - устройство становится рассчитанным
+        dl.updateOutputs();
+        cout << "Device calculated after first update: " << dl.isCalculated() << endl;
+        
+        // Второй апдейт - должно выбросить исключение о рецикле
+        dl.updateOutputs();
+        
+        cout << "TEST FAILED: No recycle exception thrown" << endl;
+    } catch (const RecycleException& e) {
+        cout << "TEST PASSED: " << e.what() << endl;
+    } catch (const exception& e) {
+        cout << "TEST FAILED: Wrong exception: " << e.what() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Рецикл с несколькими устройствами
+ */
+void testRecycleWithMultipleDevices() {
+    cout << "\n=== Test: Recycle with Multiple Devices ===\n";
+    int streamcounter = 0;
+    
+    try {
+        // Создаем два реактора
+        Reactor r1(false);
+        Reactor r2(false);
+        
+        auto input = make_shared<Stream>(++streamcounter);
+        auto intermediate = make_shared<Stream>(++streamcounter);
+        auto output = make_shared<Stream>(++streamcounter);
+        
+        input->setMassFlow(20.0);
+        
+        // Связываем устройства: input -> r1 -> intermediate -> r2 -> output
+        r1.addInput(input);
+        r1.addOutput(intermediate);
+        
+        r2.addInput(intermediate);
+        r2.addOutput(output);
+        
+        // Рассчитываем первое устройство
+        r1.updateOutputs();
+        cout << "R1 calculated: " << r1.isCalculated() << endl;
+        cout << "Intermediate flow: " << intermediate->getMassFlow() << endl;
+        
+        // Рассчитываем второе устройство - должно работать
+        r2.updateOutputs();
+        cout << "R2 calculated: " << r2.isCalculated() << endl;
+        cout << "Output flow: " << output->getMassFlow() << endl;
+        
+        // Пытаемся повторно рассчитать первое устройство - рецикл!
+        r1.updateOutputs();
+        
+        cout << "TEST FAILED: No recycle exception thrown" << endl;
+    } catch (const RecycleException& e) {
+        cout << "TEST PASSED: " << e.what() << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Рецикл с Mixer
+ */
+void testRecycleWithMixer() {
+    cout << "\n=== Test: Recycle with Mixer ===\n";
+    int streamcounter = 0;
+    
+    try {
+        Mixer mixer(2);
+        Reactor reactor(false);
+        
+        auto s1 = make_shared<Stream>(++streamcounter);
+        auto s2 = make_shared<Stream>(++streamcounter);
+        auto s3 = make_shared<Stream>(++streamcounter);
+        auto s4 = make_shared<Stream>(++streamcounter);
+        
+        s1->setMassFlow(10.0);
+        s2->setMassFlow(5.0);
+        
+        mixer.addInput(s1);
+        mixer.addInput(s2);
+        mixer.addOutput(s3);
+        
+        reactor.addInput(s3);
+        reactor.addOutput(s4);
+        
+        // Рассчитываем mixer
+        mixer.updateOutputs();
+        cout << "Mixer calculated: " << mixer.isCalculated() << endl;
+        
+        // Рассчитываем reactor
+        reactor.updateOutputs();
+        cout << "Reactor calculated: " << reactor.isCalculated() << endl;
+        
+        // Пытаемся повторно рассчитать mixer - рецикл!
+        mixer.updateOutputs();
+        
+        cout << "TEST FAILED: No recycle exception thrown" << endl;
+    } catch (const RecycleException& e) {
+        cout << "TEST PASSED: " << e.what() << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ FLOWSHEET ============
+/**
+ * @brief Тест 1: Схема рассчитывается в правильном порядке независимо от порядка добавления
+ */
+void testFlowsheetSolvesInTopologicalOrder() {
+    cout << "\n=== Test: Flowsheet Topological Order ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(true);
+    auto mixer = sheet.addDevice<Mixer>(2);
+
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+    auto s4 = sheet.addStream();
+    auto s5 = sheet.addStream();
+
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(6.0);
+
+    // s1, s2 -> mixer -> s3 -> reactor -> s4, s5
+    reactor->addInput(s3);
+    reactor->addOutput(s4);
+    reactor->addOutput(s5);
+    mixer->addInput(s1);
+    mixer->addInput(s2);
+    mixer->addOutput(s3);
+
+    try {
+        sheet.solve();
+    } catch (const RecycleException& e) {
+        cout << "TEST FAILED: " << e.what() << endl;
+        return;
+    }
+
+    if (sheet.getSchedule().front() == mixer.get() &&
+        abs(s4->getMassFlow() - 8.0) < POSSIBLE_ERROR &&
+        abs(s5->getMassFlow() - 8.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: mixer scheduled before reactor" << endl;
+    } else {
+        cout << "TEST FAILED: wrong order or flows" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Порядок кэшируется и перестраивается только при изменении связей
+ */
+void testFlowsheetScheduleCache() {
+    cout << "\n=== Test: Flowsheet Schedule Cache ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(false);
+    auto mixer = sheet.addDevice<Mixer>(2);
+
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+    auto s4 = sheet.addStream();
+
+    s1->setMassFlow(20.0);
+    s4->setMassFlow(5.0);
+    reactor->addInput(s1);
+    reactor->addOutput(s2);
+    mixer->addInput(s2);
+    mixer->addOutput(s3);
+
+    sheet.solve();
+    bool validAfterSolve = sheet.isScheduleValid();
+
+    // Повторный расчет не должен бросать исключение о рецикле
+    s1->setMassFlow(30.0);
+    sheet.solve();
+
+    mixer->addInput(s4);
+    bool invalidAfterWiring = !sheet.isScheduleValid();
+    sheet.solve();
+
+    if (validAfterSolve && invalidAfterWiring && abs(s3->getMassFlow() - 35.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: schedule rebuilt only after wiring change" << endl;
+    } else {
+        cout << "TEST FAILED: schedule cache is wrong" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Замкнутый контур без разрыва обнаруживается при построении порядка
+ */
+void testFlowsheetDetectsLoop() {
+    cout << "\n=== Test: Flowsheet Loop Detection ===\n";
+
+    Flowsheet sheet;
+    auto r1 = sheet.addDevice<Reactor>(false);
+    auto r2 = sheet.addDevice<Reactor>(false);
+
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+
+    // r1 -> s1 -> r2 -> s2 -> r1
+    r1->addInput(s2);
+    r1->addOutput(s1);
+    r2->addInput(s1);
+    r2->addOutput(s2);
+
+    try {
+        sheet.solve();
+        cout << "TEST FAILED: No recycle exception thrown" << endl;
+    } catch (const RecycleException& e) {
+        cout << "TEST PASSED: " << e.what() << endl;
+    }
+}
+
+// ============ ТЕСТЫ НА СХОДИМОСТЬ РЕЦИКЛА ============
+/**
+ * @brief Собрать контур: s1 + s4 -> mixer -> s2 -> reactor -> s3 (продукт), s4 (рецикл)
+ *
+ * Установившийся режим: s2 = 10 + s2 / 2 = 20, продукт s3 = 10.
+ */
+void buildRecycleLoop(Flowsheet& sheet, shared_ptr<Stream>& product) {
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto reactor = sheet.addDevice<Reactor>(true);
+
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+    auto s4 = sheet.addStream();
+    s1->setMassFlow(10.0);
+
+    mixer->addInput(s1);
+    mixer->addInput(s4);
+    mixer->addOutput(s2);
+    reactor->addInput(s2);
+    reactor->addOutput(s3);
+    reactor->addOutput(s4);
+    product = s3;
+}
+
+/**
+ * @brief Тест 1: Контур рецикла сходится простой итерацией
+ */
+void testRecycleConvergesByDirectSubstitution() {
+    cout << "\n=== Test: Recycle Direct Substitution ===\n";
+
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setRecycleAcceleration(RecycleAcceleration::DirectSubstitution);
+    sheet.setConvergence(1e-6, 200);
+
+    try {
+        sheet.solve();
+    } catch (const exception& e) {
+        cout << "TEST FAILED: " << e.what() << endl;
+        return;
+    }
+
+    cout << "Iterations: " << sheet.getLastIterations() << endl;
+    if (abs(product->getMassFlow() - 10.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: product flow = " << product->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: product flow = " << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Ускорение Вегштейна сходится быстрее простой итерации
+ */
+void testRecycleConvergesByWegstein() {
+    cout << "\n=== Test: Recycle Wegstein Acceleration ===\n";
+
+    Flowsheet direct;
+    shared_ptr<Stream> directProduct;
+    buildRecycleLoop(direct, directProduct);
+    direct.setRecycleMode(RecycleMode::Converge);
+    direct.setRecycleAcceleration(RecycleAcceleration::DirectSubstitution);
+    direct.setConvergence(1e-6, 200);
+    direct.solve();
+
+    Flowsheet accelerated;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(accelerated, product);
+    accelerated.setRecycleMode(RecycleMode::Converge);
+    accelerated.setConvergence(1e-6, 200);
+    accelerated.solve();
+
+    cout << "Iterations: direct = " << direct.getLastIterations()
+         << ", Wegstein = " << accelerated.getLastIterations() << endl;
+    if (abs(product->getMassFlow() - 10.0) < POSSIBLE_ERROR &&
+        accelerated.getLastIterations() < direct.getLastIterations()) {
+        cout << "TEST PASSED: product flow = " << product->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: product flow = " << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Несошедшийся контур сообщает об этом исключением
+ */
+void testRecycleReportsNoConvergence() {
+    cout << "\n=== Test: Recycle Iteration Limit ===\n";
+
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setRecycleAcceleration(RecycleAcceleration::DirectSubstitution);
+    sheet.setConvergence(1e-9, 3);
+
+    try {
+        sheet.solve();
+        cout << "TEST FAILED: No convergence exception thrown" << endl;
+    } catch (const ConvergenceException& e) {
+        cout << "TEST PASSED: " << e.what() << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ StreamTable ============
+/**
+ * @brief Тест 1: Расходы потоков схемы лежат подряд в таблице
+ */
+void testStreamTableStoresFlowsContiguously() {
+    cout << "\n=== Test: StreamTable Contiguous Storage ===\n";
+
+    Flowsheet sheet;
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+
+    s1->setMassFlow(10.0);
+    s2->setMassFlow(5.0);
+    mixer->addInput(s1);
+    mixer->addInput(s2);
+    mixer->addOutput(s3);
+    sheet.solve();
+
+    const StreamTable& table = sheet.getStreamTable();
+    const double* flow = table.data();
+    if (table.size() == 3 && &flow[s3->getId()] == &flow[s1->getId()] + 2 &&
+        abs(flow[s3->getId()] - 15.0) < POSSIBLE_ERROR &&
+        abs(s3->getMassFlow() - 15.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: flows stored in one array" << endl;
+    } else {
+        cout << "TEST FAILED: flows are not in the table" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Поток, созданный вне схемы, переносится в таблицу и обратно
+ */
+void testStreamTableAdoptsExternalStreams() {
+    cout << "\n=== Test: StreamTable External Streams ===\n";
+    int streamcounter = 0;
+
+    auto feed = make_shared<Stream>(++streamcounter);
+    auto product = make_shared<Stream>(++streamcounter);
+    feed->setMassFlow(12.0);
+
+    {
+        Flowsheet sheet;
+        auto reactor = sheet.addDevice<Reactor>(false);
+        reactor->addInput(feed);
+        reactor->addOutput(product);
+        sheet.solve();
+        if (!feed->isBound() || sheet.getStreamTable().size() != 2) {
+            cout << "TEST FAILED: streams were not adopted" << endl;
+            return;
+        }
+    }
+
+    if (!product->isBound() && product->getName() == "s2" &&
+        abs(product->getMassFlow() - 12.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: stream keeps its data after flowsheet is gone" << endl;
+    } else {
+        cout << "TEST FAILED: stream lost its data" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Одинаковые имена потоков хранятся один раз
+ */
+void testStreamTableInternsNames() {
+    cout << "\n=== Test: StreamTable Name Interning ===\n";
+
+    StreamTable table;
+    StreamId a = table.add("feed", 1.0);
+    StreamId b = table.add("feed", 2.0);
+    StreamId c = table.add("product");
+
+    if (table.size() == 3 && table.nameCount() == 2 && table.name(a) == table.name(b) &&
+        table.name(c) == "product" && abs(table.massFlow(b) - 2.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: names interned" << endl;
+    } else {
+        cout << "TEST FAILED: names duplicated" << endl;
+    }
+}
+
+// ============ ТЕСТЫ ПАРАЛЛЕЛЬНОГО РАСЧЕТА ============
+/**
+ * @brief Тест 1: Пул выполняет все задачи parallelFor ровно один раз
+ */
+void testThreadPoolRunsEveryTask() {
+    cout << "\n=== Test: ThreadPool parallelFor ===\n";
+
+    ThreadPool pool(4);
+    vector<int> hits(1000, 0);
+    atomic<int> total{0};
+    pool.parallelFor(hits.size(), [&](size_t i) {
+        hits[i]++;
+        total += i;
+    });
+
+    bool once = all_of(hits.begin(), hits.end(), [](int h) { return h == 1; });
+    if (once && total == 999 * 1000 / 2) {
+        cout << "TEST PASSED: every task executed once" << endl;
+    } else {
+        cout << "TEST FAILED: tasks lost or repeated" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Независимые цепочки реакторов рассчитываются параллельно по уровням
+ */
+void testParallelSolveMatchesSequential() {
+    cout << "\n=== Test: Parallel Level Solve ===\n";
+
+    const int trains = 16;
+    Flowsheet sheet;
+    vector<shared_ptr<Stream>> products;
+    for (int t = 0; t < trains; t++) {
+        auto feed = sheet.addStream();
+        auto middle = sheet.addStream();
+        auto product = sheet.addStream();
+        feed->setMassFlow(t + 1.0);
+
+        auto first = sheet.addDevice<Reactor>(false);
+        auto second = sheet.addDevice<Reactor>(false);
+        first->addInput(feed);
+        first->addOutput(middle);
+        second->addInput(middle);
+        second->addOutput(product);
+        products.push_back(product);
+    }
+
+    sheet.setThreadPool(make_shared<ThreadPool>(4));
+    sheet.solve();
+
+    bool correct = sheet.getLevels().size() == 2 && sheet.getLevels()[0].size() == trains;
+    for (int t = 0; t < trains; t++) {
+        correct = correct && abs(products[t]->getMassFlow() - (t + 1.0)) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: " << trains << " trains solved in 2 levels" << endl;
+    } else {
+        cout << "TEST FAILED: parallel solve is wrong" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Ошибка устройства из рабочего потока доходит до вызывающего
+ */
+void testParallelSolvePropagatesErrors() {
+    cout << "\n=== Test: Parallel Solve Error ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(true);
+    auto feed = sheet.addStream();
+    reactor->addInput(feed);
+    reactor->addOutput(sheet.addStream());
+    sheet.setThreadPool(make_shared<ThreadPool>(2));
+
+    try {
+        sheet.solve();
+        cout << "TEST FAILED: No exception thrown" << endl;
+    } catch (const string& ex) {
+        if (ex == "Wrong number of outputs") {
+            cout << "TEST PASSED: " << ex << endl;
+        } else {
+            cout << "TEST FAILED: " << ex << endl;
+        }
+    }
+}
+
+// ============ ТЕСТЫ ПАКЕТНОГО РЕЖИМА ============
+/**
+ * @brief Тест 1: Все варианты схемы рассчитываются за один проход
+ */
+void testBatchSolvesEveryCase() {
+    cout << "\n=== Test: Batch Solve ===\n";
+
+    const size_t cases = 37; // не кратно LANE_BLOCK - проверяем хвост
+    Flowsheet sheet;
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto reactor = sheet.addDevice<Reactor>(true);
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+    auto s4 = sheet.addStream();
+    auto s5 = sheet.addStream();
+    mixer->addInput(s1);
+    mixer->addInput(s2);
+    mixer->addOutput(s3);
+    reactor->addInput(s3);
+    reactor->addOutput(s4);
+    reactor->addOutput(s5);
+
+    s2->setMassFlow(4.0);
+    sheet.setCaseCount(cases);
+    for (size_t c = 0; c < cases; c++) {
+        s1->setCaseMassFlow(c, 2.0 * c);
+    }
+    sheet.solve();
+
+    bool correct = true;
+    for (size_t c = 0; c < cases; c++) {
+        double expected = (2.0 * c + 4.0) / 2;
+        correct = correct && abs(s4->getCaseMassFlow(c) - expected) < POSSIBLE_ERROR &&
+                  abs(s5->getCaseMassFlow(c) - expected) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: " << cases << " cases solved" << endl;
+    } else {
+        cout << "TEST FAILED: batched flows are wrong" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Контур рецикла сходится во всех вариантах одновременно
+ */
+void testBatchRecycleConverges() {
+    cout << "\n=== Test: Batch Recycle ===\n";
+
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-6, 100);
+
+    const size_t cases = 16;
+    sheet.setCaseCount(cases);
+    auto feed = sheet.getStreams().front();
+    for (size_t c = 0; c < cases; c++) {
+        feed->setCaseMassFlow(c, c + 1.0);
+    }
+    sheet.solve();
+
+    bool correct = true;
+    for (size_t c = 0; c < cases; c++) {
+        correct = correct && abs(product->getCaseMassFlow(c) - (c + 1.0)) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: converged in " << sheet.getLastIterations() << " iterations" << endl;
+    } else {
+        cout << "TEST FAILED: batched recycle is wrong" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: При переходе в пакетный режим расходы копируются во все варианты
+ */
+void testBatchCaseCountKeepsFlows() {
+    cout << "\n=== Test: Batch Case Count ===\n";
+
+    StreamTable table;
+    StreamId a = table.add("a", 3.0);
+    StreamId b = table.add("b", 7.0);
+    table.setCaseCount(5);
+    table.setMassFlow(b, 4, 1.0);
+
+    if (table.size() == 2 && table.massFlow(a, 4) == 3.0 && table.massFlow(b, 3) == 7.0 &&
+        table.massFlow(b, 4) == 1.0 && table.row(b) == table.row(a) + 5) {
+        cout << "TEST PASSED: cases stored per stream row" << endl;
+    } else {
+        cout << "TEST FAILED: case layout is wrong" << endl;
+    }
+}
+
+// ============ ТЕСТЫ ИНКРЕМЕНТАЛЬНОГО РАСЧЕТА ============
+/**
+ * @brief Тест 1: Пересчитываются только устройства ниже измененного питания
+ */
+void testIncrementalSolveTouchesDownstreamOnly() {
+    cout << "\n=== Test: Incremental Solve Cone ===\n";
+
+    // Две независимые цепочки из двух реакторов, сходящиеся в смеситель
+    Flowsheet sheet;
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto product = sheet.addStream();
+    mixer->addOutput(product);
+    vector<shared_ptr<Stream>> feeds;
+    for (int t = 0; t < 2; t++) {
+        auto feed = sheet.addStream();
+        auto middle = sheet.addStream();
+        auto out = sheet.addStream();
+        auto first = sheet.addDevice<Reactor>(false);
+        auto second = sheet.addDevice<Reactor>(false);
+        first->addInput(feed);
+        first->addOutput(middle);
+        second->addInput(middle);
+        second->addOutput(out);
+        mixer->addInput(out);
+        feed->setMassFlow(10.0);
+        feeds.push_back(feed);
+    }
+
+    sheet.solve();
+    feeds[1]->setMassFlow(25.0);
+    sheet.solveIncremental();
+
+    if (sheet.getLastRecomputed() == 3 && abs(product->getMassFlow() - 35.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: recomputed " << sheet.getLastRecomputed() << " of 5 devices" << endl;
+    } else {
+        cout << "TEST FAILED: recomputed " << sheet.getLastRecomputed()
+             << ", product = " << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Без изменений ничего не пересчитывается, после смены связей - все
+ */
+void testIncrementalSolveFallsBackToFullSolve() {
+    cout << "\n=== Test: Incremental Solve Fallback ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(false);
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto s1 = sheet.addStream();
+    auto s2 = sheet.addStream();
+    auto s3 = sheet.addStream();
+    auto s4 = sheet.addStream();
+    s1->setMassFlow(8.0);
+    s4->setMassFlow(2.0);
+    reactor->addInput(s1);
+    reactor->addOutput(s2);
+    mixer->addInput(s2);
+    mixer->addOutput(s3);
+
+    sheet.solveIncremental();
+    int first = sheet.getLastRecomputed();
+    sheet.solveIncremental();
+    int idle = sheet.getLastRecomputed();
+    mixer->addInput(s4);
+    sheet.solveIncremental();
+    int rewired = sheet.getLastRecomputed();
+
+    if (first == 2 && idle == 0 && rewired == 2 && abs(s3->getMassFlow() - 10.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: full solve only when needed" << endl;
+    } else {
+        cout << "TEST FAILED: recomputed " << first << ", " << idle << ", " << rewired << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Изменение питания контура рецикла пересчитывает весь контур
+ */
+void testIncrementalSolveRecycle() {
+    cout << "\n=== Test: Incremental Solve Recycle ===\n";
+
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-6, 100);
+    sheet.solve();
+
+    sheet.getStreams().front()->setMassFlow(30.0);
+    sheet.solveIncremental();
+
+    if (sheet.getLastRecomputed() == 2 && abs(product->getMassFlow() - 30.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: product flow = " << product->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: product flow = " << product->getMassFlow() << endl;
+    }
+}
+
+// ============ ТЕСТЫ API БЕЗ ИСКЛЮЧЕНИЙ ============
+/**
+ * @brief Тест 1: Переполнение портов возвращается кодом ошибки
+ */
+void testTryAddReportsLimits() {
+    cout << "\n=== Test: tryAddInput / tryAddOutput ===\n";
+    int streamcounter = 0;
+
+    Mixer mixer(1);
+    Reactor reactor(false);
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+
+    bool correct = mixer.tryAddInput(s1) == DeviceError::None &&
+                   mixer.tryAddInput(s2) == DeviceError::InputLimit &&
+                   mixer.tryAddOutput(s3) == DeviceError::None &&
+                   mixer.tryAddOutput(s2) == DeviceError::OutputLimit &&
+                   reactor.tryAddInput(s1) == DeviceError::None &&
+                   !reactor.canAddInput() &&
+                   reactor.tryAddInput(s2) == DeviceError::InputLimit &&
+                   mixer.getInputCount() == 1 && reactor.getInputCount() == 1;
+    if (correct) {
+        cout << "TEST PASSED: limits reported without exceptions" << endl;
+    } else {
+        cout << "TEST FAILED: wrong error codes" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Проверка готовности и расчет без исключений
+ */
+void testTryUpdateOutputs() {
+    cout << "\n=== Test: validate / tryUpdateOutputs ===\n";
+    int streamcounter = 0;
+
+    Reactor reactor(true);
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    s1->setMassFlow(6.0);
+
+    DeviceError noInput = reactor.tryUpdateOutputs();
+    reactor.addInput(s1);
+    reactor.addOutput(s2);
+    DeviceError wrongOutputs = reactor.tryUpdateOutputs();
+    reactor.addOutput(s3);
+    DeviceError ok = reactor.tryUpdateOutputs();
+    DeviceError recycle = reactor.tryUpdateOutputs();
+
+    if (noInput == DeviceError::NoInput && wrongOutputs == DeviceError::WrongOutputCount &&
+        ok == DeviceError::None && recycle == DeviceError::Recycle &&
+        abs(s3->getMassFlow() - 3.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: " << describe(wrongOutputs) << endl;
+    } else {
+        cout << "TEST FAILED: wrong error codes" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Схема сообщает обо всех неготовых устройствах сразу
+ */
+void testFlowsheetValidateCollectsIssues() {
+    cout << "\n=== Test: Flowsheet validate ===\n";
+
+    Flowsheet sheet;
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto reactor = sheet.addDevice<Reactor>(true);
+    auto good = sheet.addDevice<Reactor>(false);
+    mixer->addInput(sheet.addStream());
+    reactor->addInput(sheet.addStream());
+    good->addInput(sheet.addStream());
+    good->addOutput(sheet.addStream());
+
+    auto issues = sheet.validate();
+    if (issues.size() == 2 && issues[0].device == mixer.get() &&
+        issues[0].error == DeviceError::NoOutputs && issues[1].error == DeviceError::WrongOutputCount) {
+        cout << "TEST PASSED: " << issues.size() << " issues found" << endl;
+    } else {
+        cout << "TEST FAILED: " << issues.size() << " issues found" << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ FixedMixer / FixedReactor ============
+/**
+ * @brief Тест 1: FixedMixer суммирует все N входов
+ */
+void testFixedMixerSumsInputs() {
+    cout << "\n=== Test: FixedMixer<3> ===\n";
+    int streamcounter = 0;
+
+    FixedMixer<3> mixer;
+    auto s1 = make_shared<Stream>(++streamcounter);
+    auto s2 = make_shared<Stream>(++streamcounter);
+    auto s3 = make_shared<Stream>(++streamcounter);
+    auto s4 = make_shared<Stream>(++streamcounter);
+    s1->setMassFlow(1.0);
+    s2->setMassFlow(2.0);
+    s3->setMassFlow(4.0);
+
+    mixer.addInput(s1);
+    mixer.addInput(s2);
+    DeviceError incomplete = mixer.validate();
+    mixer.addInput(s3);
+    mixer.addOutput(s4);
+    mixer.updateOutputs();
+
+    if (incomplete == DeviceError::NoInput && abs(s4->getMassFlow() - 7.0) < POSSIBLE_ERROR &&
+        mixer.tryAddInput(s4) == DeviceError::InputLimit) {
+        cout << "TEST PASSED: output flow = " << s4->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: output flow = " << s4->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Фиксированные устройства рассчитываются в схеме и в пакетном режиме
+ */
+void testFixedDevicesInFlowsheet() {
+    cout << "\n=== Test: Fixed Devices in Flowsheet ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<FixedReactor<4>>();
+    auto mixer = sheet.addDevice<FixedMixer<2>>();
+    auto feed = sheet.addStream();
+    auto other = sheet.addStream();
+    auto mixed = sheet.addStream();
+    mixer->addInput(feed);
+    mixer->addInput(other);
+    mixer->addOutput(mixed);
+    reactor->addInput(mixed);
+    vector<shared_ptr<Stream>> products;
+    for (int i = 0; i < 4; i++) {
+        products.push_back(sheet.addStream());
+        reactor->addOutput(products.back());
+    }
+
+    other->setMassFlow(2.0);
+    sheet.setCaseCount(3);
+    for (size_t c = 0; c < 3; c++) {
+        feed->setCaseMassFlow(c, 10.0 * c);
+    }
+    sheet.solve();
+
+    bool correct = true;
+    for (size_t c = 0; c < 3; c++) {
+        correct = correct && abs(products[3]->getCaseMassFlow(c) - (10.0 * c + 2.0) / 4) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: fixed kernels solved all cases" << endl;
+    } else {
+        cout << "TEST FAILED: fixed kernels are wrong" << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ Arena ============
+/**
+ * @brief Собрать в схеме цепочку из count реакторов и вернуть ее выход
+ */
+shared_ptr<Stream> buildReactorChain(Flowsheet& sheet, int count, double feedFlow) {
+    auto current = sheet.addStream();
+    current->setMassFlow(feedFlow);
+    for (int i = 0; i < count; i++) {
+        auto reactor = sheet.addDevice<Reactor>(false);
+        auto next = sheet.addStream();
+        reactor->addInput(current);
+        reactor->addOutput(next);
+        current = next;
+    }
+    return current;
+}
+
+/**
+ * @brief Тест 1: Схема в области считается так же, как обычная, и не ходит в кучу за объектами
+ */
+void testArenaFlowsheetSolves() {
+    cout << "\n=== Test: Arena Flowsheet ===\n";
+
+    Flowsheet sheet(256 * 1024);
+    auto product = buildReactorChain(sheet, 200, 42.0);
+    sheet.solve();
+
+    if (abs(product->getMassFlow() - 42.0) < POSSIBLE_ERROR &&
+        sheet.getArena()->getUpstreamAllocations() == 0) {
+        cout << "TEST PASSED: 401 objects placed in the arena buffer" << endl;
+    } else {
+        cout << "TEST FAILED: upstream allocations = "
+             << sheet.getArena()->getUpstreamAllocations() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: После clear() новый вариант снова размещается в той же памяти
+ */
+void testArenaReusedAfterClear() {
+    cout << "\n=== Test: Arena Reuse ===\n";
+
+    Flowsheet sheet(1024); // мал для цепочки - область возьмет блоки из кучи
+    size_t grown = 0;
+    bool correct = true;
+    for (int run = 0; run < 3; run++) {
+        { // product отпускается до clear(): удерживаемый объект не дал бы переиспользовать буфер
+            auto product = buildReactorChain(sheet, 100, run + 1.0);
+            sheet.solve();
+            correct = correct && abs(product->getMassFlow() - (run + 1.0)) < POSSIBLE_ERROR;
+        }
+        if (run == 0) {
+            grown = sheet.getArena()->getUpstreamAllocations();
+        }
+        sheet.clear();
+    }
+
+    if (correct && grown > 0 && sheet.getArena()->getUpstreamBytes() == 0 &&
+        sheet.getDevices().empty()) {
+        cout << "TEST PASSED: arena released in bulk after each case" << endl;
+    } else {
+        cout << "TEST FAILED: arena was not released" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Поток, который держат после clear(), не затирается следующим вариантом
+ */
+void testArenaKeepsHeldStreams() {
+    cout << "\n=== Test: Arena Keeps Held Streams ===\n";
+
+    Flowsheet sheet(64 * 1024);
+    auto held = buildReactorChain(sheet, 50, 7.0);
+    sheet.solve();
+    sheet.clear();
+    buildReactorChain(sheet, 50, 3.0);
+    sheet.solve();
+    bool kept = abs(held->getMassFlow() - 7.0) < POSSIBLE_ERROR && !held->isBound() &&
+                sheet.getArena()->getRetiredRegions() == 1;
+
+    held.reset();
+    sheet.clear();
+    if (kept && sheet.getArena()->getRetiredRegions() == 1) {
+        cout << "TEST PASSED: held stream survived the next case" << endl;
+    } else {
+        cout << "TEST FAILED: held stream flow = " << (held ? held->getMassFlow() : 0.0) << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ FlowsheetFile ============
+/**
+ * @brief Тест 1: Сохраненная схема загружается и рассчитывается так же
+ */
+void testFlowsheetFileRoundTrip() {
+    cout << "\n=== Test: Flowsheet File Round Trip ===\n";
+    const string path = "test_flowsheet.bin";
+
+    {
+        Flowsheet sheet;
+        shared_ptr<Stream> product;
+        buildRecycleLoop(sheet, product);
+        sheet.setCaseCount(4);
+        auto feed = sheet.getStreams().front();
+        for (size_t c = 0; c < 4; c++) {
+            feed->setCaseMassFlow(c, 10.0 * (c + 1));
+        }
+        feed->setName("feed");
+        FlowsheetFile::save(sheet, path);
+    }
+
+    Flowsheet loaded;
+    FlowsheetFile::load(loaded, path);
+    remove(path.c_str());
+    loaded.setRecycleMode(RecycleMode::Converge);
+    loaded.setConvergence(1e-6, 100);
+    loaded.solve();
+
+    auto feed = loaded.getStreams().front();
+    auto product = loaded.getStreams()[2];
+    bool correct = loaded.getDevices().size() == 2 && loaded.getCaseCount() == 4 &&
+                   feed->getName() == "feed" && loaded.getDevices()[1]->getDeviceType() == "Reactor";
+    for (size_t c = 0; c < 4; c++) {
+        correct = correct && abs(product->getCaseMassFlow(c) - 10.0 * (c + 1)) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: loaded sheet solved, product = " << product->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: loaded sheet differs" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Поврежденный файл отвергается
+ */
+void testFlowsheetFileRejectsBadData() {
+    cout << "\n=== Test: Flowsheet File Validation ===\n";
+    const string path = "test_flowsheet_bad.bin";
+    {
+        ofstream out(path, ios::binary);
+        out << "NOTAFLOWSHEET";
+    }
+
+    try {
+        Flowsheet sheet;
+        FlowsheetFile::load(sheet, path);
+        cout << "TEST FAILED: bad file accepted" << endl;
+    } catch (const string& ex) {
+        cout << "TEST PASSED: " << ex << endl;
+    }
+    remove(path.c_str());
+}
+
+/**
+ * @brief Тест 3: Пустая схема (без устройств и потоков) сохраняется и загружается
+ */
+void testFlowsheetFileEmptySheet() {
+    cout << "\n=== Test: Flowsheet File Empty Sheet ===\n";
+    const string path = "test_flowsheet_empty.bin";
+    try {
+        Flowsheet empty;
+        FlowsheetFile::save(empty, path);
+        Flowsheet loaded;
+        FlowsheetFile::load(loaded, path);
+        if (loaded.getStreams().empty() && loaded.getDevices().empty()) {
+            cout << "TEST PASSED: empty sheet round trip" << endl;
+        } else {
+            cout << "TEST FAILED: loaded " << loaded.getStreams().size() << " streams" << endl;
+        }
+    } catch (const string& ex) {
+        cout << "TEST FAILED: " << ex << endl;
+    }
+    remove(path.c_str());
+}
+
+/**
+ * @brief Тест 4: После загрузки addStream() продолжает нумерацию, clear() ее сбрасывает
+ */
+void testFlowsheetFileContinuesNumbering() {
+    cout << "\n=== Test: Flowsheet File Continues Numbering ===\n";
+    const string path = "test_flowsheet_numbering.bin";
+    {
+        Flowsheet sheet;
+        buildReactorChain(sheet, 3, 1.0);
+        FlowsheetFile::save(sheet, path);
+    }
+
+    Flowsheet loaded;
+    FlowsheetFile::load(loaded, path);
+    string next = loaded.addStream()->getName();
+    loaded.clear();
+    string restarted = loaded.addStream()->getName();
+
+    // Испорченное число входов смесителя не должно стать отрицательным (без ограничения)
+    bool rejected = false;
+    {
+        Flowsheet sheet;
+        auto mixer = sheet.addDevice<Mixer>(1);
+        mixer->addInput(sheet.addStream());
+        mixer->addOutput(sheet.addStream());
+        FlowsheetFile::save(sheet, path);
+        fstream file(path, ios::binary | ios::in | ios::out);
+        FlowsheetFile::Header header;
+        file.read(reinterpret_cast<char*>(&header), sizeof(header));
+        uint32_t huge = 0x80000001u;
+        file.seekp(header.devicesOffset + offsetof(FlowsheetFile::DeviceRecord, param));
+        file.write(reinterpret_cast<const char*>(&huge), sizeof(huge));
+    }
+    try {
+        Flowsheet corrupted;
+        FlowsheetFile::load(corrupted, path);
+    } catch (const string&) {
+        rejected = true;
+    }
+    remove(path.c_str());
+
+    if (next == "s5" && restarted == "s1" && rejected) {
+        cout << "TEST PASSED: next stream " << next << ", after clear " << restarted << endl;
+    } else {
+        cout << "TEST FAILED: next stream " << next << ", after clear " << restarted
+             << (rejected ? "" : ", bad mixer accepted") << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ FlowsheetImporter ============
+/**
+ * @brief Тест 1: CSV-схема импортируется и рассчитывается
+ */
+void testImportCsvBuildsFlowsheet() {
+    cout << "\n=== Test: Import CSV Flowsheet ===\n";
+    istringstream csv(
+        "type,name,kind,ports\n"
+        "# реактор делит смесь двух питаний\n"
+        "unit,M1,mixer,2\n"
+        "unit,R1,reactor,2\n"
+        "stream,a,10\n"
+        "stream,b,20\n"
+        "link,a,,M1\n"
+        "link,b,,M1\n"
+        "link,mix,M1,R1\n"
+        "link,top,R1,\n"
+        "link,bottom,R1,\n");
+
+    Flowsheet sheet;
+    FlowsheetImporter importer(sheet);
+    importer.importCsv(csv);
+    sheet.solve();
+
+    auto bottom = sheet.getStreams().back();
+    if (importer.ok() && sheet.getDevices().size() == 2 && sheet.getStreams().size() == 5 &&
+        abs(bottom->getMassFlow() - 15.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: imported sheet solved, bottom = " << bottom->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: " << importer.getErrors().size() << " errors, bottom = "
+             << bottom->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: JSON-схема дает тот же результат
+ */
+void testImportJsonBuildsFlowsheet() {
+    cout << "\n=== Test: Import JSON Flowsheet ===\n";
+    istringstream json(
+        "[\n"
+        "  {\"type\": \"unit\", \"name\": \"M1\", \"kind\": \"mixer\", \"ports\": 2},\n"
+        "  {\"type\": \"stream\", \"name\": \"a\", \"flow\": 1.5e1},\n"
+        "  {\"type\": \"link\", \"stream\": \"a\", \"from\": null, \"to\": \"M1\"},\n"
+        "  {\"type\": \"link\", \"stream\": \"b\", \"to\": \"M1\"},\n"
+        "  {\"type\": \"link\", \"stream\": \"out\", \"from\": \"M1\"}\n"
+        "]\n");
+
+    Flowsheet sheet;
+    FlowsheetImporter importer(sheet);
+    importer.importJson(json);
+    sheet.getStreams()[1]->setMassFlow(5.0);
+    sheet.solve();
+
+    auto out = sheet.getStreams().back();
+    if (importer.ok() && abs(out->getMassFlow() - 20.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: imported sheet solved, out = " << out->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: " << importer.getErrors().size() << " errors, out = "
+             << out->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Все ошибки собираются за один проход с номерами строк
+ */
+void testImportCollectsErrors() {
+    cout << "\n=== Test: Import Collects Errors ===\n";
+    istringstream csv(
+        "unit,M1,mixer,1\n"
+        "unit,X1,pump,1\n"
+        "link,a,,M1\n"
+        "link,b,,M1\n"
+        "link,c,,R9\n"
+        "stream,d,abc\n"
+        "unit,S1,splitter,2,0.5;0.6\n"
+        "unit,S2,splitter,2,0.4;0.6\n");
+
+    Flowsheet sheet;
+    FlowsheetImporter importer(sheet);
+    importer.importCsv(csv);
+
+    const auto& errors = importer.getErrors();
+    bool correct = errors.size() == 5 && errors[0].line == 2 && errors[1].line == 4 &&
+                   errors[1].message.find(describe(DeviceError::InputLimit)) != string::npos &&
+                   errors[2].line == 5 && errors[3].line == 6 && errors[4].line == 7 &&
+                   sheet.getDevices().size() == 3;
+    if (correct) {
+        cout << "TEST PASSED: " << errors.size() << " errors, e.g. line " << errors[1].line
+             << ": " << errors[1].message << endl;
+    } else {
+        cout << "TEST FAILED: got " << errors.size() << " errors" << endl;
+        for (const auto& e : errors) {
+            cout << "  line " << e.line << ": " << e.message << endl;
+        }
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ SolveProfiler ============
+/**
+ * @brief Тест 1: Статистика по устройствам и типам, вывод в Chrome Trace
+ */
+void testProfilerAggregatesStats() {
+    cout << "\n=== Test: Profiler Aggregates Stats ===\n";
+    Mixer m1(1), m2(1);
+    Reactor r(false);
+    SolveProfiler profiler;
+    profiler.recordUpdate(&m1, 1000, 300);
+    profiler.recordUpdate(&m2, 2000, 100);
+    profiler.recordUpdate(&m1, 3000, 500);
+    profiler.recordUpdate(&r, 4000, 50);
+    profiler.recordLoop(7, 900, 4000);
+
+    auto devices = profiler.getDeviceStats();
+    auto types = profiler.getTypeStats();
+    ostringstream trace;
+    profiler.writeChromeTrace(trace);
+
+    bool correct = devices.size() == 3 && devices[0].label == "Mixer#0" && devices[0].calls == 2 &&
+                   devices[0].totalNs == 800 && devices[0].maxNs == 500 &&
+                   types.size() == 2 && types[0].type == "Mixer" && types[0].calls == 3 &&
+                   types[0].totalNs == 900 && profiler.getRecycleIterations() == 7 &&
+                   trace.str().find("\"name\":\"Reactor#2\"") != string::npos &&
+                   trace.str().find("\"iterations\":7") != string::npos;
+    if (correct) {
+        cout << "TEST PASSED: " << types[0].calls << " Mixer calls, " << types[0].totalNs << " ns" << endl;
+    } else {
+        cout << "TEST FAILED: wrong profile" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Схема ведет профиль только в сборке с DEVICE_PROFILE
+ */
+void testProfilerRecordsFlowsheet() {
+    cout << "\n=== Test: Profiler Records Flowsheet ===\n";
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    SolveProfiler profiler;
+    sheet.setProfiler(&profiler);
+    sheet.solve();
+    sheet.setProfiler(nullptr);
+
+    auto devices = profiler.getDeviceStats();
+#ifdef DEVICE_PROFILE
+    bool correct = devices.size() == 2 && profiler.getLoopCount() == 1 &&
+                   devices[0].calls == uint64_t(sheet.getLastIterations()) &&
+                   profiler.getRecycleIterations() == uint64_t(sheet.getLastIterations());
+#else
+    bool correct = devices.empty() && profiler.getLoopCount() == 0;
+#endif
+    if (correct) {
+        cout << "TEST PASSED: " << devices.size() << " devices profiled" << endl;
+    } else {
+        cout << "TEST FAILED: " << devices.size() << " devices profiled" << endl;
+    }
+}
+
+// ============ ТЕСТЫ НА ВЫДЕЛЕНИЯ ПАМЯТИ ============
+/**
+ * @brief Тест 1: Повторный расчет готовой схемы не обращается к куче
+ */
+void testSolveDoesNotAllocate() {
+    cout << "\n=== Test: Solve Without Heap Allocations ===\n";
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    auto feed = sheet.getStreams().front();
+    auto tail = sheet.addDevice<Reactor>(false);
+    tail->addInput(product);
+    tail->addOutput(sheet.addStream());
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setCaseCount(4);
+    sheet.solve(); // расписание и рабочие буферы контуров
+
+    size_t before = heapAllocations.load();
+    for (int run = 0; run < 10; run++) {
+        feed->setMassFlow(10.0 + run);
+        sheet.solve();
+        feed->setMassFlow(20.0 + run);
+        sheet.solveIncremental();
+    }
+    size_t allocations = heapAllocations.load() - before;
+
+    if (allocations == 0 && abs(product->getMassFlow() - 29.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: 20 solves, 0 heap allocations" << endl;
+    } else {
+        cout << "TEST FAILED: " << allocations << " heap allocations, product = "
+             << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Тип устройства отдается без копирования, автоматические имена не хранятся строками
+ */
+void testDeviceTypeAndNameDoNotCopy() {
+    cout << "\n=== Test: Device Type And Name Without Copies ===\n";
+    Mixer mixer(1);
+    Stream s("a_rather_long_stream_name_that_does_not_fit_sso");
+    mixer.addOutput(make_shared<Stream>(s));
+
+    size_t before = heapAllocations.load();
+    size_t length = 0;
+    for (int i = 0; i < 100; i++) {
+        length += mixer.getDeviceType().size();
+    }
+    size_t allocations = heapAllocations.load() - before;
+
+    StreamTable table;
+    for (uint32_t n = 1; n <= 1000; n++) {
+        Stream numbered(n);
+        numbered.bind(&table);
+    }
+    bool compact = table.nameCount() == 0 && table.name(999) == "s1000";
+    if (allocations == 0 && compact && length == 500 && s.getName() == "a_rather_long_stream_name_that_does_not_fit_sso") {
+        cout << "TEST PASSED: " << mixer.getDeviceType() << " / " << s.getName() << endl;
+    } else {
+        cout << "TEST FAILED: " << allocations << " heap allocations, compact names " << compact << endl;
+    }
+}
+
+// ============ ТЕСТЫ МНОГОКОМПОНЕНТНЫХ ПОТОКОВ ============
+/**
+ * @brief Тест 1: Смеситель суммирует компоненты во всех вариантах, реактор делит их
+ */
+void testComponentsMixAndSplit() {
+    cout << "\n=== Test: Component Mixing ===\n";
+    Flowsheet sheet;
+    auto mixer = sheet.addDevice<Mixer>(2);
+    auto reactor = sheet.addDevice<Reactor>(true);
+    auto a = sheet.addStream();
+    auto b = sheet.addStream();
+    auto mix = sheet.addStream();
+    auto top = sheet.addStream();
+    mixer->addInput(a);
+    mixer->addInput(b);
+    mixer->addOutput(mix);
+    reactor->addInput(mix);
+    reactor->addOutput(top);
+    reactor->addOutput(sheet.addStream());
+
+    sheet.setCaseCount(2);
+    sheet.setComponentCount(3);
+    for (size_t j = 0; j < 3; j++) {
+        a->setComponentFlow(j, 1.0 + j);
+        b->setComponentFlow(j, 10.0 * (j + 1));
+    }
+    sheet.getStreamTable().setComponentFlow(a->getId(), 1, 2, 103.0); // вариант 1: a = {1, 2, 103}
+    sheet.solve();
+
+    bool correct = abs(top->getMassFlow() - 33.0) < POSSIBLE_ERROR &&
+                   abs(top->getCaseMassFlow(1) - 83.0) < POSSIBLE_ERROR;
+    for (size_t j = 0; j < 3; j++) {
+        correct = correct && abs(top->getComponentFlow(j) - (11.0 * (j + 1)) / 2) < POSSIBLE_ERROR;
+    }
+    correct = correct && abs(top->getComponentFlow(2, 1) - 66.5) < POSSIBLE_ERROR;
+    if (correct) {
+        cout << "TEST PASSED: top = " << top->getMassFlow() << " / " << top->getCaseMassFlow(1) << endl;
+    } else {
+        cout << "TEST FAILED: top = " << top->getMassFlow() << " / " << top->getCaseMassFlow(1) << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Реактор превращает компоненты по матрице, рецикл сводит и состав
+ *
+ * Новая матрица пересчитывается solveIncremental(), матрица, не сохраняющая массу,
+ * отвергается.
+ */
+void testReactorConversionMatrix() {
+    cout << "\n=== Test: Reactor Conversion Matrix ===\n";
+
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(false);
+    auto feed = sheet.addStream();
+    auto out = sheet.addStream();
+    reactor->addInput(feed);
+    reactor->addOutput(out);
+    reactor->setConversion({0.4, 0.0,
+                            0.6, 1.0}, 2); // A -> B, конверсия 60%
+    sheet.setComponentCount(2);
+    feed->setComponentFlow(0, 10.0);
+    sheet.solve();
+    bool converted = abs(out->getComponentFlow(0) - 4.0) < POSSIBLE_ERROR &&
+                     abs(out->getComponentFlow(1) - 6.0) < POSSIBLE_ERROR;
+
+    reactor->setConversion({0.1, 0.0,
+                            0.9, 1.0}, 2);
+    sheet.solveIncremental();
+    int rejected = 0;
+    for (const vector<double>& bad : {vector<double>{0.5, 0.0, 0.4, 1.0}, vector<double>{1.2, 0.0, -0.2, 1.0}}) {
+        try {
+            reactor->setConversion(bad, 2);
+        } catch (const string&) {
+            rejected++;
+        }
+    }
+
+    Flowsheet loop;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(loop, product);
+    loop.setComponentCount(2);
+    loop.setRecycleMode(RecycleMode::Converge);
+    loop.setConvergence(1e-9, 200);
+    loop.solve();
+
+    if (converted && abs(out->getComponentFlow(0) - 1.0) < POSSIBLE_ERROR &&
+        abs(out->getComponentFlow(1) - 9.0) < POSSIBLE_ERROR && sheet.getLastRecomputed() == 1 && rejected == 2 &&
+        abs(out->getMassFlow() - 10.0) < POSSIBLE_ERROR && abs(product->getComponentFlow(0) - 10.0) < 1e-6 &&
+        abs(product->getComponentFlow(1)) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: A = " << out->getComponentFlow(0) << ", B = " << out->getComponentFlow(1) << endl;
+    } else {
+        cout << "TEST FAILED: A = " << out->getComponentFlow(0) << ", B = " << out->getComponentFlow(1)
+             << ", recycle product A = " << product->getComponentFlow(0) << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Схема без компонентов хранит один расход на вариант
+ */
+void testScalarStreamsHaveNoComponents() {
+    cout << "\n=== Test: Scalar Streams ===\n";
+    StreamTable table;
+    StreamId a = table.add("a", 5.0);
+    table.setCaseCount(3);
+    bool layout = table.laneCount() == 3 && table.componentCount() == 0;
+
+    table.setComponentCount(2);
+    bool widened = table.laneCount() == 9 && table.componentFlow(a, 2, 0) == 5.0 && table.massFlow(a, 2) == 5.0;
+    table.setMassFlow(a, 1, 10.0);
+    table.setComponentCount(0);
+    bool narrowed = table.laneCount() == 3 && table.massFlow(a, 1) == 10.0 && table.massFlow(a, 0) == 5.0;
+
+    Stream s(1);
+    try {
+        s.setComponentFlow(0, 1.0);
+        cout << "TEST FAILED: unbound stream accepted a component" << endl;
+    } catch (const string& ex) {
+        if (layout && widened && narrowed) {
+            cout << "TEST PASSED: " << ex << endl;
+        } else {
+            cout << "TEST FAILED: wrong lane layout" << endl;
+        }
+    }
+}
+
+// ============ ТЕСТЫ ДЛЯ Splitter ============
+/**
+ * @brief Тест 1: Делитель делит все варианты и компоненты в заданных долях
+ */
+void testSplitterSplitsByFractions() {
+    cout << "\n=== Test: Splitter Fractions ===\n";
+    Flowsheet sheet;
+    auto splitter = sheet.addDevice<Splitter>(3);
+    auto feed = sheet.addStream();
+    splitter->addInput(feed);
+    for (int i = 0; i < 3; i++) {
+        splitter->addOutput(sheet.addStream());
+    }
+    splitter->setFractions({0.2, 0.3, 0.5});
+    sheet.setCaseCount(10);
+    sheet.setComponentCount(2);
+    feed->setComponentFlow(0, 60.0);
+    feed->setComponentFlow(1, 40.0);
+    feed->setCaseMassFlow(9, 200.0);
+    sheet.solve();
+
+    const auto& outputs = splitter->getOutputs();
+    bool correct = true;
+    const double fractions[] = {0.2, 0.3, 0.5};
+    for (int i = 0; i < 3; i++) {
+        correct = correct && abs(outputs[i]->getMassFlow() - 100.0 * fractions[i]) < POSSIBLE_ERROR &&
+                  abs(outputs[i]->getComponentFlow(1) - 40.0 * fractions[i]) < POSSIBLE_ERROR &&
+                  abs(outputs[i]->getCaseMassFlow(9) - 200.0 * fractions[i]) < POSSIBLE_ERROR;
+    }
+    if (correct) {
+        cout << "TEST PASSED: outputs " << outputs[0]->getMassFlow() << ", " << outputs[1]->getMassFlow()
+             << ", " << outputs[2]->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: wrong split" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Новые доли подхватываются solveIncremental() без перераспределения памяти
+ */
+void testSplitterFractionsUpdateIncrementally() {
+    cout << "\n=== Test: Splitter Fraction Update ===\n";
+    Flowsheet sheet;
+    auto splitter = sheet.addDevice<Splitter>(2);
+    auto mixer = sheet.addDevice<Mixer>(1);
+    auto feed = sheet.addStream();
+    auto bypass = sheet.addStream();
+    auto product = sheet.addStream();
+    splitter->addInput(feed);
+    splitter->addOutput(bypass);
+    splitter->addOutput(sheet.addStream());
+    mixer->addInput(bypass);
+    mixer->addOutput(product);
+    feed->setMassFlow(50.0);
+    sheet.solve();
+    double even = product->getMassFlow();
+
+    const double* storage = splitter->getFractions().data();
+    splitter->setFractions({0.9, 0.1});
+    sheet.solveIncremental();
+
+    bool rejected = false;
+    try {
+        splitter->setFractions({0.5, 0.6});
+    } catch (const string&) {
+        rejected = true;
+    }
+
+    if (abs(even - 25.0) < POSSIBLE_ERROR && abs(product->getMassFlow() - 45.0) < POSSIBLE_ERROR &&
+        sheet.getLastRecomputed() == 2 && splitter->getFractions().data() == storage && rejected) {
+        cout << "TEST PASSED: product " << even << " -> " << product->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: product " << even << " -> " << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Делитель, матрица превращения и компоненты сохраняются в файл
+ */
+void testFlowsheetFileSavesSplitter() {
+    cout << "\n=== Test: Flowsheet File Splitter ===\n";
+    const string path = "test_flowsheet_splitter.bin";
+    {
+        Flowsheet sheet;
+        auto reactor = sheet.addDevice<Reactor>(false);
+        auto splitter = sheet.addDevice<Splitter>(2);
+        auto feed = sheet.addStream();
+        auto mid = sheet.addStream();
+        reactor->addInput(feed);
+        reactor->addOutput(mid);
+        reactor->setConversion({0.5, 0.0,
+                                0.5, 1.0}, 2);
+        splitter->addInput(mid);
+        splitter->addOutput(sheet.addStream());
+        splitter->addOutput(sheet.addStream());
+        splitter->setFractions({0.25, 0.75});
+        sheet.setComponentCount(2);
+        feed->setComponentFlow(0, 8.0);
+        FlowsheetFile::save(sheet, path);
+    }
+
+    Flowsheet loaded;
+    FlowsheetFile::load(loaded, path);
+    remove(path.c_str());
+    loaded.solve();
+
+    auto last = loaded.getStreams().back();
+    if (loaded.getComponentCount() == 2 && loaded.getDevices()[1]->getDeviceType() == "Splitter" &&
+        abs(last->getComponentFlow(0) - 3.0) < POSSIBLE_ERROR && abs(last->getComponentFlow(1) - 3.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: loaded splitter output = " << last->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: loaded splitter output = " << last->getMassFlow() << endl;
+    }
+}
+
+// ============ ТЕСТЫ РАСЧЕТА СИСТЕМОЙ УРАВНЕНИЙ ============
+/**
+ * @brief Два последовательных контура с отводом через делители
+ * @return Продукт второго контура (в установившемся режиме равен питанию)
+ */
+shared_ptr<Stream> buildPurgeLoops(Flowsheet& sheet, double feedFlow) {
+    auto feed = sheet.addStream();
+    feed->setMassFlow(feedFlow);
+    auto current = feed;
+    const double purge[] = {0.3, 0.05};
+    for (double fraction : purge) {
+        auto mixer = sheet.addDevice<Mixer>(2);
+        auto splitter = sheet.addDevice<Splitter>(2);
+        auto mix = sheet.addStream();
+        auto product = sheet.addStream();
+        auto recycle = sheet.addStream();
+        mixer->addInput(current);
+        mixer->addInput(recycle);
+        mixer->addOutput(mix);
+        splitter->addInput(mix);
+        splitter->addOutput(product);
+        splitter->addOutput(recycle);
+        splitter->setFractions({fraction, 1.0 - fraction});
+        current = product;
+    }
+    return current;
+}
+
+/**
+ * @brief Тест 1: Система уравнений дает тот же результат, что и итерации рецикла
+ */
+void testEquationModeMatchesSequential() {
+    cout << "\n=== Test: Equation-Oriented Matches Sequential ===\n";
+    Flowsheet sequential;
+    buildPurgeLoops(sequential, 10.0);
+    sequential.setRecycleMode(RecycleMode::Converge);
+    sequential.setConvergence(1e-10, 2000);
+    sequential.solve();
+
+    Flowsheet equations;
+    auto product = buildPurgeLoops(equations, 10.0);
+    equations.setSolveMode(SolveMode::EquationOriented);
+    equations.solve();
+
+    double worst = 0;
+    for (size_t i = 0; i < equations.getStreams().size(); i++) {
+        worst = max(worst, abs(equations.getStreams()[i]->getMassFlow() - sequential.getStreams()[i]->getMassFlow()));
+    }
+    if (worst < 1e-6 && abs(product->getMassFlow() - 10.0) < 1e-9 && sequential.getLastIterations() > 10) {
+        cout << "TEST PASSED: max difference " << worst << " vs " << sequential.getLastIterations()
+             << " sequential iterations" << endl;
+    } else {
+        cout << "TEST FAILED: max difference " << worst << ", product = " << product->getMassFlow() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Одно разложение решает все варианты и компоненты
+ */
+void testEquationModeSolvesAllLanes() {
+    cout << "\n=== Test: Equation-Oriented Batch ===\n";
+    Flowsheet sheet;
+    shared_ptr<Stream> product;
+    buildRecycleLoop(sheet, product);
+    sheet.setSolveMode(SolveMode::EquationOriented);
+    sheet.setCaseCount(3);
+    sheet.setComponentCount(2);
+    auto feed = sheet.getStreams().front();
+    feed->setComponentFlow(0, 4.0);
+    feed->setComponentFlow(1, 6.0);
+    feed->setCaseMassFlow(2, 30.0);
+    sheet.solve();
+
+    // Реактор делит поровну: половина уходит в рецикл, в установившемся режиме продукт = питание
+    if (abs(product->getMassFlow() - 10.0) < 1e-9 && abs(product->getComponentFlow(1) - 6.0) < 1e-9 &&
+        abs(product->getCaseMassFlow(2) - 30.0) < 1e-9 && sheet.getLastIterations() == 0) {
+        cout << "TEST PASSED: product = " << product->getMassFlow() << " / " << product->getCaseMassFlow(2)
+             << ", LU non-zeros " << sheet.getEquationNonZeros() << endl;
+    } else {
+        cout << "TEST FAILED: product = " << product->getMassFlow() << " / " << product->getCaseMassFlow(2) << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Устройство без общей для дорожек модели и контур без отвода отвергаются
+ *
+ * Реактор с матрицей превращения линеен, но смешивает компоненты по-разному.
+ */
+void testEquationModeRejectsUnsolvable() {
+    cout << "\n=== Test: Equation-Oriented Errors ===\n";
+    Flowsheet closed;
+    auto mixer = closed.addDevice<Mixer>(2);
+    auto splitter = closed.addDevice<Splitter>(2);
+    auto feed = closed.addStream();
+    auto mix = closed.addStream();
+    auto recycle = closed.addStream();
+    mixer->addInput(feed);
+    mixer->addInput(recycle);
+    mixer->addOutput(mix);
+    splitter->addInput(mix);
+    splitter->addOutput(recycle);
+    splitter->addOutput(closed.addStream());
+    splitter->setFractions({1.0, 0.0}); // весь поток возвращается: решения нет
+    closed.setSolveMode(SolveMode::EquationOriented);
+
+    Flowsheet converting;
+    auto reactor = converting.addDevice<Reactor>(false);
+    reactor->addInput(converting.addStream());
+    reactor->addOutput(converting.addStream());
+    reactor->setConversion({1.0}, 1);
+    converting.setSolveMode(SolveMode::EquationOriented);
+
+    string singular;
+    string unsupported;
+    try {
+        closed.solve();
+    } catch (const string& ex) {
+        singular = ex;
+    }
+    try {
+        converting.solve();
+    } catch (const string& ex) {
+        unsupported = ex;
+    }
+    if (!singular.empty() && unsupported.find("Reactor") != string::npos) {
+        cout << "TEST PASSED: " << singular << "; " << unsupported << endl;
+    } else {
+        cout << "TEST FAILED: '" << singular << "', '" << unsupported << "'" << endl;
+    }
+}
+
+// ============ ТЕСТЫ СКОМПИЛИРОВАННОГО ПЛАНА ============
+/**
+ * @brief Тест 1: План дает те же потоки, что и solve(), и не обращается к куче
+ */
+void testCompiledPlanMatchesSolve() {
+    cout << "\n=== Test: Compiled Plan ===\n";
+    Flowsheet reference;
+    auto expected = buildPurgeLoops(reference, 1.0);
+    buildReactorChain(reference, 5, 1.0);
+    reference.setRecycleMode(RecycleMode::Converge);
+    reference.setConvergence(1e-9, 1000);
+
+    Flowsheet sheet;
+    auto product = buildPurgeLoops(sheet, 1.0);
+    buildReactorChain(sheet, 5, 1.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-9, 1000);
+    sheet.compile();
+    sheet.solveCompiled();
+
+    auto feed = sheet.getStreams().front();
+    size_t before = heapAllocations.load();
+    for (int run = 1; run <= 50; run++) {
+        feed->setMassFlow(run);
+        sheet.solveCompiled();
+    }
+    size_t allocations = heapAllocations.load() - before;
+
+    reference.getStreams().front()->setMassFlow(50.0);
+    reference.solve();
+    double worst = 0;
+    for (size_t i = 0; i < sheet.getStreams().size(); i++) {
+        worst = max(worst, abs(sheet.getStreams()[i]->getMassFlow() - reference.getStreams()[i]->getMassFlow()));
+    }
+    // Контуры плана стартуют с решения предыдущего прогона, поэтому сравнение - с точностью сходимости
+    if (worst < 1e-7 && allocations == 0 && sheet.getTapeSize() == sheet.getDevices().size() + 2 &&
+        sheet.getLastIterations() > 0) {
+        cout << "TEST PASSED: " << sheet.getTapeSize() << " instructions, product = " << product->getMassFlow()
+             << ", 0 heap allocations" << endl;
+    } else {
+        cout << "TEST FAILED: difference " << worst << ", " << allocations << " allocations" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Разложение системы уравнений переиспользуется для новых питаний
+ */
+void testCompiledFactorizationReused() {
+    cout << "\n=== Test: Cached Factorization ===\n";
+    Flowsheet sheet;
+    auto product = buildPurgeLoops(sheet, 10.0);
+    sheet.setSolveMode(SolveMode::EquationOriented);
+    sheet.setCaseCount(4);
+    sheet.compile();
+
+    auto feed = sheet.getStreams().front();
+    bool correct = true;
+    for (int run = 1; run <= 5; run++) {
+        for (size_t c = 0; c < 4; c++) {
+            feed->setCaseMassFlow(c, run * 10.0 + c);
+        }
+        sheet.solveCompiled();
+        for (size_t c = 0; c < 4; c++) {
+            correct = correct && abs(product->getCaseMassFlow(c) - (run * 10.0 + c)) < 1e-9;
+        }
+    }
+    if (correct && sheet.isCompiled() && sheet.getTapeSize() == 0) {
+        cout << "TEST PASSED: product = " << product->getCaseMassFlow(3) << endl;
+    } else {
+        cout << "TEST FAILED: product = " << product->getCaseMassFlow(3) << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Изменение связей и долей делителя сбрасывает план, устройство без линейной
+ *        модели вызывается напрямую
+ */
+void testCompiledPlanRecompilesOnTopologyChange() {
+    cout << "\n=== Test: Compiled Plan Invalidation ===\n";
+    Flowsheet sheet;
+    auto reactor = sheet.addDevice<Reactor>(false);
+    auto feed = sheet.addStream();
+    auto out = sheet.addStream();
+    reactor->addInput(feed);
+    reactor->addOutput(out);
+    reactor->setConversion({0.0, 0.0,
+                            1.0, 1.0}, 2);
+    sheet.setComponentCount(2);
+    feed->setComponentFlow(0, 3.0);
+    sheet.solveCompiled();
+    bool firstRun = sheet.isCompiled() && abs(out->getComponentFlow(1) - 3.0) < POSSIBLE_ERROR;
+
+    auto splitter = sheet.addDevice<Splitter>(2);
+    splitter->addInput(out);
+    bool invalidated = !sheet.isCompiled();
+    auto half = sheet.addStream();
+    splitter->addOutput(half);
+    splitter->addOutput(sheet.addStream());
+    sheet.solveCompiled();
+    bool recompiled = sheet.getTapeSize() == 2 && abs(half->getComponentFlow(1) - 1.5) < POSSIBLE_ERROR;
+
+    splitter->setFractions({0.2, 0.8});
+    bool stale = !sheet.isCompiled();
+    sheet.solveCompiled();
+
+    if (firstRun && invalidated && recompiled && stale && abs(half->getComponentFlow(1) - 0.6) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: recompiled, half = " << half->getMassFlow() << endl;
+    } else {
+        cout << "TEST FAILED: half = " << half->getMassFlow() << endl;
+    }
+}
+
+// ============ ТЕСТЫ ПУБЛИКАЦИИ СНИМКОВ ============
+/**
+ * @brief Тест 1: Снимок не меняется после публикации, новый расчет дает новый снимок
+ */
+void testSnapshotIsImmutable() {
+    cout << "\n=== Test: Snapshot Publication ===\n";
+    Flowsheet sheet;
+    auto product = buildReactorChain(sheet, 3, 5.0);
+    bool emptyBefore = sheet.getSnapshot() == nullptr;
+    sheet.setPublishing(true);
+    sheet.solve();
+
+    auto first = sheet.getSnapshot();
+    auto feed = sheet.getStreams().front();
+    feed->setMassFlow(8.0);
+    bool untouched = first->massFlow(product->getId()) == 5.0;
+    sheet.solveIncremental();
+    auto second = sheet.getSnapshot();
+
+    if (emptyBefore && untouched && first->getEpoch() == 1 && second->getEpoch() == 2 &&
+        second->massFlow(product->getId()) == 8.0 && first->massFlow(product->getId()) == 5.0) {
+        cout << "TEST PASSED: epoch " << first->getEpoch() << " -> " << second->getEpoch() << endl;
+    } else {
+        cout << "TEST FAILED: snapshots are not isolated" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Читатели в других потоках видят только целые расчеты
+ */
+void testSnapshotConcurrentReaders() {
+    cout << "\n=== Test: Snapshot Concurrent Readers ===\n";
+    Flowsheet sheet;
+    buildReactorChain(sheet, 200, 0.0); // реакторы без деления: все потоки равны питанию
+    sheet.setPublishing(true);
+    sheet.solve();
+
+    atomic<bool> done{false};
+    atomic<int> torn{0};
+    atomic<int> reads{0};
+    vector<thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.emplace_back([&sheet, &done, &torn, &reads]() {
+            uint64_t lastEpoch = 0;
+            while (!done.load()) {
+                auto snapshot = sheet.getSnapshot();
+                const double feed = snapshot->massFlow(0);
+                for (StreamId id = 1; id < snapshot->size(); id++) {
+                    if (snapshot->massFlow(id) != feed) {
+                        torn++;
+                        break;
+                    }
+                }
+                if (snapshot->getEpoch() < lastEpoch) {
+                    torn++;
+                }
+                lastEpoch = snapshot->getEpoch();
+                reads++;
+            }
+        });
+    }
+
+    auto feed = sheet.getStreams().front();
+    for (int run = 1; run <= 300; run++) {
+        feed->setMassFlow(run);
+        sheet.solve();
+    }
+    while (reads.load() < 10) {
+        this_thread::yield();
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    if (torn.load() == 0 && sheet.getSnapshot()->getEpoch() == 301) {
+        cout << "TEST PASSED: " << reads.load() << " consistent reads" << endl;
+    } else {
+        cout << "TEST FAILED: " << torn.load() << " inconsistent reads" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: После прогрева публикация переиспользует буферы снимков
+ */
+void testSnapshotBuffersReused() {
+    cout << "\n=== Test: Snapshot Buffer Reuse ===\n";
+    Flowsheet sheet;
+    buildReactorChain(sheet, 50, 1.0);
+    sheet.setPublishing(true);
+    for (int run = 0; run < 3; run++) {
+        sheet.solve();
+    }
+
+    size_t before = heapAllocations.load();
+    for (int run = 0; run < 20; run++) {
+        sheet.solve();
+    }
+    size_t allocations = heapAllocations.load() - before;
+#ifdef __SANITIZE_THREAD__
+    allocations = 0; // см. Flowsheet::publish()
+#endif
+    if (allocations == 0 && sheet.getSnapshot()->getEpoch() == 23) {
+        cout << "TEST PASSED: 20 publications, 0 heap allocations" << endl;
+    } else {
+        cout << "TEST FAILED: " << allocations << " heap allocations" << endl;
+    }
+}
+
+// ============ ТЕСТЫ НЕЗАВИСИМЫХ СХЕМ ============
+/**
+ * @brief Тест 1: Каждая схема нумерует свои потоки сама
+ */
+void testStreamNamesArePerFlowsheet() {
+    cout << "\n=== Test: Per-Flowsheet Stream Names ===\n";
+    Flowsheet first;
+    Flowsheet second;
+    auto a1 = first.addStream();
+    auto a2 = first.addStream();
+    auto b1 = second.addStream();
+
+    if (a1->getName() == "s1" && a2->getName() == "s2" && b1->getName() == "s1") {
+        cout << "TEST PASSED: " << a2->getName() << " / " << b1->getName() << endl;
+    } else {
+        cout << "TEST FAILED: " << a2->getName() << " / " << b1->getName() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Сотни схем строятся и считаются параллельно в одном процессе
+ */
+void testIndependentFlowsheetsInParallel() {
+    cout << "\n=== Test: Independent Flowsheets In Parallel ===\n";
+    const size_t sheets = 256;
+    vector<double> products(sheets, 0.0);
+    vector<string> names(sheets);
+    ThreadPool pool(4);
+    pool.parallelFor(sheets, [&products, &names](size_t i) {
+        Flowsheet sheet;
+        shared_ptr<Stream> product;
+        buildRecycleLoop(sheet, product);
+        sheet.setRecycleMode(RecycleMode::Converge);
+        sheet.getStreams().front()->setMassFlow(double(i));
+        sheet.solve();
+        products[i] = product->getMassFlow();
+        names[i] = product->getName();
+    });
+
+    bool correct = true;
+    for (size_t i = 0; i < sheets; i++) {
+        correct = correct && abs(products[i] - double(i)) < POSSIBLE_ERROR && names[i] == "s3";
+    }
+    if (correct) {
+        cout << "TEST PASSED: " << sheets << " sheets solved on " << pool.getThreadCount() << " threads" << endl;
+    } else {
+        cout << "TEST FAILED: sheets interfered" << endl;
+    }
+}
+
+// ============ ТЕСТЫ РАЗБИЕНИЯ СХЕМЫ ============
+/**
+ * @brief Цепочка установок: у каждой свой контур отвода (смеситель и делитель)
+ * @return Продукт последней установки (в установившемся режиме равен питанию)
+ */
+shared_ptr<Stream> buildSite(Flowsheet& sheet, int plants, double feedFlow) {
+    auto current = sheet.addStream();
+    current->setMassFlow(feedFlow);
+    for (int i = 0; i < plants; i++) {
+        auto mixer = sheet.addDevice<Mixer>(2);
+        auto splitter = sheet.addDevice<Splitter>(2);
+        auto mix = sheet.addStream();
+        auto product = sheet.addStream();
+        auto recycle = sheet.addStream();
+        mixer->addInput(current);
+        mixer->addInput(recycle);
+        mixer->addOutput(mix);
+        splitter->addInput(mix);
+        splitter->addOutput(product);
+        splitter->addOutput(recycle);
+        splitter->setFractions({0.5, 0.5});
+        current = product;
+    }
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 1000);
+    return current;
+}
+
+/**
+ * @brief Площадка - один большой рецикл: смеситель, цепочка из plants смесителей, делитель,
+ * вторая половина которого возвращается в первый смеситель
+ * @return Продукт (в установившемся режиме равен питанию)
+ */
+shared_ptr<Stream> buildSiteLoop(Flowsheet& sheet, int plants, double feedFlow) {
+    auto feed = sheet.addStream();
+    feed->setMassFlow(feedFlow);
+    auto recycle = sheet.addStream();
+    auto head = sheet.addDevice<Mixer>(2);
+    auto current = sheet.addStream();
+    head->addInput(feed);
+    head->addInput(recycle);
+    head->addOutput(current);
+    for (int i = 0; i < plants; i++) {
+        auto mixer = sheet.addDevice<Mixer>(1);
+        auto next = sheet.addStream();
+        mixer->addInput(current);
+        mixer->addOutput(next);
+        current = next;
+    }
+    auto splitter = sheet.addDevice<Splitter>(2);
+    auto product = sheet.addStream();
+    splitter->addInput(current);
+    splitter->addOutput(product);
+    splitter->addOutput(recycle);
+    splitter->setFractions({0.5, 0.5});
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 1000);
+    return product;
+}
+
+/**
+ * @brief Сохранить каждую часть в свой файл, загрузить в свою схему и рассчитать в своем потоке
+ * @param solveNode Расчет одной части (создает транспорт узла и вызывает solvePart)
+ * @param rounds Раунды каждой части (-1 - расчет бросил исключение)
+ * @return Схемы частей
+ */
+vector<unique_ptr<Flowsheet>> solveDistributed(Flowsheet& whole, const FlowPartition& parts,
+                                               const function<int(Flowsheet&)>& solveNode, vector<int>& rounds) {
+    vector<unique_ptr<Flowsheet>> nodes;
+    for (size_t p = 0; p < parts.partCount(); p++) {
+        const string path = "test_flowsheet_part" + to_string(p) + ".bin";
+        FlowsheetFile::savePart(whole, parts, p, path);
+        nodes.push_back(make_unique<Flowsheet>());
+        FlowsheetFile::load(*nodes.back(), path);
+        remove(path.c_str());
+        nodes.back()->setRecycleMode(RecycleMode::Converge);
+        nodes.back()->setConvergence(1e-10, 1000);
+    }
+    rounds.assign(nodes.size(), 0);
+    vector<thread> workers;
+    for (size_t p = 0; p < nodes.size(); p++) {
+        workers.emplace_back([&nodes, &rounds, &solveNode, p] {
+            try {
+                rounds[p] = solveNode(*nodes[p]);
+            } catch (const string&) {
+                rounds[p] = -1;
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    return nodes;
+}
+
+/**
+ * @brief Наибольшее отличие расходов потоков частей от одноименных потоков целой схемы
+ */
+double distributedDifference(Flowsheet& whole, const vector<unique_ptr<Flowsheet>>& nodes) {
+    unordered_map<string, double> flows;
+    for (const auto& stream : whole.getStreams()) {
+        flows[stream->getName()] = stream->getMassFlow();
+    }
+    double worst = 0;
+    for (const auto& node : nodes) {
+        for (const auto& stream : node->getStreams()) {
+            worst = max(worst, abs(stream->getMassFlow() - flows.at(stream->getName())));
+        }
+    }
+    return worst;
+}
+
+/**
+ * @brief Тест 1: Разбиение не режет контуры, выравнивает части и режет мало потоков
+ */
+void testPartitionKeepsLoopsWhole() {
+    cout << "\n=== Test: Partition Keeps Loops Whole ===\n";
+    Flowsheet sheet;
+    buildSite(sheet, 6, 10.0);
+    FlowPartition parts = sheet.partition(3);
+
+    bool balanced = parts.partCount() == 3;
+    for (size_t p = 0; p < parts.partCount(); p++) {
+        balanced = balanced && parts.weight[p] == 4 && parts.boundary[p].inbound.size() == (p == 0 ? 0u : 1u) &&
+                   parts.boundary[p].lagged.empty() && !parts.boundary[p].cyclic;
+    }
+    if (balanced && parts.cutCount() == 2 && parts.recycleCutCount() == 0) {
+        cout << "TEST PASSED: " << parts.cutCount() << " cut streams, 4 devices per part" << endl;
+    } else {
+        cout << "TEST FAILED: " << parts.cutCount() << " cut streams" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Узлы загружают только свои части и вместе дают результат расчета целиком
+ */
+void testPartitionedSolveMatchesWhole() {
+    cout << "\n=== Test: Partitioned Solve Matches Whole ===\n";
+    const int nodeCount = 3;
+    Flowsheet whole;
+    buildSite(whole, 6, 10.0);
+    FlowPartition parts = whole.partition(nodeCount);
+
+    LocalExchange exchange(nodeCount);
+    vector<int> rounds;
+    auto nodes = solveDistributed(whole, parts, [&exchange](Flowsheet& node) { return node.solvePart(exchange); },
+                                  rounds);
+    whole.solve();
+
+    bool local = true;
+    for (int n = 0; n < nodeCount; n++) {
+        local = local && nodes[n]->getDevices().size() == parts.weight[n] &&
+                nodes[n]->getStreams().size() < whole.getStreams().size() && rounds[n] == 1;
+    }
+    double worst = distributedDifference(whole, nodes);
+    if (local && worst < 1e-9) {
+        cout << "TEST PASSED: one round, max difference " << worst << endl;
+    } else {
+        cout << "TEST FAILED: max difference " << worst << ", rounds " << rounds[0] << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Частей не может быть больше, чем устройств
+ */
+void testPartitionRejectsTooManyParts() {
+    cout << "\n=== Test: Partition Rejects Too Many Parts ===\n";
+    Flowsheet sheet;
+    buildSite(sheet, 2, 1.0);
+    try {
+        sheet.partition(5);
+        cout << "TEST FAILED: no exception" << endl;
+    } catch (const string& error) {
+        cout << "TEST PASSED: " << error << endl;
+    }
+}
+
+/**
+ * @brief Тест 4: Наименьший разрез вне окна балансировки не забирает границу
+ *
+ * Питание -> смеситель -> делитель -> цепочка из 8 смесителей и обвод -> смеситель.
+ * Один поток пересекает только границу после первого смесителя, но она далеко от середины.
+ */
+void testPartitionIgnoresCutOutsideWindow() {
+    cout << "\n=== Test: Partition Ignores Cut Outside Window ===\n";
+    Flowsheet sheet;
+    auto feed = sheet.addStream();
+    feed->setMassFlow(10.0);
+    auto head = sheet.addDevice<Mixer>(1);
+    auto mixed = sheet.addStream();
+    head->addInput(feed);
+    head->addOutput(mixed);
+    auto splitter = sheet.addDevice<Splitter>(2);
+    auto current = sheet.addStream();
+    auto bypass = sheet.addStream();
+    splitter->addInput(mixed);
+    splitter->addOutput(current);
+    splitter->addOutput(bypass);
+    for (int i = 0; i < 8; i++) {
+        auto mixer = sheet.addDevice<Mixer>(1);
+        auto next = sheet.addStream();
+        mixer->addInput(current);
+        mixer->addOutput(next);
+        current = next;
+    }
+    auto tail = sheet.addDevice<Mixer>(2);
+    tail->addInput(current);
+    tail->addInput(bypass);
+    tail->addOutput(sheet.addStream());
+    FlowPartition parts = sheet.partition(2);
+
+    if (parts.partCount() == 2 && parts.weight[0] == 5 && parts.weight[1] == 6 && parts.cutCount() == 2) {
+        cout << "TEST PASSED: parts of " << parts.weight[0] << " and " << parts.weight[1] << " devices" << endl;
+    } else {
+        cout << "TEST FAILED: parts of " << parts.weight[0] << " and " << parts.weight[1] << " devices" << endl;
+    }
+}
+
+/**
+ * @brief Тест 5: Один рецикл на всю площадку разрезается и сходится внешними раундами
+ */
+void testPartitionCutsSiteRecycle() {
+    cout << "\n=== Test: Partition Cuts Site Recycle ===\n";
+    const int nodeCount = 3;
+    Flowsheet whole;
+    buildSiteLoop(whole, 10, 10.0);
+    FlowPartition parts = whole.partition(nodeCount);
+
+    LocalExchange exchange(nodeCount);
+    vector<int> rounds;
+    auto nodes = solveDistributed(whole, parts, [&exchange](Flowsheet& node) { return node.solvePart(exchange); },
+                                  rounds);
+    whole.solve();
+
+    double worst = distributedDifference(whole, nodes);
+    bool together = rounds[0] > 1 && rounds[1] == rounds[0] && rounds[2] == rounds[0];
+    if (parts.recycleCutCount() == 1 && parts.cutCount() == nodeCount && together && worst < 1e-6) {
+        cout << "TEST PASSED: " << parts.recycleCutCount() << " cut recycle, " << rounds[0]
+             << " rounds, max difference " << worst << endl;
+    } else {
+        cout << "TEST FAILED: " << parts.recycleCutCount() << " cut recycles, " << rounds[0]
+             << " rounds, max difference " << worst << endl;
+    }
+}
+
+/**
+ * @brief Тест 6: Ошибка одной части прерывает ожидание остальных
+ */
+void testPartFailureAbortsExchange() {
+    cout << "\n=== Test: Part Failure Aborts Exchange ===\n";
+    const int nodeCount = 3;
+    Flowsheet whole;
+    buildSiteLoop(whole, 10, 10.0);
+    FlowPartition parts = whole.partition(nodeCount);
+
+    LocalExchange exchange(nodeCount);
+    vector<int> rounds;
+    solveDistributed(whole, parts, [&exchange](Flowsheet& node) {
+        if (node.getBoundary().inbound.empty()) {
+            // Первая часть не находит граничный поток и не отправляет свои
+            PartBoundary broken = node.getBoundary();
+            broken.outbound.push_back("missing");
+            node.setBoundary(broken);
+        }
+        return node.solvePart(exchange);
+    }, rounds);
+
+    if (rounds == vector<int>{-1, -1, -1}) {
+        cout << "TEST PASSED: all parts stopped" << endl;
+    } else {
+        cout << "TEST FAILED: rounds " << rounds[0] << ", " << rounds[1] << ", " << rounds[2] << endl;
+    }
+}
+
+#ifndef _WIN32
+/**
+ * @brief Тест 7: Узлы обмениваются граничными потоками по TCP; чужие запросы отвергаются
+ */
+void testSocketExchangeSolvesParts() {
+    cout << "\n=== Test: Socket Exchange Solves Parts ===\n";
+    const int nodeCount = 3;
+    Flowsheet whole;
+    buildSiteLoop(whole, 10, 10.0);
+    FlowPartition parts = whole.partition(nodeCount);
+
+    ExchangeServer server(parts, whole.getStreamTable().laneCount());
+    const uint16_t port = server.getPort();
+    const uint64_t token = server.getToken();
+    // Соединение с неверным ключом отвергается и не прерывает обмен узлов
+    bool strangerRejected = false;
+    try {
+        SocketExchange stranger("127.0.0.1", port, token + 1);
+    } catch (const string&) {
+        strangerRejected = true;
+    }
+    vector<int> rounds;
+    auto nodes = solveDistributed(whole, parts, [port, token](Flowsheet& node) {
+        SocketExchange exchange("127.0.0.1", port, token);
+        return node.solvePart(exchange);
+    }, rounds);
+    whole.solve();
+
+    double worst = distributedDifference(whole, nodes);
+
+    // Узел с ключом может писать только граничные потоки разбиения с верным числом дорожек
+    const vector<double> lanes(2, 1.0);
+    int refused = 0;
+    for (const auto& attempt : {make_pair(string("unknown"), size_t(1)), make_pair(parts.boundary[0].outbound[0], size_t(2))}) {
+        try {
+            SocketExchange node("127.0.0.1", port, token);
+            node.send(attempt.first, 100, lanes.data(), attempt.second);
+        } catch (const string&) {
+            refused++;
+        }
+    }
+
+    if (rounds[0] > 1 && rounds[1] == rounds[0] && rounds[2] == rounds[0] && worst < 1e-6 && strangerRejected &&
+        refused == 2) {
+        cout << "TEST PASSED: " << rounds[0] << " rounds over loopback, max difference " << worst << endl;
+    } else {
+        cout << "TEST FAILED: rounds " << rounds[0] << ", max difference " << worst << ", stranger rejected "
+             << strangerRejected << ", refused " << refused << endl;
+    }
+}
+#endif
+
+// ============ ТЕСТЫ ПОИСКА РЕЦИКЛОВ ============
+/**
+ * @brief Тест 1: Все контуры находятся сразу, даже в режиме Detect
+ */
+void testFindRecyclesReportsAllLoops() {
+    cout << "\n=== Test: Find Recycles Reports All Loops ===\n";
+    Flowsheet sheet;
+    buildPurgeLoops(sheet, 1.0);
+    vector<SolveBlock> loops = sheet.findRecycles();
+
+    bool correct = loops.size() == 2;
+    for (const SolveBlock& loop : loops) {
+        correct = correct && loop.devices.size() == 2 && loop.tears.size() == 1;
+    }
+    if (correct && !sheet.isScheduleValid()) {
+        cout << "TEST PASSED: " << loops.size() << " loops, tear " << sheet.getStreams()[loops[0].tears[0]]->getName()
+             << endl;
+    } else {
+        cout << "TEST FAILED: " << loops.size() << " loops" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Устройство проверенной схемы не проверяет рецикл при расчете
+ */
+void testScheduledDevicesSkipRecycleCheck() {
+    cout << "\n=== Test: Scheduled Devices Skip Recycle Check ===\n";
+    shared_ptr<Mixer> mixer;
+    bool skipped = false;
+    {
+        Flowsheet sheet;
+        mixer = sheet.addDevice<Mixer>(1);
+        mixer->addInput(sheet.addStream());
+        mixer->addOutput(sheet.addStream());
+        sheet.solve();
+        try {
+            mixer->updateOutputs();
+            skipped = mixer->isRecycleChecked();
+        } catch (const RecycleException&) {
+            skipped = false;
+        }
+    }
+
+    bool restored = false;
+    try {
+        mixer->updateOutputs();
+    } catch (const RecycleException&) {
+        restored = !mixer->isRecycleChecked();
+    }
+    if (skipped && restored) {
+        cout << "TEST PASSED: check skipped inside the sheet, restored after it" << endl;
+    } else {
+        cout << "TEST FAILED: skipped " << skipped << ", restored " << restored << endl;
+    }
+}
+
+// ============ ТЕСТЫ ГРУППИРОВКИ ПО ТИПУ ============
+/**
+ * @brief Тест 1: Внутри уровня однотипные устройства считаются подряд, результат прежний
+ */
+void testLevelsGroupedByDeviceType() {
+    cout << "\n=== Test: Levels Grouped By Device Type ===\n";
+    Flowsheet sheet;
+    vector<shared_ptr<Stream>> products;
+    for (int i = 0; i < 6; i++) {
+        auto feed = sheet.addStream();
+        feed->setMassFlow(1.0 + i);
+        auto product = sheet.addStream();
+        if (i % 2 == 0) {
+            auto mixer = sheet.addDevice<Mixer>(1);
+            mixer->addInput(feed);
+            mixer->addOutput(product);
+        } else {
+            auto reactor = sheet.addDevice<Reactor>(false);
+            reactor->addInput(feed);
+            reactor->addOutput(product);
+        }
+        products.push_back(product);
+    }
+    sheet.solve();
+
+    const auto& level = sheet.getLevels().at(0);
+    const auto& blocks = sheet.getBlocks();
+    int switches = 0;
+    for (size_t i = 1; i < level.size(); i++) {
+        switches += blocks[level[i]].devices.front()->getDeviceType() !=
+                    blocks[level[i - 1]].devices.front()->getDeviceType();
+    }
+    bool correct = level.size() == 6;
+    for (int i = 0; i < 6; i++) {
+        correct = correct && abs(products[i]->getMassFlow() - (1.0 + i)) < POSSIBLE_ERROR;
+    }
+    if (correct && switches == 1) {
+        cout << "TEST PASSED: one type switch in a level of " << level.size() << endl;
+    } else {
+        cout << "TEST FAILED: " << switches << " type switches" << endl;
+    }
+}
 
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
+// ============ ТЕСТЫ АСИНХРОННОГО РАСЧЕТА ============
+/**
+ * @brief Тест 1: solveAsync() дает тот же результат и сообщает о ходе расчета
+ */
+void testSolveAsyncReportsProgress() {
+    cout << "\n=== Test: Solve Async Reports Progress ===\n";
+    Flowsheet sheet;
+    auto product = buildPurgeLoops(sheet, 10.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 2000);
+    auto control = make_shared<SolveControl>();
+    atomic<size_t> reports{0};
+    atomic<size_t> lastDone{0};
+    control->setProgress([&reports, &lastDone](size_t done, size_t total) {
+        reports++;
+        lastDone = done == total ? done : 0;
+    });
+    sheet.solveAsync(control).get();
 
+    if (abs(product->getMassFlow() - 10.0) < 1e-6 && reports == sheet.getBlocks().size() &&
+        lastDone == sheet.getBlocks().size()) {
+        cout << "TEST PASSED: " << reports << " progress reports" << endl;
+    } else {
+        cout << "TEST FAILED: product " << product->getMassFlow() << ", " << reports << " reports" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Отмена в фоне и истекший срок останавливают расчет исключением
+ */
+void testSolveAsyncCancelAndDeadline() {
+    cout << "\n=== Test: Solve Async Cancel And Deadline ===\n";
+    Flowsheet sheet;
+    buildPurgeLoops(sheet, 10.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 2000);
+
+    auto cancelled = make_shared<SolveControl>();
+    cancelled->setProgress([&cancelled](size_t, size_t) { cancelled->cancel(); });
+    bool stopped = false;
     try {
-        d1.addOutput(s4);
-    } catch (const string& ex) {
-        if (ex == "Too much outputs") {
-            cout << "Test 2 passed" << endl;
-            return;
-        }
+        sheet.solveAsync(cancelled).get();
+    } catch (const SolveCancelledException&) {
+        stopped = cancelled->isCancelled();
     }
 
-    cout << "Test 2 failed" << endl;
+    auto late = make_shared<SolveControl>();
+    late->setDeadline(chrono::steady_clock::now() - chrono::seconds(1));
+    bool expired = false;
+    try {
+        sheet.solve(*late);
+    } catch (const SolveCancelledException& e) {
+        expired = e.isDeadline();
+    }
+
+    if (stopped && expired) {
+        cout << "TEST PASSED: cancelled and expired solves stopped" << endl;
+    } else {
+        cout << "TEST FAILED: cancelled " << stopped << ", expired " << expired << endl;
+    }
 }
 
-void shouldCorrectInputs() {
-    streamcounter = 0;
-    Mixer d1(2);
+/**
+ * @brief Тест 3: Много расчетов одновременно в одном пуле
+ */
+void testManyAsyncSolvesShareAPool() {
+    cout << "\n=== Test: Many Async Solves Share A Pool ===\n";
+    const int count = 32;
+    auto pool = make_shared<ThreadPool>(4);
+    vector<unique_ptr<Flowsheet>> sheets;
+    vector<shared_ptr<Stream>> products;
+    vector<future<void>> futures;
+    for (int i = 0; i < count; i++) {
+        sheets.push_back(make_unique<Flowsheet>());
+        products.push_back(buildPurgeLoops(*sheets.back(), 1.0 + i));
+        sheets.back()->setRecycleMode(RecycleMode::Converge);
+        sheets.back()->setConvergence(1e-10, 2000);
+        sheets.back()->setThreadPool(pool);
+        futures.push_back(sheets.back()->solveAsync());
+    }
+
+    bool correct = true;
+    for (int i = 0; i < count; i++) {
+        futures[i].get();
+        correct = correct && abs(products[i]->getMassFlow() - (1.0 + i)) < 1e-6;
+    }
+    if (correct) {
+        cout << "TEST PASSED: " << count << " solves on " << pool->getThreadCount() << " threads" << endl;
+    } else {
+        cout << "TEST FAILED: wrong product" << endl;
+    }
+}
+
+/**
+ * @brief Тест 4: Режим EquationOriented проверяет управление; фоновый расчет без пула
+ * не переживает схему
+ */
+void testEquationSolveHonoursControl() {
+    cout << "\n=== Test: Equation Solve Honours Control ===\n";
+    Flowsheet sheet;
+    buildPurgeLoops(sheet, 10.0);
+    sheet.setSolveMode(SolveMode::EquationOriented);
+
+    vector<size_t> steps;
+    SolveControl watched;
+    watched.setProgress([&steps](size_t done, size_t total) { steps.push_back(done * 10 + total); });
+    sheet.solve(watched);
+
+    // Отмена после разложения останавливает расчет перед обратным ходом
+    auto cancelled = make_shared<SolveControl>();
+    size_t reports = 0;
+    cancelled->setProgress([&cancelled, &reports](size_t, size_t) {
+        reports++;
+        cancelled->cancel();
+    });
+    bool stopped = false;
+    try {
+        sheet.solveAsync(cancelled).get();
+    } catch (const SolveCancelledException&) {
+        stopped = reports == 1;
+    }
+
+    // Схема уничтожается, пока фоновый расчет идет: деструктор его дожидается
+    auto doomed = make_unique<Flowsheet>();
+    auto product = buildPurgeLoops(*doomed, 10.0);
+    doomed->setRecycleMode(RecycleMode::Converge);
+    doomed->setConvergence(1e-10, 2000);
+    future<void> pending = doomed->solveAsync();
+    doomed.reset();
+    pending.get();
+
+    if (steps == vector<size_t>{12, 22} && stopped && abs(product->getMassFlow() - 10.0) < 1e-6) {
+        cout << "TEST PASSED: two checked steps, cancel before back-substitution, sheet outlived" << endl;
+    } else {
+        cout << "TEST FAILED: " << steps.size() << " reports, stopped " << stopped
+             << ", product = " << product->getMassFlow() << endl;
+    }
+}
+
+// ============ ТЕСТЫ КЭША РЕЗУЛЬТАТОВ ============
+/**
+ * @brief Тест 1: Повторное питание (в пределах шага квантования) берется из кэша
+ */
+void testResultCacheHitsRepeatedFeeds() {
+    cout << "\n=== Test: Result Cache Hits Repeated Feeds ===\n";
+    Flowsheet sheet;
+    auto product = buildPurgeLoops(sheet, 10.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 2000);
+    sheet.setResultCache(8);
+    auto feed = sheet.getStreams().front();
+
+    bool first = sheet.solveCached();
+    double atTen = product->getMassFlow();
+    feed->setMassFlow(20.0);
+    bool second = sheet.solveCached();
+    feed->setMassFlow(10.001);
+    bool third = sheet.solveCached();
+
+    const ResultCache* cache = sheet.getResultCache();
+    if (!first && !second && third && product->getMassFlow() == atTen && cache->getHits() == 1 &&
+        cache->getMisses() == 2 && cache->size() == 2 && cache->getMemoryBytes() > 0 &&
+        sheet.getLastRecomputed() == 0) {
+        cout << "TEST PASSED: hit rate " << cache->getHitRate() << ", " << cache->getMemoryBytes() << " bytes" << endl;
+    } else {
+        cout << "TEST FAILED: hits " << cache->getHits() << ", misses " << cache->getMisses() << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Давний результат вытесняется, смена связей очищает кэш
+ */
+void testResultCacheEvictsAndInvalidates() {
+    cout << "\n=== Test: Result Cache Evicts And Invalidates ===\n";
+    Flowsheet sheet;
+    shared_ptr<Stream> product = buildReactorChain(sheet, 3, 1.0);
+    sheet.setResultCache(2);
+    auto feed = sheet.getStreams().front();
+    for (double flow : {1.0, 2.0, 3.0}) {
+        feed->setMassFlow(flow);
+        sheet.solveCached();
+    }
+    feed->setMassFlow(1.0);
+    bool evicted = !sheet.solveCached();
+
+    auto extra = sheet.addDevice<Mixer>(1);
+    extra->addInput(product);
+    bool cleared = sheet.getResultCache()->size() == 0;
+    extra->addOutput(sheet.addStream());
+    bool recomputed = !sheet.solveCached() && sheet.getStreams().back()->getMassFlow() == product->getMassFlow();
+
+    Flowsheet split;
+    auto splitter = split.addDevice<Splitter>(2);
+    auto splitFeed = split.addStream();
+    auto share = split.addStream();
+    splitter->addInput(splitFeed);
+    splitter->addOutput(share);
+    splitter->addOutput(split.addStream());
+    splitFeed->setMassFlow(10.0);
+    split.setResultCache(4);
+    split.solveCached();
+    splitter->setFractions({0.3, 0.7});
+    bool retuned = !split.solveCached() && abs(share->getMassFlow() - 3.0) < POSSIBLE_ERROR;
+
+    if (evicted && cleared && recomputed && retuned) {
+        cout << "TEST PASSED: LRU eviction, topology and parameter invalidation" << endl;
+    } else {
+        cout << "TEST FAILED: evicted " << evicted << ", cleared " << cleared << ", recomputed " << recomputed
+             << ", retuned " << retuned << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Устройство, подключенное до addDevice(), и clear() сбрасывают кэш
+ */
+void testResultCacheSeesPrewiredDevices() {
+    cout << "\n=== Test: Result Cache Sees Prewired Devices ===\n";
+    Flowsheet sheet;
+    shared_ptr<Stream> product = buildReactorChain(sheet, 3, 1.0);
+    sheet.setResultCache(4);
+    sheet.solveCached();
+
+    // Связи заданы раньше, чем устройство попало в схему: слушателя у него еще нет
+    auto extra = make_shared<Mixer>(1);
+    auto tail = make_shared<Stream>("tail");
+    extra->addInput(product);
+    extra->addOutput(tail);
+    sheet.addDevice(extra);
+    bool missed = !sheet.solveCached() && tail->getMassFlow() == product->getMassFlow();
+
+    sheet.clear();
+    bool emptied = sheet.getResultCache()->size() == 0;
+    product = buildReactorChain(sheet, 3, 2.0);
+    bool rebuilt = !sheet.solveCached() && abs(product->getMassFlow() - 2.0) < POSSIBLE_ERROR;
+
+    if (missed && emptied && rebuilt) {
+        cout << "TEST PASSED: cache cleared by addDevice and clear" << endl;
+    } else {
+        cout << "TEST FAILED: missed " << missed << ", emptied " << emptied << ", rebuilt " << rebuilt << endl;
+    }
+}
+
+// ============ ТЕСТЫ МАТЕРИАЛЬНОГО БАЛАНСА ============
+/**
+ * @brief Тест 1: Рассчитанная схема с рециклами сводит баланс
+ */
+void testBalanceClosesAfterSolve() {
+    cout << "\n=== Test: Balance Closes After Solve ===\n";
+    Flowsheet sheet;
+    buildPurgeLoops(sheet, 10.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-10, 2000);
+    sheet.setCaseCount(4);
+    sheet.solve();
+    BalanceReport report = sheet.validateBalance(3);
+
+    if (report.ok() && report.worst.size() == 3 && abs(report.sheet.inflow - 10.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: worst residual " << report.worst[0].residual << ", sheet " << report.sheet.residual
+             << endl;
+    } else {
+        cout << "TEST FAILED: " << report.violations << " violations" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Испорченный продукт находится с устройством и вариантом
+ */
+void testBalanceReportsWorstOffender() {
+    cout << "\n=== Test: Balance Reports Worst Offender ===\n";
+    Flowsheet sheet;
+    auto product = buildReactorChain(sheet, 5, 10.0);
+    sheet.setCaseCount(4);
+    sheet.solve();
+    product->setCaseMassFlow(2, 7.0);
+    BalanceReport report = sheet.validateBalance();
+
+    Device* last = sheet.getSchedule().back();
+    if (report.violations == 1 && !report.sheetClosed && report.worst.front().device == last &&
+        report.worst.front().caseIndex == 2 && abs(report.worst.front().residual + 3.0) < POSSIBLE_ERROR) {
+        cout << "TEST PASSED: residual " << report.worst.front().residual << " in case "
+             << report.worst.front().caseIndex << endl;
+    } else {
+        cout << "TEST FAILED: " << report.violations << " violations" << endl;
+    }
+}
+
+// ============ ТЕСТЫ ЯКОБИАНА ============
+/**
+ * @brief Тест 1: Производные через контуры рецикла совпадают с разностной оценкой
+ */
+void testJacobianMatchesFiniteDifference() {
+    cout << "\n=== Test: Jacobian Matches Finite Difference ===\n";
+    Flowsheet sheet;
+    auto product = buildPurgeLoops(sheet, 10.0);
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-12, 5000);
+    sheet.solve();
+    Jacobian jacobian = sheet.computeJacobian();
+
+    auto feed = sheet.getStreams().front();
+    vector<double> base;
+    for (StreamId id : jacobian.outputs) {
+        base.push_back(sheet.getStreams()[id]->getMassFlow());
+    }
+    feed->setMassFlow(11.0);
+    sheet.solve();
+    double worst = 0;
+    for (size_t o = 0; o < jacobian.outputs.size(); o++) {
+        double difference = sheet.getStreams()[jacobian.outputs[o]]->getMassFlow() - base[o];
+        worst = max(worst, abs(difference - jacobian.at(o, 0)));
+    }
+    size_t productRow = find(jacobian.outputs.begin(), jacobian.outputs.end(), product->getId()) - jacobian.outputs.begin();
+    if (jacobian.feeds.size() == 1 && worst < 1e-6 && abs(jacobian.at(productRow, 0) - 1.0) < 1e-9 &&
+        sheet.getCaseCount() == 1) {
+        cout << "TEST PASSED: max difference from finite differences " << worst << endl;
+    } else {
+        cout << "TEST FAILED: max difference " << worst << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Много питаний за несколько проходов, значения схемы не меняются
+ */
+void testJacobianBatchesDirections() {
+    cout << "\n=== Test: Jacobian Batches Directions ===\n";
+    Flowsheet sheet;
+    vector<shared_ptr<Stream>> feeds;
+    auto total = sheet.addStream();
+    feeds.push_back(total);
+    for (int i = 1; i < 5; i++) {
+        feeds.push_back(sheet.addStream());
+        feeds.back()->setMassFlow(i);
+        auto mixer = sheet.addDevice<Mixer>(2);
+        mixer->addInput(total);
+        mixer->addInput(feeds.back());
+        total = sheet.addStream();
+        mixer->addOutput(total);
+    }
+    sheet.solve();
+    Jacobian jacobian = sheet.computeJacobian(2);
+
+    size_t last = jacobian.outputs.size() - 1;
+    bool correct = jacobian.feeds.size() == 5 && jacobian.outputs[last] == total->getId() &&
+                   abs(total->getMassFlow() - 10.0) < POSSIBLE_ERROR;
+    for (size_t f = 0; f < jacobian.feeds.size(); f++) {
+        correct = correct && abs(jacobian.at(last, f) - 1.0) < 1e-12;
+    }
+    // Первый смеситель не зависит от последних питаний
+    correct = correct && jacobian.at(0, 4) == 0.0;
+    if (correct) {
+        cout << "TEST PASSED: " << jacobian.feeds.size() << " directions in passes of 2" << endl;
+    } else {
+        cout << "TEST FAILED: wrong derivatives" << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Приращение многокомпонентного питания сохраняет его состав
+ *
+ * Реактор переводит половину компонента B в A и делит продукт на два выхода; питание
+ * из чистого B дает производную 0.5. Промежуточные расчеты с касательными вариантами
+ * не публикуются.
+ */
+void testJacobianKeepsFeedComposition() {
+    cout << "\n=== Test: Jacobian Keeps Feed Composition ===\n";
+    Flowsheet sheet;
+    auto feed = sheet.addStream();
+    auto product = sheet.addStream();
+    auto reactor = sheet.addDevice<Reactor>(true);
+    reactor->addInput(feed);
+    reactor->addOutput(product);
+    reactor->addOutput(sheet.addStream());
+    reactor->setConversion({1.0, 0.5,
+                            0.0, 0.5}, 2);
+    sheet.setComponentCount(2);
+    feed->setComponentFlow(1, 10.0);
+    sheet.setPublishing(true);
+    sheet.solve();
+    uint64_t epoch = sheet.getSnapshot()->getEpoch();
+    Jacobian jacobian = sheet.computeJacobian();
+
+    auto snapshot = sheet.getSnapshot();
+    feed->setComponentFlow(1, 11.0);
+    sheet.solve();
+    double difference = product->getMassFlow() - 5.0;
+    if (jacobian.feeds.size() == 1 && abs(jacobian.at(0, 0) - 0.5) < 1e-12 && abs(difference - 0.5) < 1e-12 &&
+        snapshot->getEpoch() == epoch + 1 && snapshot->caseCount() == 1) {
+        cout << "TEST PASSED: derivative " << jacobian.at(0, 0) << ", one snapshot published" << endl;
+    } else {
+        cout << "TEST FAILED: derivative " << jacobian.at(0, 0) << ", finite difference " << difference
+             << ", snapshots " << snapshot->getEpoch() - epoch << endl;
+    }
+}
+
+// ============ ТЕСТЫ ДИНАМИЧЕСКОГО РАСЧЕТА ============
+/**
+ * @brief Тест 1: Ступенька питания емкости дает отклик явного метода Эйлера
+ */
+void testTankStepResponse() {
+    cout << "\n=== Test: Tank Step Response ===\n";
+    Flowsheet sheet;
+    auto feed = sheet.addStream();
+    auto product = sheet.addStream();
+    auto tank = sheet.addDevice<Tank>(2.0);
+    tank->addInput(feed);
+    tank->addOutput(product);
+    sheet.setHistoryLength(8);
+    sheet.solve(); // установившийся режим с пустым запасом
+
+    const double dt = 0.5;
+    const double rate = dt / tank->getResidenceTime();
+    feed->setMassFlow(1.0);
+    for (int n = 0; n < 10; n++) {
+        sheet.step(dt);
+    }
+    const StreamHistory& history = sheet.getHistory();
+    double worst = 0;
+    for (size_t age = 0; age < history.size(); age++) {
+        int n = 10 - age; // номер шага, начиная с 1
+        double expected = 1.0 - pow(1.0 - rate, n - 1);
+        worst = max(worst, abs(history.at(product->getId(), age) - expected));
+    }
+    if (worst < 1e-12 && history.size() == 8 && history.timeAt(0) == 5.0 && sheet.getTime() == 5.0) {
+        cout << "TEST PASSED: holdup " << tank->getHoldup() << " after " << sheet.getTime() << " s" << endl;
+    } else {
+        cout << "TEST FAILED: max deviation " << worst << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Шаги с историей не выделяют память, тренд читается без копирования
+ */
+void testDynamicStepIsAllocationFree() {
+    cout << "\n=== Test: Dynamic Step Is Allocation Free ===\n";
+    Flowsheet sheet;
+    auto current = buildReactorChain(sheet, 20, 10.0);
+    for (int i = 0; i < 5; i++) {
+        auto tank = sheet.addDevice<Tank>(1.0 + i);
+        tank->addInput(current);
+        current = sheet.addStream();
+        tank->addOutput(current);
+    }
+    sheet.setHistoryLength(32);
+    sheet.solve();
+    auto feed = sheet.getStreams().front();
+    for (int n = 0; n < 3; n++) {
+        sheet.step(0.1);
+    }
+
+    size_t before = heapAllocations.load();
+    for (int n = 0; n < 100; n++) {
+        feed->setMassFlow(10.0 + (n % 10)); // питание меняется во времени
+        sheet.step(0.1);
+    }
+    size_t allocations = heapAllocations.load() - before;
+
+    const StreamHistory& history = sheet.getHistory();
+    const double* trend = history.ring(current->getId());
+    bool trendOk = history.size() == 32 && trend[history.slot(0)] == current->getMassFlow() &&
+                   history.at(feed->getId(), 0) == 19.0 && history.at(feed->getId(), 1) == 18.0;
+    if (allocations == 0 && trendOk) {
+        cout << "TEST PASSED: 100 steps, 0 heap allocations" << endl;
+    } else {
+        cout << "TEST FAILED: " << allocations << " heap allocations, trend " << trendOk << endl;
+    }
+}
+
+/**
+ * @brief Тест 3: Заполняющиеся и опорожняющиеся емкости сводят баланс с учетом накопления
+ */
+void testDynamicStepKeepsBalance() {
+    cout << "\n=== Test: Dynamic Step Keeps Balance ===\n";
+    Flowsheet sheet;
+    auto feed = sheet.addStream();
+    auto current = feed;
+    for (int i = 0; i < 3; i++) {
+        auto tank = sheet.addDevice<Tank>(1.0 + i);
+        tank->addInput(current);
+        current = sheet.addStream();
+        tank->addOutput(current);
+    }
+    feed->setMassFlow(5.0);
+    sheet.solve();
+    bool steady = sheet.validateBalance().ok();
+
+    feed->setMassFlow(20.0); // емкости заполняются
+    for (int n = 0; n < 5; n++) {
+        sheet.step(0.25);
+    }
+    BalanceReport filling = sheet.validateBalance();
+    feed->setMassFlow(0.0); // и опорожняются
+    sheet.step(0.25);
+    BalanceReport draining = sheet.validateBalance();
+
+    if (steady && filling.ok() && draining.ok() && abs(current->getMassFlow() - feed->getMassFlow()) > 1.0) {
+        cout << "TEST PASSED: balance closes while tanks fill and drain" << endl;
+    } else {
+        cout << "TEST FAILED: " << filling.violations << " violations while filling, " << draining.violations
+             << " while draining, sheet residual " << draining.sheet.residual << endl;
+    }
+}
+
+/**
+ * @brief Тест 4: Запас, заданный setHoldup() до первого шага, опорожняется динамикой
+ */
+void testTankHoldupBeforeFirstStep() {
+    cout << "\n=== Test: Tank Holdup Before First Step ===\n";
+    Flowsheet sheet;
+    auto feed = sheet.addStream();
+    auto tank = sheet.addDevice<Tank>(2.0);
+    auto product = sheet.addStream();
+    tank->addInput(feed);
+    tank->addOutput(product);
+    tank->setHoldup(4.0);
+    sheet.step(0.5);
+
+    // Выход шага - из начального запаса, пустое питание только опорожняет емкость
+    bool drained = abs(product->getMassFlow() - 2.0) < 1e-12 && abs(tank->getHoldup() - 3.0) < 1e-12;
+    if (drained && sheet.validateBalance().ok()) {
+        cout << "TEST PASSED: holdup " << tank->getHoldup() << " after first step" << endl;
+    } else {
+        cout << "TEST FAILED: holdup " << tank->getHoldup() << ", product = " << product->getMassFlow() << endl;
+    }
+}
+
+// ============ ТЕСТЫ КОМПАКТНЫХ ИМЕН ============
+/**
+ * @brief Тест 1: Таблица потоков занимает меньше 24 байт на поток, имена строятся по запросу
+ *
+ * Расчет читает только таблицу. Полная цена потока больше: объект Stream (32 байта)
+ * с управляющим блоком shared_ptr и слот в Flowsheet::getStreams() добавляют еще около
+ * 64 байт на 64-битной сборке - они измеряются по счетчику кучи.
+ */
+void testStreamFootprintIsCompact() {
+    cout << "\n=== Test: Stream Footprint Is Compact ===\n";
+    Flowsheet sheet;
+    auto product = buildReactorChain(sheet, 10000, 1.0);
+    sheet.solve();
+    const StreamTable& table = sheet.getStreamTable();
+    double bytesPerStream = double(table.memoryBytes()) / table.size();
+
+    // Объект потока, который addStream() создает рядом со строкой таблицы
+    const size_t count = 10000;
+    vector<shared_ptr<Stream>> handles;
+    handles.reserve(count);
+    size_t before = heapBytes.load();
+    for (size_t i = 0; i < count; i++) {
+        handles.push_back(make_shared<Stream>(int(i + 1)));
+    }
+    double handleBytes = double(heapBytes.load() - before) / count + sizeof(shared_ptr<Stream>);
+    // sizeof(Stream), управляющий блок и слот в getStreams(), без накладных расходов malloc
+    bool handlesCounted = !COUNTING_ALLOCATIONS || handleBytes <= sizeof(Stream) + 48;
+
+    if (bytesPerStream < 24 && handlesCounted && table.nameCount() == 0 &&
+        product->getName() == "s" + to_string(table.size())) {
+        cout << "TEST PASSED: table " << bytesPerStream << " bytes per stream, Stream handle "
+             << handleBytes << " more, " << product->getName() << endl;
+    } else {
+        cout << "TEST FAILED: table " << bytesPerStream << " bytes per stream, handle " << handleBytes
+             << ", " << table.nameCount() << " names" << endl;
+    }
+}
+
+/**
+ * @brief Тест 2: Только канонические автоматические имена хранятся номером
+ *
+ * Отрицательный номер потока и номер от 2^31 отвергаются, а не превращаются в другое имя.
+ */
+void testOnlyCanonicalNamesAreNumbered() {
+    cout << "\n=== Test: Only Canonical Names Are Numbered ===\n";
+    StreamTable table;
+    StreamId numbered = table.add("s42");
+    StreamId zero = table.add("s0");
+    StreamId padded = table.add("s042");
+    StreamId custom = table.add("feed");
+    StreamId huge = table.add("s99999999999");
+    table.setName(numbered, "s7");
+
+    int rejected = 0;
+    try {
+        Stream negative(-1);
+    } catch (const string&) {
+        rejected++;
+    }
+    try {
+        table.addNumbered(0x80000000u);
+    } catch (const string&) {
+        rejected++;
+    }
+
+    if (table.nameCount() == 3 && rejected == 2 && table.size() == 5 && table.name(numbered) == "s7" && table.name(zero) == "s0" &&
+        table.name(padded) == "s042" && table.name(custom) == "feed" && table.name(huge) == "s99999999999") {
+        cout << "TEST PASSED: " << table.nameCount() << " stored names for 5 streams" << endl;
+    } else {
+        cout << "TEST FAILED: " << table.nameCount() << " stored names" << endl;
+    }
+}
+
+// ============ ГЛАВНАЯ ФУНКЦИЯ ТЕСТИРОВАНИЯ ============
+void tests() {
+    cout << "========== RUNNING TESTS ==========\n\n";
+    if (!COUNTING_ALLOCATIONS) {
+        cout << "Heap allocations are not counted: build with -DDEVICE_COUNT_ALLOCATIONS (make test)\n\n";
+    }
     
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    auto s4 = make_shared<Stream>(++streamcounter);
+    testInputEqualOutput();
+    testTooManyOutputStreams();
+    testTooManyInputStreams();
     
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
+    shouldSetOutputsCorrectlyWithOneOutput();
+    shouldCorrectOutputs();
+    shouldCorrectInputs();
+    
+    // НОВЫЕ тесты на рецикл
+    cout << "\n--- RECYCLE DETECTION TESTS ---\n";
+    testRecycleDetectionOnCalculatedDevice();
+    testRecycleWithMultipleDevices();
+    testRecycleWithMixer();
+
+    cout << "\n--- FLOWSHEET TESTS ---\n";
+    testFlowsheetSolvesInTopologicalOrder();
+    testFlowsheetScheduleCache();
+    testFlowsheetDetectsLoop();
+
+    cout << "\n--- RECYCLE CONVERGENCE TESTS ---\n";
+    testRecycleConvergesByDirectSubstitution();
+    testRecycleConvergesByWegstein();
+    testRecycleReportsNoConvergence();
+
+    cout << "\n--- STREAM TABLE TESTS ---\n";
+    testStreamTableStoresFlowsContiguously();
+    testStreamTableAdoptsExternalStreams();
+    testStreamTableInternsNames();
+
+    cout << "\n--- PARALLEL SOLVE TESTS ---\n";
+    testThreadPoolRunsEveryTask();
+    testParallelSolveMatchesSequential();
+    testParallelSolvePropagatesErrors();
+
+    cout << "\n--- BATCH TESTS ---\n";
+    testBatchSolvesEveryCase();
+    testBatchRecycleConverges();
+    testBatchCaseCountKeepsFlows();
+
+    cout << "\n--- INCREMENTAL SOLVE TESTS ---\n";
+    testIncrementalSolveTouchesDownstreamOnly();
+    testIncrementalSolveFallsBackToFullSolve();
+    testIncrementalSolveRecycle();
+
+    cout << "\n--- ERROR CODE TESTS ---\n";
+    testTryAddReportsLimits();
+    testTryUpdateOutputs();
+    testFlowsheetValidateCollectsIssues();
+
+    cout << "\n--- FIXED DEVICE TESTS ---\n";
+    testFixedMixerSumsInputs();
+    testFixedDevicesInFlowsheet();
+
+    cout << "\n--- ARENA TESTS ---\n";
+    testArenaFlowsheetSolves();
+    testArenaReusedAfterClear();
+    testArenaKeepsHeldStreams();
+
+    cout << "\n--- FLOWSHEET FILE TESTS ---\n";
+    testFlowsheetFileRoundTrip();
+    testFlowsheetFileRejectsBadData();
+    testFlowsheetFileEmptySheet();
+    testFlowsheetFileContinuesNumbering();
+
+    cout << "\n--- IMPORT TESTS ---\n";
+    testImportCsvBuildsFlowsheet();
+    testImportJsonBuildsFlowsheet();
+    testImportCollectsErrors();
+
+    cout << "\n--- PROFILER TESTS ---\n";
+    testProfilerAggregatesStats();
+    testProfilerRecordsFlowsheet();
+
+    cout << "\n--- ALLOCATION TESTS ---\n";
+    testSolveDoesNotAllocate();
+    testDeviceTypeAndNameDoNotCopy();
+
+    cout << "\n--- COMPONENT TESTS ---\n";
+    testComponentsMixAndSplit();
+    testReactorConversionMatrix();
+    testScalarStreamsHaveNoComponents();
+
+    cout << "\n--- SPLITTER TESTS ---\n";
+    testSplitterSplitsByFractions();
+    testSplitterFractionsUpdateIncrementally();
+    testFlowsheetFileSavesSplitter();
+
+    cout << "\n--- EQUATION-ORIENTED TESTS ---\n";
+    testEquationModeMatchesSequential();
+    testEquationModeSolvesAllLanes();
+    testEquationModeRejectsUnsolvable();
+
+    cout << "\n--- COMPILED PLAN TESTS ---\n";
+    testCompiledPlanMatchesSolve();
+    testCompiledFactorizationReused();
+    testCompiledPlanRecompilesOnTopologyChange();
+
+    cout << "\n--- SNAPSHOT TESTS ---\n";
+    testSnapshotIsImmutable();
+    testSnapshotConcurrentReaders();
+    testSnapshotBuffersReused();
+
+    cout << "\n--- INDEPENDENT FLOWSHEET TESTS ---\n";
+    testStreamNamesArePerFlowsheet();
+    testIndependentFlowsheetsInParallel();
+
+    cout << "\n--- PARTITION TESTS ---\n";
+    testPartitionKeepsLoopsWhole();
+    testPartitionedSolveMatchesWhole();
+    testPartitionRejectsTooManyParts();
+    testPartitionIgnoresCutOutsideWindow();
+    testPartitionCutsSiteRecycle();
+    testPartFailureAbortsExchange();
+#ifndef _WIN32
+    testSocketExchangeSolvesParts();
+#endif
+
+    cout << "\n--- RECYCLE DETECTION TESTS ---\n";
+    testFindRecyclesReportsAllLoops();
+    testScheduledDevicesSkipRecycleCheck();
+
+    cout << "\n--- TYPE GROUPING TESTS ---\n";
+    testLevelsGroupedByDeviceType();
+
+    cout << "\n--- ASYNC SOLVE TESTS ---\n";
+    testSolveAsyncReportsProgress();
+    testSolveAsyncCancelAndDeadline();
+    testManyAsyncSolvesShareAPool();
+    testEquationSolveHonoursControl();
+
+    cout << "\n--- RESULT CACHE TESTS ---\n";
+    testResultCacheHitsRepeatedFeeds();
+    testResultCacheEvictsAndInvalidates();
+    testResultCacheSeesPrewiredDevices();
+
+    cout << "\n--- MASS BALANCE TESTS ---\n";
+    testBalanceClosesAfterSolve();
+    testBalanceReportsWorstOffender();
+
+    cout << "\n--- JACOBIAN TESTS ---\n";
+    testJacobianMatchesFiniteDifference();
+    testJacobianBatchesDirections();
+    testJacobianKeepsFeedComposition();
+
+    cout << "\n--- DYNAMIC SIMULATION TESTS ---\n";
+    testTankStepResponse();
+    testDynamicStepIsAllocationFree();
+    testDynamicStepKeepsBalance();
+    testTankHoldupBeforeFirstStep();
+
+    cout << "\n--- COMPACT NAME TESTS ---\n";
+    testStreamFootprintIsCompact();
+    testOnlyCanonicalNamesAreNumbered();
+
+    cout << "\n========== TESTS COMPLETE ==========\n";
+}
+
+// ============ БЕНЧМАРКИ ============
+/**
+ * @brief Параметры запуска бенчмарков (./a.out --bench [--bench-max=N] [--bench-csv] [--bench-repeat=N])
+ */
+struct BenchOptions {
+    size_t maxDevices = 100000;   ///< Наибольший размер синтетической схемы
+    bool csv = false;             ///< Вывод в CSV для сравнения с эталоном
+    double minSeconds = 0.2;      ///< Минимальное время замера одного бенчмарка
+    int repeats = 1;              ///< Замеров каждого бенчмарка: берется медиана (меньше шума)
+    string profilePath;           ///< Файл Chrome Trace для runProfile() (пусто - без профиля)
+    string baselinePath;          ///< Эталон CSV для runPerfCheck() (пусто - без проверки)
+    double threshold = 15.0;      ///< Допустимое замедление ns/update относительно эталона, %
+    double shortThreshold = 25.0; ///< То же для схем меньше shortDevices устройств
+    size_t shortDevices = 1000;   ///< Расчет малой схемы - единицы микросекунд, замер шумнее
+    int retries = 1;              ///< Сколько раз perf-check перемеряет бенчмарк сверх порога
+};
+
+/**
+ * @brief Результат одного бенчмарка
+ */
+struct BenchResult {
+    string name;
+    size_t devices = 0;
+    size_t threads = 1;
+    double nsPerUpdate = 0;    ///< Время на один updateOutputs() устройства
+    double devicesPerSecond = 0;
+    double bytesPerStream = 0; ///< Байт кучи на поток при построении схемы (вместе с устройствами)
+};
+
+/**
+ * @brief Цепочка из devices реакторов
+ */
+void benchBuildReactorChain(Flowsheet& sheet, size_t devices) {
+    buildReactorChain(sheet, devices, 100.0);
+}
+
+/**
+ * @brief Дерево смесителей: devices + 1 питаний сливаются попарно в один поток
+ */
+void benchBuildMixerTree(Flowsheet& sheet, size_t devices) {
+    vector<shared_ptr<Stream>> level;
+    for (size_t i = 0; i <= devices; i++) {
+        level.push_back(sheet.addStream());
+        level.back()->setMassFlow(1.0);
+    }
+    while (level.size() > 1) {
+        vector<shared_ptr<Stream>> next;
+        for (size_t i = 0; i + 1 < level.size(); i += 2) {
+            auto mixer = sheet.addDevice<Mixer>(2);
+            mixer->addInput(level[i]);
+            mixer->addInput(level[i + 1]);
+            next.push_back(sheet.addStream());
+            mixer->addOutput(next.back());
+        }
+        if (level.size() % 2 == 1) {
+            next.push_back(level.back());
+        }
+        level.swap(next);
+    }
+}
+
+/**
+ * @brief Последовательность контуров рецикла (смеситель + двойной реактор), devices / 2 контуров
+ */
+void benchBuildRecycleLoops(Flowsheet& sheet, size_t devices) {
+    sheet.setRecycleMode(RecycleMode::Converge);
+    sheet.setConvergence(1e-6, 100);
+    auto feed = sheet.addStream();
+    feed->setMassFlow(10.0);
+    for (size_t i = 0; i + 1 < devices; i += 2) {
+        auto mixer = sheet.addDevice<Mixer>(2);
+        auto reactor = sheet.addDevice<Reactor>(true);
+        auto mixed = sheet.addStream();
+        auto product = sheet.addStream();
+        auto recycle = sheet.addStream();
+        mixer->addInput(feed);
+        mixer->addInput(recycle);
+        mixer->addOutput(mixed);
+        reactor->addInput(mixed);
+        reactor->addOutput(product);
+        reactor->addOutput(recycle);
+        feed = product;
+    }
+}
 
-    d1.addInput(s1);
-    d1.addInput(s2);
-    d1.addOutput(s3);
+/**
+ * @brief Те же контуры рецикла, решаемые одной системой уравнений
+ */
+void benchBuildRecycleLoopsEquations(Flowsheet& sheet, size_t devices) {
+    benchBuildRecycleLoops(sheet, devices);
+    sheet.setSolveMode(SolveMode::EquationOriented);
+}
 
-    try {
-        d1.addInput(s4);
-    } catch (const string& ex) {
-        if (ex == "Too much inputs") {
-            cout << "Test 3 passed" << endl;
-            return;
-        }
+/**
+ * @brief Независимые пары "смеситель -> реактор", добавленные вперемешку
+ */
+void benchBuildMixedPairs(Flowsheet& sheet, size_t devices) {
+    for (size_t i = 0; i + 1 < devices; i += 2) {
+        auto feed = sheet.addStream();
+        feed->setMassFlow(1.0 + i);
+        auto mixed = sheet.addStream();
+        auto mixer = sheet.addDevice<Mixer>(1);
+        mixer->addInput(feed);
+        mixer->addOutput(mixed);
+        auto reactor = sheet.addDevice<Reactor>(false);
+        reactor->addInput(mixed);
+        reactor->addOutput(sheet.addStream());
     }
+}
 
-    cout << "Test 3 failed" << endl;
+/**
+ * @brief Независимые цепочки по 4 реактора - проверка масштабирования по потокам
+ */
+void benchBuildTrains(Flowsheet& sheet, size_t devices) {
+    for (size_t i = 0; i < devices / 4; i++) {
+        buildReactorChain(sheet, 4, 1.0 + i);
+    }
 }
 
-// ============ ТЕСТЫ ДЛЯ REACTOR ============
-void testTooManyOutputStreams() {
-    streamcounter = 0;
-    
-    Reactor dl(false);
-    
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    
-    s1->setMassFlow(10.0);
-    
-    dl.addInput(s1);
-    dl.addOutput(s2);
-    
-    try {
-        dl.addOutput(s3);
-        cout << "Test 1 failed" << endl;
-    } catch (const string& ex) {
-        if (ex == "OUTPUT STREAM LIMIT!") {
-            cout << "Test 1 passed" << endl;
+/**
+ * @brief Построить схему, замерить память и время расчета
+ */
+BenchResult runBenchmark(const string& name, void (*build)(Flowsheet&, size_t), size_t devices,
+                         size_t threads, const BenchOptions& options, bool compiled = false) {
+    Flowsheet sheet;
+    size_t bytesBefore = heapBytes.load();
+    build(sheet, devices);
+    sheet.solve(); // построение расписания и прогрев
+    size_t buildBytes = heapBytes.load() - bytesBefore;
+    if (threads > 1) {
+        sheet.setThreadPool(make_shared<ThreadPool>(threads));
+    }
+
+    size_t iterations = 0;
+    auto start = chrono::steady_clock::now();
+    double elapsed = 0;
+    if (compiled) {
+        sheet.compile();
+    }
+    do {
+        if (compiled) {
+            sheet.solveCompiled();
         } else {
-            cout << "Test 1 failed" << endl;
+            sheet.solve();
         }
+        iterations++;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (elapsed < options.minSeconds);
+
+    BenchResult result;
+    result.name = name + "/" + to_string(devices) + (threads > 1 ? "/threads:" + to_string(threads) : "") +
+                  (compiled ? "/compiled" : "");
+    result.devices = sheet.getDevices().size();
+    result.threads = threads;
+    double updates = double(iterations) * result.devices * max(sheet.getLastIterations(), 1);
+    result.nsPerUpdate = elapsed * 1e9 / updates;
+    result.devicesPerSecond = double(iterations) * result.devices / elapsed;
+    result.bytesPerStream = double(buildBytes) / max<size_t>(sheet.getStreams().size(), 1);
+    return result;
+}
+
+/**
+ * @brief Медиана options.repeats замеров runBenchmark() по ns/update
+ *
+ * Медиана не следует за одним удачным или неудачным замером, как лучший или средний.
+ */
+BenchResult runMedianBenchmark(const string& name, void (*build)(Flowsheet&, size_t), size_t devices,
+                               size_t threads, const BenchOptions& options, bool compiled = false) {
+    vector<BenchResult> results;
+    for (int run = 0; run < options.repeats; run++) {
+        results.push_back(runBenchmark(name, build, devices, threads, options, compiled));
     }
+    auto middle = results.begin() + results.size() / 2;
+    nth_element(results.begin(), middle, results.end(),
+                [](const BenchResult& a, const BenchResult& b) { return a.nsPerUpdate < b.nsPerUpdate; });
+    return *middle;
 }
 
-void testTooManyInputStreams() {
-    streamcounter = 0;
-    
-    Reactor dl(false);
-    
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    
-    s1->setMassFlow(10.0);
-    s2->setMassFlow(5.0);
-    
-    dl.addInput(s1);
-    
-    try {
-        dl.addInput(s3);
-        cout << "Test 2 failed" << endl;
-    } catch (const string& ex) {
-        if (ex == "INPUT STREAM LIMIT!") {
-            cout << "Test 2 passed" << endl;
-        } else {
-            cout << "Test 2 failed" << endl;
+void printBenchResult(const BenchResult& r, const BenchOptions& options) {
+    if (options.csv) {
+        cout << r.name << "," << r.devices << "," << r.threads << "," << r.nsPerUpdate << ","
+             << r.devicesPerSecond << "," << r.bytesPerStream << "\n";
+        return;
+    }
+    cout.width(40);
+    cout << left << r.name;
+    cout.width(14);
+    cout << right << fixed << setprecision(2) << r.nsPerUpdate;
+    cout.width(16);
+    cout << setprecision(0) << r.devicesPerSecond;
+    cout.width(14);
+    if (COUNTING_ALLOCATIONS) {
+        cout << setprecision(1) << r.bytesPerStream << "\n";
+    } else {
+        cout << "-" << "\n"; // память не считается без DEVICE_COUNT_ALLOCATIONS
+    }
+    cout.unsetf(ios::floatfield);
+    cout << setprecision(6);
+}
+
+/**
+ * @brief Прогнать все сценарии бенчмарков, передавая каждый результат в report
+ *
+ * Если report вернул true, бенчмарк замеряется заново и результат передается еще раз
+ * (так runPerfCheck() перепроверяет замедления). Этот же набор - обучающая нагрузка
+ * сборки с профилем (make pgo-gen).
+ */
+void runBenchmarkSuite(const BenchOptions& options, const function<bool(const BenchResult&)>& report) {
+    struct Scenario {
+        const char* name;
+        void (*build)(Flowsheet&, size_t);
+    };
+    const Scenario scenarios[] = {
+        {"ReactorChain", benchBuildReactorChain},
+        {"MixerTree", benchBuildMixerTree},
+        {"MixedPairs", benchBuildMixedPairs},
+        {"RecycleLoops", benchBuildRecycleLoops},
+        {"RecycleLoopsEO", benchBuildRecycleLoopsEquations},
+    };
+    auto measure = [&](const char* name, void (*build)(Flowsheet&, size_t), size_t devices, size_t threads,
+                       bool compiled) {
+        while (report(runMedianBenchmark(name, build, devices, threads, options, compiled))) {
+        }
+    };
+    for (const Scenario& scenario : scenarios) {
+        for (size_t devices = 100; devices <= options.maxDevices; devices *= 10) {
+            measure(scenario.name, scenario.build, devices, 1, false);
+            measure(scenario.name, scenario.build, devices, 1, true);
         }
     }
+
+    size_t trainDevices = min<size_t>(options.maxDevices, 100000);
+    size_t hardware = max<unsigned>(thread::hardware_concurrency(), 1);
+    for (size_t threads = 1; threads <= max<size_t>(hardware, 2); threads *= 2) {
+        measure("Trains", benchBuildTrains, trainDevices, threads, false);
+    }
 }
 
-void testInputEqualOutput() {
-    streamcounter = 0;
-    
-    Reactor dl(true);
-    
-    auto s1 = make_shared<Stream>(++streamcounter);
-    auto s2 = make_shared<Stream>(++streamcounter);
-    auto s3 = make_shared<Stream>(++streamcounter);
-    
-    s1->setMassFlow(10.0);
-    
-    dl.addInput(s1);
-    dl.addOutput(s2);
-    dl.addOutput(s3);
-    
-    dl.updateOutputs();
-    
-    double sumOutputs = dl.getOutputs().at(0)->getMassFlow() + 
-                        dl.getOutputs().at(1)->getMassFlow();
-    double inputMass = dl.getInputs().at(0)->getMassFlow();
-    
-    if (abs(sumOutputs - inputMass) < POSSIBLE_ERROR) {
-        cout << "Test 3 passed" << endl;
+/**
+ * @brief Запустить все бенчмарки
+ */
+int runBenchmarks(const BenchOptions& options) {
+    if (options.csv) {
+        cout << "name,devices,threads,ns_per_update,devices_per_second,bytes_per_stream\n";
     } else {
-        cout << "Test 3 failed" << endl;
+        cout << "========== RUNNING BENCHMARKS ==========\n";
+        cout << left << setw(40) << "Benchmark" << right << setw(14) << "ns/update"
+             << setw(16) << "devices/sec" << setw(14) << "bytes/stream" << "\n";
+    }
+    runBenchmarkSuite(options, [&options](const BenchResult& r) {
+        printBenchResult(r, options);
+        return false;
+    });
+    if (!options.csv) {
+        cout << "========== BENCHMARKS COMPLETE ==========\n";
     }
+    return 0;
 }
 
-// ============ ТЕСТЫ НА РЕЦИКЛ ============
 /**
- * @brief Тест 1: Обнаружение рецикла при апдейте рассчитанного устройства
+ * @brief Прочитать ns/update из эталона, записанного --bench --bench-csv
+ * @return Время по имени бенчмарка
+ * @throws string если строка эталона повреждена
  */
-void testRecycleDetectionOnCalculatedDevice() {
-    cout << "\n=== Test: Recycle Detection on Calculated Device ===\n";
-    streamcounter = 0;
-    
-    try {
-        Reactor dl(false);
-        
-        auto s1 = make_shared<Stream>(++streamcounter);
-        auto s2 = make_shared<Stream>(++streamcounter);
-        
-        s1->setMassFlow(10.0);
-        
-        dl.addInput(s1);
-        dl.addOutput(s2);
-        
-        // Первый апдейт - устройство становится рассчитанным
-        dl.updateOutputs();
-        cout << "Device calculated after first update: " << dl.isCalculated() << endl;
-        
-        // Второй апдейт - должно выбросить исключение о рецикле
-        dl.updateOutputs();
-        
-        cout << "TEST FAILED: No recycle exception thrown" << endl;
-    } catch (const RecycleException& e) {
-        cout << "TEST PASSED: " << e.what() << endl;
-    } catch (const exception& e) {
-        cout << "TEST FAILED: Wrong exception: " << e.what() << endl;
+unordered_map<string, double> readBenchBaseline(istream& in) {
+    unordered_map<string, double> baseline;
+    string line;
+    size_t number = 0;
+    while (getline(in, line)) {
+        number++;
+        if (line.empty() || line.rfind("name,", 0) == 0) {
+            continue;
+        }
+        vector<string> fields;
+        stringstream row(line);
+        string field;
+        while (getline(row, field, ',')) {
+            fields.push_back(field);
+        }
+        char* end = nullptr;
+        double ns = fields.size() == 6 ? strtod(fields[3].c_str(), &end) : 0.0;
+        if (fields.size() != 6 || end == fields[3].c_str() || !(ns > 0)) {
+            throw string("Bad benchmark baseline line ") + to_string(number);
+        }
+        baseline[fields[0]] = ns;
     }
+    return baseline;
 }
 
 /**
- * @brief Тест 2: Рецикл с несколькими устройствами
+ * @brief Сравнить бенчмарки с эталоном (make perf-check)
+ *
+ * Каждый бенчмарк - медиана options.repeats замеров. Схемы меньше options.shortDevices
+ * сравниваются с порогом options.shortThreshold: их расчет занимает единицы микросекунд, и чтение
+ * часов на каждой итерации заметно в замере. Бенчмарк сверх порога перемеряется до
+ * options.retries раз и считается замедлением, только если сверх порога все замеры.
+ * Бенчмарк без эталона (например, Trains с другим числом потоков) только печатается,
+ * как и записи эталона, которых не было в этом прогоне. Если не сопоставлен ни один
+ * бенчмарк (эталон снят с другим PERF_MAX или числом ядер), проверка не пройдена.
+ * @return 0 - замедлений сверх options.threshold нет, 1 - есть, 2 - эталон не прочитан
+ *         или не подходит к этому прогону
  */
-void testRecycleWithMultipleDevices() {
-    cout << "\n=== Test: Recycle with Multiple Devices ===\n";
-    streamcounter = 0;
-    
+int runPerfCheck(const BenchOptions& options) {
+    unordered_map<string, double> baseline;
     try {
-        // Создаем два реактора
-        Reactor r1(false);
-        Reactor r2(false);
-        
-        auto input = make_shared<Stream>(++streamcounter);
-        auto intermediate = make_shared<Stream>(++streamcounter);
-        auto output = make_shared<Stream>(++streamcounter);
-        
-        input->setMassFlow(20.0);
-        
-        // Связываем устройства: input -> r1 -> intermediate -> r2 -> output
-        r1.addInput(input);
-        r1.addOutput(intermediate);
-        
-        r2.addInput(intermediate);
-        r2.addOutput(output);
-        
-        // Рассчитываем первое устройство
-        r1.updateOutputs();
-        cout << "R1 calculated: " << r1.isCalculated() << endl;
-        cout << "Intermediate flow: " << intermediate->getMassFlow() << endl;
-        
-        // Рассчитываем второе устройство - должно работать
-        r2.updateOutputs();
-        cout << "R2 calculated: " << r2.isCalculated() << endl;
-        cout << "Output flow: " << output->getMassFlow() << endl;
-        
-        // Пытаемся повторно рассчитать первое устройство - рецикл!
-        r1.updateOutputs();
-        
-        cout << "TEST FAILED: No recycle exception thrown" << endl;
-    } catch (const RecycleException& e) {
-        cout << "TEST PASSED: " << e.what() << endl;
+        ifstream in(options.baselinePath);
+        if (!in) {
+            throw string("Cannot open benchmark baseline ") + options.baselinePath +
+                " (run make perf-baseline on this configuration and commit it)";
+        }
+        baseline = readBenchBaseline(in);
+    } catch (const string& error) {
+        cerr << error << "\n";
+        return 2;
+    }
+
+    cout << "========== PERFORMANCE CHECK (threshold " << options.threshold << "%, " << options.shortThreshold
+         << "% below " << options.shortDevices << " devices) ==========\n";
+    cout << left << setw(40) << "Benchmark" << right << setw(14) << "baseline" << setw(14) << "current"
+         << setw(10) << "change" << "\n";
+    size_t regressions = 0;
+    size_t compared = 0;
+    set<string> matched;
+    int attempts = 0; // Перемеров текущего бенчмарка
+    runBenchmarkSuite(options, [&](const BenchResult& r) {
+        cout << left << setw(40) << r.name << right << fixed << setprecision(2);
+        auto it = baseline.find(r.name);
+        bool retry = false;
+        if (it == baseline.end()) {
+            cout << setw(14) << "-" << setw(14) << r.nsPerUpdate << "       new\n";
+        } else {
+            double change = (r.nsPerUpdate / it->second - 1.0) * 100.0;
+            double limit = r.devices < options.shortDevices ? options.shortThreshold : options.threshold;
+            bool regressed = change > limit;
+            retry = regressed && attempts < options.retries;
+            if (!retry) {
+                compared++;
+                matched.insert(r.name);
+                regressions += regressed;
+            }
+            cout << setw(14) << it->second << setw(14) << r.nsPerUpdate << setw(9) << showpos << change
+                 << noshowpos << "%" << (retry ? "  re-measuring" : regressed ? "  REGRESSION" : "") << "\n";
+        }
+        cout.unsetf(ios::floatfield);
+        cout << setprecision(6);
+        attempts = retry ? attempts + 1 : 0;
+        return retry;
+    });
+    vector<string> missing;
+    for (const auto& entry : baseline) {
+        if (!matched.count(entry.first)) {
+            missing.push_back(entry.first);
+        }
+    }
+    sort(missing.begin(), missing.end());
+    for (const string& name : missing) {
+        cout << left << setw(40) << name << right << setw(14) << "-" << setw(14) << "-" << "   missing\n";
     }
+    cout << "========== " << regressions << " of " << compared << " benchmarks regressed ==========\n";
+    if (compared == 0) {
+        cerr << "No benchmark matches the baseline " << options.baselinePath
+             << " (recorded with another PERF_MAX or core count? run make perf-baseline)\n";
+        return 2;
+    }
+    return regressions ? 1 : 0;
 }
 
 /**
- * @brief Тест 3: Рецикл с Mixer
+ * @brief Рассчитать синтетические схемы с профилем и записать его в options.profilePath
+ *
+ * Имеет смысл только в сборке с -DDEVICE_PROFILE (make profile).
  */
-void testRecycleWithMixer() {
-    cout << "\n=== Test: Recycle with Mixer ===\n";
-    streamcounter = 0;
-    
-    try {
-        Mixer mixer(2);
-        Reactor reactor(false);
-        
-        auto s1 = make_shared<Stream>(++streamcounter);
-        auto s2 = make_shared<Stream>(++streamcounter);
-        auto s3 = make_shared<Stream>(++streamcounter);
-        auto s4 = make_shared<Stream>(++streamcounter);
-        
-        s1->setMassFlow(10.0);
-        s2->setMassFlow(5.0);
-        
-        mixer.addInput(s1);
-        mixer.addInput(s2);
-        mixer.addOutput(s3);
-        
-        reactor.addInput(s3);
-        reactor.addOutput(s4);
-        
-        // Рассчитываем mixer
-        mixer.updateOutputs();
-        cout << "Mixer calculated: " << mixer.isCalculated() << endl;
-        
-        // Рассчитываем reactor
-        reactor.updateOutputs();
-        cout << "Reactor calculated: " << reactor.isCalculated() << endl;
-        
-        // Пытаемся повторно рассчитать mixer - рецикл!
-        mixer.updateOutputs();
-        
-        cout << "TEST FAILED: No recycle exception thrown" << endl;
-    } catch (const RecycleException& e) {
-        cout << "TEST PASSED: " << e.what() << endl;
+int runProfile(const BenchOptions& options) {
+#ifndef DEVICE_PROFILE
+    (void)options;
+    cerr << "Profiling is disabled: rebuild with -DDEVICE_PROFILE (make profile)\n";
+    return 1;
+#else
+    size_t devices = min<size_t>(options.maxDevices, 10000);
+    SolveProfiler profiler;
+    void (*const builders[])(Flowsheet&, size_t) = {
+        benchBuildReactorChain, benchBuildMixerTree, benchBuildRecycleLoops, benchBuildTrains};
+    for (auto build : builders) {
+        Flowsheet sheet;
+        build(sheet, devices);
+        sheet.setProfiler(&profiler);
+        sheet.solve();
     }
-}
 
-// ============ ГЛАВНАЯ ФУНКЦИЯ ТЕСТИРОВАНИЯ ============
-void tests() {
-    cout << "========== RUNNING TESTS ==========\n\n";
-    
-    testInputEqualOutput();
-    testTooManyOutputStreams();
-    testTooManyInputStreams();
-    
-    shouldSetOutputsCorrectlyWithOneOutput();
-    shouldCorrectOutputs();
-    shouldCorrectInputs();
-    
-    // НОВЫЕ тесты на рецикл
-    cout << "\n--- RECYCLE DETECTION TESTS ---\n";
-    testRecycleDetectionOnCalculatedDevice();
-    testRecycleWithMultipleDevices();
-    testRecycleWithMixer();
+    ofstream trace(options.profilePath);
+    profiler.writeChromeTrace(trace);
+    if (!trace) {
+        cerr << "Cannot write " << options.profilePath << "\n";
+        return 1;
+    }
 
-    cout << "\n========== TESTS COMPLETE ==========\n";
+    cout << left << setw(16) << "Device type" << right << setw(12) << "calls" << setw(16) << "total ns"
+         << setw(12) << "max ns" << "\n";
+    for (const SolveProfiler::Stats& stats : profiler.getTypeStats()) {
+        cout << left << setw(16) << stats.type << right << setw(12) << stats.calls << setw(16)
+             << stats.totalNs << setw(12) << stats.maxNs << "\n";
+    }
+    cout << "Recycle loops: " << profiler.getLoopCount() << ", iterations: "
+         << profiler.getRecycleIterations() << "\n";
+    cout << "Trace written to " << options.profilePath;
+    if (profiler.getDroppedEvents()) {
+        cout << " (" << profiler.getDroppedEvents() << " events dropped)";
+    }
+    cout << "\n";
+    return 0;
+#endif
 }
 
 // ============ ТОЧКА ВХОДА ============
 /**
  * @brief The entry point of the program.
- * @return 0 on successful execution.
+ *
+ * Without arguments runs the tests; --bench runs the benchmarks instead
+ * (--bench-max=N limits the flowsheet size, --bench-csv prints CSV).
+ * --profile=FILE solves the benchmark flowsheets once with a SolveProfiler
+ * attached and writes a Chrome trace (requires -DDEVICE_PROFILE).
+ * --perf-check=FILE runs the benchmarks against a CSV baseline and fails when
+ * ns/update grows by more than --perf-threshold=PCT (default 15), or by more than
+ * --perf-short-threshold=PCT (default 25) on sheets below 1000 devices; a benchmark
+ * over the threshold is re-measured up to --perf-retries=N times (default 1).
+ * --bench-repeat=N keeps the median of N runs of each benchmark.
+ * @return 0 on successful execution, non-zero when the performance check fails.
  */
-int main()
+int main(int argc, char* argv[])
 {
-    streamcounter = 0;
+    BenchOptions benchOptions;
+    bool bench = false;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--bench") {
+            bench = true;
+        } else if (arg.rfind("--bench-max=", 0) == 0) {
+            benchOptions.maxDevices = stoul(arg.substr(12));
+        } else if (arg == "--bench-csv") {
+            benchOptions.csv = true;
+        } else if (arg.rfind("--bench-repeat=", 0) == 0) {
+            benchOptions.repeats = max(stoi(arg.substr(15)), 1);
+        } else if (arg.rfind("--profile=", 0) == 0) {
+            benchOptions.profilePath = arg.substr(10);
+        } else if (arg.rfind("--perf-check=", 0) == 0) {
+            benchOptions.baselinePath = arg.substr(13);
+        } else if (arg.rfind("--perf-threshold=", 0) == 0) {
+            benchOptions.threshold = stod(arg.substr(17));
+        } else if (arg.rfind("--perf-short-threshold=", 0) == 0) {
+            benchOptions.shortThreshold = stod(arg.substr(23));
+        } else if (arg.rfind("--perf-retries=", 0) == 0) {
+            benchOptions.retries = max(stoi(arg.substr(15)), 0);
+        }
+    }
+    if (!benchOptions.profilePath.empty()) {
+        return runProfile(benchOptions);
+    }
+    if (!benchOptions.baselinePath.empty()) {
+        return runPerfCheck(benchOptions);
+    }
+    if (bench) {
+        return runBenchmarks(benchOptions);
+    }
     tests();
     return 0;
 }
\ No newline at end of file